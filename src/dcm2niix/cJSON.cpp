@@ -72,7 +72,7 @@ typedef struct {
 	const unsigned char *json;
 	size_t position;
 } error;
-static error global_error = {NULL, 0};
+static thread_local error global_error = {NULL, 0};
 
 CJSON_PUBLIC(const char *)
 cJSON_GetErrorPtr(void) {
@@ -95,7 +95,7 @@ cJSON_GetStringValue(const cJSON *const item) {
 
 CJSON_PUBLIC(const char *)
 cJSON_Version(void) {
-	static char version[15];
+	static thread_local char version[15];
 	snprintf(version, sizeof(version), "%i.%i.%i", CJSON_VERSION_MAJOR, CJSON_VERSION_MINOR, CJSON_VERSION_PATCH);
 
 	return version;
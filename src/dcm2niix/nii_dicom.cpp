@@ -13,6 +13,7 @@
 // #define vsnprintf _vsnprintf
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
+#define strtok_r strtok_s
 #ifdef _WIN32
 #pragma comment(lib, "advapi32")
 #endif
@@ -6613,13 +6614,14 @@ struct TDICOMdata readDICOMx(char *fname, struct TDCMprefs *prefs, struct TDTI4D
 			char iceStr[kDICOMStr];
 			dcmStr(lLength, &buffer[lPos], iceStr);
 			int idx = 0;
-			char *pch = strtok(iceStr, "_");
+			char *save = NULL; // strtok_r: headers may be read on several threads at once
+			char *pch = strtok_r(iceStr, "_", &save);
 			char *end;
 			while (pch != NULL) {
 				if (idx == 20)
 					numberOfFramesICEdims = (int)strtol(pch, &end, 10);
 				idx++;
-				pch = strtok(NULL, "_");
+				pch = strtok_r(NULL, "_", &save);
 			}
 			break;
 		}
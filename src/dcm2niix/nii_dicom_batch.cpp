@@ -2696,7 +2696,7 @@ unsigned char *reorderVolumes(struct nifti_1_header *hdr, unsigned char *inImg,
 } // reorderVolumes()
 #endif // naive_reorder_vols
 
-float *bvals; // global variable for cmp_bvals
+static thread_local float *bvals; // per-thread variable for cmp_bvals, so series can be converted on several threads
 int cmp_bvals(const void *a, const void *b) {
 	int ia = *(int *)a;
 	int ib = *(int *)b;
@@ -8352,7 +8352,7 @@ void loadOverlay(char *imgname, unsigned char *img, int offset, int x, int y, in
 	if (sz < imgszRead)
 		printWarning("loadOverlay fread error.");
 	// static unsigned char mask[] = {128, 64, 32, 16, 8, 4, 2, 1};
-	static unsigned char mask[] = {1, 2, 4, 8, 16, 32, 64, 128};
+	static const unsigned char mask[] = {1, 2, 4, 8, 16, 32, 64, 128};
 	for (int i = 0; i < nvox; i++) {
 		int byt = (i >> 3);
 		int bit = (i % 8);
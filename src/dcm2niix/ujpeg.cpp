@@ -326,7 +326,7 @@ typedef struct _nj_ctx {
 	unsigned char *rgb;
 } nj_context_t;
 
-static nj_context_t nj;
+static thread_local nj_context_t nj; // one decoder context per thread, so images can be decoded on several threads at once
 
 static const char njZZ[64] = {0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18,
 							  11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28, 35,
@@ -620,7 +620,7 @@ NJ_INLINE void njDecodeSOF(void) {
 NJ_INLINE void njDecodeDHT(void) {
 	int codelen, currcnt, remain, spread, i, j;
 	nj_vlc_code_t *vlc;
-	static unsigned char counts[16];
+	unsigned char counts[16];
 	njDecodeLength();
 	njCheckError();
 	while (nj.length >= 17) {
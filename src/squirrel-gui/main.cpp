@@ -33,10 +33,11 @@ int main(int argc, char *argv[]) {
     QCoreApplication::setApplicationName("squirrel-gui");
     QCoreApplication::setApplicationVersion(QString("%1.%2.%3").arg(UTIL_VERSION_MAJ).arg(UTIL_VERSION_MIN).arg(UTIL_BUILD_NUM));
 
-    /* guiPackage crosses from the worker thread to the GUI thread through a
-       queued signal, and Qt can only copy it into the event queue if the type is
-       registered first */
+    /* guiPackage and guiSubject cross from the worker thread to the GUI thread
+       through queued signals, and Qt can only copy them into the event queue if
+       the types are registered first */
     qRegisterMetaType<guiPackage>("guiPackage");
+    qRegisterMetaType<guiSubject>("guiSubject");
 
     mainWindow w;
     w.show();
@@ -87,9 +87,11 @@ mainWindow::mainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::mainWi
     connect(this, &mainWindow::RequestOpen, worker, &squirrelWorker::OpenPackage);
     connect(this, &mainWindow::RequestClose, worker, &squirrelWorker::ClosePackage);
     connect(this, &mainWindow::RequestValidate, worker, &squirrelWorker::ValidatePackage);
+    connect(this, &mainWindow::RequestLoadSubject, worker, &squirrelWorker::LoadSubject);
     connect(this, &mainWindow::RequestMerge, worker, &squirrelWorker::MergePackages);
 
     connect(worker, &squirrelWorker::PackageLoaded, this, &mainWindow::PackageLoaded);
+    connect(worker, &squirrelWorker::SubjectLoaded, this, &mainWindow::SubjectLoaded);
     connect(worker, &squirrelWorker::OperationStarted, this, &mainWindow::OperationStarted);
     connect(worker, &squirrelWorker::OperationFinished, this, &mainWindow::OperationFinished);
     connect(worker, &squirrelWorker::LogMessage, this, &mainWindow::AppendLog);
@@ -105,6 +107,7 @@ mainWindow::mainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::mainWi
     connect(ui->actionAbout, &QAction::triggered, this, &mainWindow::About);
     connect(ui->actionAboutQt, &QAction::triggered, qApp, &QApplication::aboutQt);
     connect(ui->objectTree, &QTreeWidget::itemSelectionChanged, this, &mainWindow::TreeSelectionChanged);
+    connect(ui->objectTree, &QTreeWidget::itemExpanded, this, &mainWindow::TreeItemExpanded);
 
     UpdateActionStates();
     statusLabel->setText("Ready");
@@ -211,6 +214,7 @@ void mainWindow::About() {
 void mainWindow::PackageLoaded(guiPackage pkg) {
 
     package = pkg;
+    subjectsRequested.clear();
     PopulateTree(package);
     UpdateActionStates();
 
@@ -221,6 +225,26 @@ void mainWindow::PackageLoaded(guiPackage pkg) {
 }
 
 
+/* ------------------------------------------------------------------------------
+   SubjectLoaded - a subject's studies and series were read; add them to the tree
+   ------------------------------------------------------------------------------ */
+void mainWindow::SubjectLoaded(int subjectIndex, guiSubject subject) {
+
+    /* the package may have been replaced while the worker was reading */
+    if ((subjectIndex < 0) || (subjectIndex >= package.subjects.size()) || (package.subjects.at(subjectIndex).rowID != subject.rowID))
+        return;
+
+    package.subjects[subjectIndex] = subject;
+
+    QTreeWidgetItem *packageItem = ui->objectTree->topLevelItem(0);
+    if ((packageItem == nullptr) || (subjectIndex >= packageItem->childCount()))
+        return;
+
+    PopulateSubjectItem(packageItem->child(subjectIndex), subjectIndex);
+    TreeSelectionChanged();
+}
+
+
 /* ------------------------------------------------------------------------------
    OperationStarted
    ------------------------------------------------------------------------------ */
@@ -277,34 +301,9 @@ void mainWindow::PopulateTree(const guiPackage &pkg) {
         QTreeWidgetItem *subjectItem = new QTreeWidgetItem(packageItem);
         subjectItem->setText(0, subject.id);
         subjectItem->setText(1, subject.enrollmentGroup);
-        subjectItem->setText(2, QString("%1 study(s)").arg(subject.studies.size()));
         subjectItem->setData(0, RoleNodeType, NodeSubject);
         subjectItem->setData(0, RoleSubjectIndex, s);
-
-        for (int t = 0; t < subject.studies.size(); t++) {
-            const guiStudy &study = subject.studies.at(t);
-
-            QTreeWidgetItem *studyItem = new QTreeWidgetItem(subjectItem);
-            studyItem->setText(0, QString("Study %1").arg(study.number));
-            studyItem->setText(1, study.description);
-            studyItem->setText(2, QString("%1, %2 series").arg(study.modality).arg(study.series.size()));
-            studyItem->setData(0, RoleNodeType, NodeStudy);
-            studyItem->setData(0, RoleSubjectIndex, s);
-            studyItem->setData(0, RoleStudyIndex, t);
-
-            for (int r = 0; r < study.series.size(); r++) {
-                const guiSeries &series = study.series.at(r);
-
-                QTreeWidgetItem *seriesItem = new QTreeWidgetItem(studyItem);
-                seriesItem->setText(0, QString("Series %1").arg(series.number));
-                seriesItem->setText(1, series.description.isEmpty() ? series.protocol : series.description);
-                seriesItem->setText(2, QString("%1 file(s), %2").arg(series.fileCount).arg(utils::HumanReadableSize(series.size)));
-                seriesItem->setData(0, RoleNodeType, NodeSeries);
-                seriesItem->setData(0, RoleSubjectIndex, s);
-                seriesItem->setData(0, RoleStudyIndex, t);
-                seriesItem->setData(0, RoleSeriesIndex, r);
-            }
-        }
+        PopulateSubjectItem(subjectItem, s);
     }
 
     /* expand only the package node - a large package has thousands of series
@@ -314,6 +313,69 @@ void mainWindow::PopulateTree(const guiPackage &pkg) {
 }
 
 
+/* ------------------------------------------------------------------------------
+   PopulateSubjectItem - add a subject's studies and series under its tree item
+
+   A subject that hasn't been read yet gets an expand arrow and no children;
+   expanding it asks the worker for the studies (TreeItemExpanded).
+   ------------------------------------------------------------------------------ */
+void mainWindow::PopulateSubjectItem(QTreeWidgetItem *subjectItem, int s) {
+
+    const guiSubject &subject = package.subjects.at(s);
+
+    if (!subject.loaded) {
+        subjectItem->setText(2, "");
+        subjectItem->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
+        return;
+    }
+
+    subjectItem->setText(2, QString("%1 study(s)").arg(subject.studies.size()));
+    subjectItem->setChildIndicatorPolicy(QTreeWidgetItem::DontShowIndicatorWhenChildless);
+
+    for (int t = 0; t < subject.studies.size(); t++) {
+        const guiStudy &study = subject.studies.at(t);
+
+        QTreeWidgetItem *studyItem = new QTreeWidgetItem(subjectItem);
+        studyItem->setText(0, QString("Study %1").arg(study.number));
+        studyItem->setText(1, study.description);
+        studyItem->setText(2, QString("%1, %2 series").arg(study.modality).arg(study.series.size()));
+        studyItem->setData(0, RoleNodeType, NodeStudy);
+        studyItem->setData(0, RoleSubjectIndex, s);
+        studyItem->setData(0, RoleStudyIndex, t);
+
+        for (int r = 0; r < study.series.size(); r++) {
+            const guiSeries &series = study.series.at(r);
+
+            QTreeWidgetItem *seriesItem = new QTreeWidgetItem(studyItem);
+            seriesItem->setText(0, QString("Series %1").arg(series.number));
+            seriesItem->setText(1, series.description.isEmpty() ? series.protocol : series.description);
+            seriesItem->setText(2, QString("%1 file(s), %2").arg(series.fileCount).arg(utils::HumanReadableSize(series.size)));
+            seriesItem->setData(0, RoleNodeType, NodeSeries);
+            seriesItem->setData(0, RoleSubjectIndex, s);
+            seriesItem->setData(0, RoleStudyIndex, t);
+            seriesItem->setData(0, RoleSeriesIndex, r);
+        }
+    }
+}
+
+
+/* ------------------------------------------------------------------------------
+   TreeItemExpanded - read a subject's studies the first time it is expanded
+   ------------------------------------------------------------------------------ */
+void mainWindow::TreeItemExpanded(QTreeWidgetItem *item) {
+
+    if ((item == nullptr) || (item->data(0, RoleNodeType).toInt() != NodeSubject))
+        return;
+
+    int s = item->data(0, RoleSubjectIndex).toInt();
+    if ((s < 0) || (s >= package.subjects.size()) || package.subjects.at(s).loaded || subjectsRequested.contains(s))
+        return;
+
+    subjectsRequested.insert(s);
+    emit RequestLoadSubject(s, package.subjects.at(s).rowID);
+}
+
+
 /* ------------------------------------------------------------------------------
    TreeSelectionChanged - show the selected object in the details pane
    ------------------------------------------------------------------------------ */
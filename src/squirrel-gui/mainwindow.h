@@ -24,6 +24,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QSet>
 #include <QStringList>
 #include "squirrelModel.h"
 
@@ -51,6 +52,7 @@ signals:
     void RequestOpen(QString packagePath);
     void RequestClose();
     void RequestValidate();
+    void RequestLoadSubject(int subjectIndex, qint64 subjectRowID);
     void RequestMerge(QStringList inputPaths, QString outputPath, bool testOnly, bool renumberSubjects, int digits);
 
 private slots:
@@ -63,15 +65,18 @@ private slots:
 
     /* worker responses */
     void PackageLoaded(guiPackage pkg);
+    void SubjectLoaded(int subjectIndex, guiSubject subject);
     void OperationStarted(QString description);
     void OperationFinished(bool success, QString message);
     void AppendLog(QString message);
 
     /* tree -> details pane */
     void TreeSelectionChanged();
+    void TreeItemExpanded(QTreeWidgetItem *item);
 
 private:
     void PopulateTree(const guiPackage &pkg);
+    void PopulateSubjectItem(QTreeWidgetItem *subjectItem, int s);
     void ShowDetails(const QVector<guiDetail> &details);
     void SetBusy(bool busy, const QString &description = QString());
     void UpdateActionStates();
@@ -88,6 +93,9 @@ private:
        squirrel object; this is display data only */
     guiPackage package;
 
+    /* indexes of subjects whose studies have been requested from the worker */
+    QSet<int> subjectsRequested;
+
     bool busy = false;
 };
 
@@ -67,7 +67,7 @@ QVector<guiDetail> guiSubject::details() const {
     Add(d, "Enrollment group", enrollmentGroup);
     if (dateOfBirth.isValid())
         Add(d, "Date of birth", dateOfBirth.toString("yyyy-MM-dd"));
-    Add(d, "Studies", QString::number(studies.size()));
+    Add(d, "Studies", loaded ? QString::number(studies.size()) : "(expand to load)");
     return d;
 }
 
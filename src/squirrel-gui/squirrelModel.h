@@ -83,6 +83,10 @@ struct guiSubject {
     QDate dateOfBirth;
     QList<guiStudy> studies;
 
+    /* packages are opened in lazy mode, so a subject's studies are only read
+       when its tree node is first expanded (see squirrelWorker::LoadSubject) */
+    bool loaded = false;
+
     QVector<guiDetail> details() const;
 };
 
@@ -113,6 +117,7 @@ struct guiPackage {
     QVector<guiDetail> details() const;
 };
 
+Q_DECLARE_METATYPE(guiSubject)
 Q_DECLARE_METATYPE(guiPackage)
 
 #endif // SQUIRRELMODEL_H
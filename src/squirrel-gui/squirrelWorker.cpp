@@ -77,10 +77,11 @@ void squirrelWorker::OpenPackage(QString packagePath) {
     sqrl->SetPackagePath(packagePath);
     sqrl->SetFileMode(FileMode::ExistingPackage);
 
-    /* QuickRead skips reading the file lists inside the archive. It is the
-       difference between a package opening in seconds and in minutes; the GUI
-       shows counts from the database instead. */
-    sqrl->SetQuickRead(true);
+    /* lazy mode reads only the package and the subject list. A subject's studies
+       and series, with their params and file lists, are read when its tree node
+       is expanded (LoadSubject), so opening a package doesn't pay to read all
+       of it. The package totals come from the package header */
+    sqrl->SetReadMode(ReadMode::Lazy);
     sqrl->Read();
 
     DrainLog();
@@ -144,6 +145,28 @@ void squirrelWorker::ValidatePackage() {
 }
 
 
+/* ------------------------------------------------------------------------------
+   LoadSubject - read one subject's studies and series, on first expansion in
+   the tree
+   ------------------------------------------------------------------------------ */
+void squirrelWorker::LoadSubject(int subjectIndex, qint64 subjectRowID) {
+
+    if (sqrl == nullptr) {
+        emit OperationFinished(false, "No package is open");
+        return;
+    }
+
+    squirrelSubject subject = sqrl->GetSubject(subjectRowID);
+    emit OperationStarted(QString("Reading subject %1 ...").arg(subject.ID));
+
+    guiSubject gsubject = BuildSubjectSnapshot(subject, true);
+    DrainLog();
+
+    emit SubjectLoaded(subjectIndex, gsubject);
+    emit OperationFinished(true, QString("Read subject %1 (%2 study(s))").arg(gsubject.id).arg(gsubject.studies.size()));
+}
+
+
 /* ------------------------------------------------------------------------------
    MergePackages - the same modify::MergePackages() the command line 'squirrel
    merge' calls
@@ -200,51 +223,64 @@ guiPackage squirrelWorker::BuildSnapshot() {
     pkg.groupAnalysisCount = sqrl->GetObjectCount(ObjectType::GroupAnalysis);
     pkg.dataDictionaryCount = sqrl->GetObjectCount(ObjectType::DataDictionary);
 
+    /* subjects only. Their studies are read by LoadSubject() */
     QList<squirrelSubject> subjects = sqrl->GetSubjectList();
-    for (squirrelSubject &subject : subjects) {
-
-        guiSubject gsubject;
-        gsubject.rowID = subject.GetObjectID();
-        gsubject.id = subject.ID;
-        gsubject.sex = subject.Sex;
-        gsubject.gender = subject.Gender;
-        gsubject.enrollmentGroup = subject.EnrollmentGroup;
-        gsubject.dateOfBirth = subject.DateOfBirth;
-
-        QList<squirrelStudy> studies = sqrl->GetStudyList(gsubject.rowID);
-        for (squirrelStudy &study : studies) {
-
-            guiStudy gstudy;
-            gstudy.rowID = study.GetObjectID();
-            gstudy.number = study.StudyNumber;
-            gstudy.description = study.Description;
-            gstudy.modality = study.Modality;
-            gstudy.equipment = study.Equipment;
-            gstudy.visitType = study.VisitType;
-            gstudy.dateTime = study.DateTime;
-            gstudy.ageAtStudy = study.AgeAtStudy;
-            gstudy.analysisCount = sqrl->GetAnalysisList(gstudy.rowID).size();
-
-            QList<squirrelSeries> seriesList = sqrl->GetSeriesList(gstudy.rowID);
-            for (squirrelSeries &series : seriesList) {
-
-                guiSeries gseries;
-                gseries.rowID = series.GetObjectID();
-                gseries.number = series.SeriesNumber;
-                gseries.description = series.Description;
-                gseries.protocol = series.Protocol;
-                gseries.dateTime = series.DateTime;
-                gseries.fileCount = series.FileCount;
-                gseries.size = series.Size;
-
-                gstudy.series.append(gseries);
-            }
-
-            gsubject.studies.append(gstudy);
+    for (squirrelSubject &subject : subjects)
+        pkg.subjects.append(BuildSubjectSnapshot(subject, false));
+
+    return pkg;
+}
+
+
+/* ------------------------------------------------------------------------------
+   BuildSubjectSnapshot - copy one subject, and optionally its studies and
+   series, out of the library objects
+   ------------------------------------------------------------------------------ */
+guiSubject squirrelWorker::BuildSubjectSnapshot(squirrelSubject &subject, bool withStudies) {
+
+    guiSubject gsubject;
+    gsubject.rowID = subject.GetObjectID();
+    gsubject.id = subject.ID;
+    gsubject.sex = subject.Sex;
+    gsubject.gender = subject.Gender;
+    gsubject.enrollmentGroup = subject.EnrollmentGroup;
+    gsubject.dateOfBirth = subject.DateOfBirth;
+
+    if (!withStudies)
+        return gsubject;
+
+    gsubject.loaded = true;
+    QList<squirrelStudy> studies = sqrl->GetStudyList(gsubject.rowID);
+    for (squirrelStudy &study : studies) {
+
+        guiStudy gstudy;
+        gstudy.rowID = study.GetObjectID();
+        gstudy.number = study.StudyNumber;
+        gstudy.description = study.Description;
+        gstudy.modality = study.Modality;
+        gstudy.equipment = study.Equipment;
+        gstudy.visitType = study.VisitType;
+        gstudy.dateTime = study.DateTime;
+        gstudy.ageAtStudy = study.AgeAtStudy;
+        gstudy.analysisCount = sqrl->GetAnalysisList(gstudy.rowID).size();
+
+        QList<squirrelSeries> seriesList = sqrl->GetSeriesList(gstudy.rowID);
+        for (squirrelSeries &series : seriesList) {
+
+            guiSeries gseries;
+            gseries.rowID = series.GetObjectID();
+            gseries.number = series.SeriesNumber;
+            gseries.description = series.Description;
+            gseries.protocol = series.Protocol;
+            gseries.dateTime = series.DateTime;
+            gseries.fileCount = series.FileCount;
+            gseries.size = series.Size;
+
+            gstudy.series.append(gseries);
         }
 
-        pkg.subjects.append(gsubject);
+        gsubject.studies.append(gstudy);
     }
 
-    return pkg;
+    return gsubject;
 }
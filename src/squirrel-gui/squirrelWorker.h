@@ -28,6 +28,7 @@
 #include "squirrelModel.h"
 
 class squirrel;
+class squirrelSubject;
 
 /* ------------------------------------------------------------------------------
    squirrelWorker
@@ -60,6 +61,7 @@ public slots:
     void OpenPackage(QString packagePath);
     void ClosePackage();
     void ValidatePackage();
+    void LoadSubject(int subjectIndex, qint64 subjectRowID);
     void MergePackages(QStringList inputPaths, QString outputPath, bool testOnly, bool renumberSubjects, int digits);
 
 signals:
@@ -70,12 +72,16 @@ signals:
     /* a package finished loading. pkg.isOpen is false if nothing is open */
     void PackageLoaded(guiPackage pkg);
 
+    /* a subject's studies and series were read. subjectIndex is its position in guiPackage::subjects */
+    void SubjectLoaded(int subjectIndex, guiSubject subject);
+
     /* text destined for the log pane */
     void LogMessage(QString message);
 
 private:
     /* walks the open package and fills in a snapshot for the GUI thread */
     guiPackage BuildSnapshot();
+    guiSubject BuildSubjectSnapshot(squirrelSubject &subject, bool withStudies);
 
     /* drains the library's internal log buffer into LogMessage() */
     void DrainLog();
@@ -49,10 +49,12 @@ convert::convert()
  * @param debug enable debug logging
  * @param debugSQL enable SQL statement logging
  * @param quiet suppress output
+ * @param threads number of threads reading DICOM headers, and series staged concurrently when writing. 0 uses one per core
+ * @param cacheDir DICOM ingest cache directory. Files unchanged since an earlier conversion of the same directory are not read again. Empty disables the cache
  * @param m output message describing failure
  * @return true if successful
  */
-bool convert::DoConvert(QString inputPath, QString outputPath, QString inputFormat, QString outputFormat, QString dataFormat, QString dirFormat, bool overwrite, bool debug, bool debugSQL, bool quiet, QString &m) {
+bool convert::DoConvert(QString inputPath, QString outputPath, QString inputFormat, QString outputFormat, QString dataFormat, QString dirFormat, bool overwrite, bool debug, bool debugSQL, bool quiet, int threads, QString cacheDir, QString &m) {
 
     inputFormat = inputFormat.trimmed().toLower();
     outputFormat = outputFormat.trimmed().toLower();
@@ -87,6 +89,7 @@ bool convert::DoConvert(QString inputPath, QString outputPath, QString inputForm
     sqrl->SetCommandLineExecution(true);
     sqrl->SetDebugSQL(debugSQL);
     sqrl->SetOverwritePackage(overwrite);
+    sqrl->SetWriteThreads(threads);
 
     /* apply the output directory format, if specified */
     if (dirFormat != "") {
@@ -101,6 +104,8 @@ bool convert::DoConvert(QString inputPath, QString outputPath, QString inputForm
             sqrl->DataFormat = dataFormat;
 
         dicom *dcm = new dicom();
+        dcm->SetThreads(threads);
+        dcm->SetCacheDir(cacheDir);
         dcm->LoadToSquirrel(inputPath, sqrl);
         delete dcm;
     }
@@ -35,7 +35,7 @@ class convert
 public:
     convert();
 
-    bool DoConvert(QString inputPath, QString outputPath, QString inputFormat, QString outputFormat, QString dataFormat, QString dirFormat, bool overwrite, bool debug, bool debugSQL, bool quiet, QString &m);
+    bool DoConvert(QString inputPath, QString outputPath, QString inputFormat, QString outputFormat, QString dataFormat, QString dirFormat, bool overwrite, bool debug, bool debugSQL, bool quiet, int threads, QString cacheDir, QString &m);
 };
 
 #endif // CONVERT_H
@@ -21,6 +21,147 @@
   ------------------------------------------------------------------------------ */
 
 #include "dicom.h"
+#include "squirrelVersion.h"
+#include <QThreadPool>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <future>
+#include <memory>
+#ifdef Q_OS_LINUX
+#include <sys/stat.h>
+#endif
+
+
+/* ----- the DICOM files found by one scan worker, grouped by PatientID, StudyInstanceUID, SeriesInstanceUID ----- */
+struct dicomScanResult {
+    QMap<QString, QMap<QString, QMap<QString, dicomSeriesScan> > > dcms;
+    QHash<QString, dicomFileRecord> records; /* files that were read, to be saved in the ingest cache */
+    qint64 foundFileCount = 0;
+    qint64 cachedFileCount = 0;
+};
+
+/* ----- size, modification time, and inode of a file. false if the file can't be stat'ed ----- */
+static bool StatFile(const QString &path, dicomFileRecord &rec) {
+#ifdef Q_OS_LINUX
+    struct stat st;
+    if (::stat(QFile::encodeName(path).constData(), &st) != 0)
+        return false;
+    rec.size = static_cast<qint64>(st.st_size);
+    rec.modified = static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000LL + static_cast<qint64>(st.st_mtim.tv_nsec);
+    rec.inode = static_cast<qint64>(st.st_ino);
+#else
+    QFileInfo fi(path);
+    if (!fi.exists())
+        return false;
+    rec.size = fi.size();
+    rec.modified = fi.lastModified().toMSecsSinceEpoch() * 1000000LL;
+    rec.inode = 0;
+#endif
+    return true;
+}
+
+/* ----- tags to and from the JSON stored in the ingest cache. Only the series params left by AnonymizeParams(),
+   and the few identifying tags that LoadToSquirrel() copies into the subject, study, and series, are stored. A
+   series created from the cache gets the same objects and params as one created from the file ----- */
+static QByteArray TagsToJson(const QHash<QString, QString> &tags) {
+    static const QStringList creationTags = { "PatientBirthDate", "StudyDateTime", "StudyDescription", "SeriesDateTime" };
+    QHash<QString, QString> stored = utils::AnonymizeParams(tags);
+    for (const QString &tag : creationTags) {
+        if (tags.contains(tag))
+            stored[tag] = tags.value(tag);
+    }
+
+    QJsonObject json;
+    for (auto i = stored.constBegin(); i != stored.constEnd(); ++i)
+        json[i.key()] = i.value();
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+static QHash<QString, QString> TagsFromJson(const QByteArray &bytes) {
+    QHash<QString, QString> tags;
+    QJsonObject json = QJsonDocument::fromJson(bytes).object();
+    for (auto i = json.constBegin(); i != json.constEnd(); ++i)
+        tags[i.key()] = i.value().toString();
+    return tags;
+}
+
+/* ----- read the grouping tags and size of files [begin, end), in order. Each worker has its own
+   squirrelImageIO. A file is only parsed up to its SeriesInstanceUID. The first file of each series in the
+   chunk also gets every tag, including the Siemens CSA header, so series creation needs no more file I/O. A file that DCMTK can't
+   read gets the full GetImageFileTags(), which tries the other readers. If there is an ingest cache, a file
+   whose size, modification time, and inode match its cached record is not read, unless it is the first of
+   its series and the cache doesn't have its tags ----- */
+static dicomScanResult ScanFiles(const QStringList &files, qsizetype begin, qsizetype end, const QHash<QString, dicomFileRecord> *cached) {
+    dicomScanResult r;
+    squirrelImageIO img;
+    auto newSeries = [&r](const QHash<QString, QString> &t) {
+        auto a = r.dcms.constFind(t["PatientID"]);
+        if (a == r.dcms.constEnd()) return true;
+        auto b = a.value().constFind(t["StudyInstanceUID"]);
+        if (b == a.value().constEnd()) return true;
+        return !b.value().contains(t["SeriesInstanceUID"]);
+    };
+    for (qsizetype i=begin; i<end; i++) {
+        const QString &f = files.at(i);
+        dicomFileRecord rec;
+        if (!StatFile(f, rec))
+            continue;
+
+        QHash<QString, QString> tags;
+        bool ok = false;
+        bool read = true;
+        if (cached) {
+            auto c = cached->constFind(f);
+            if ((c != cached->constEnd()) && (c->size == rec.size) && (c->modified == rec.modified) && (c->inode == rec.inode)) {
+                tags["FileType"] = c->fileType;
+                tags["PatientID"] = c->patientID;
+                tags["StudyInstanceUID"] = c->studyUID;
+                tags["SeriesInstanceUID"] = c->seriesUID;
+                if ((c->fileType != "DICOM") || !newSeries(tags))
+                    read = false;
+                else if (!c->tags.isEmpty()) {
+                    /* the cached tags are anonymized, so the grouping tags come from the record */
+                    tags = TagsFromJson(c->tags);
+                    tags["FileType"] = c->fileType;
+                    tags["PatientID"] = c->patientID;
+                    tags["StudyInstanceUID"] = c->studyUID;
+                    tags["SeriesInstanceUID"] = c->seriesUID;
+                    read = false;
+                }
+                ok = !c->fileType.isEmpty();
+                if (!read)
+                    r.cachedFileCount++;
+            }
+        }
+
+        if (read) {
+            QString m;
+            tags.clear();
+            ok = img.GetDicomGroupingTags(f, tags, newSeries) || img.GetImageFileTags(f, tags, m);
+            if (cached) {
+                rec.fileType = ok ? tags["FileType"] : "";
+                if (rec.fileType == "DICOM") {
+                    rec.patientID = tags["PatientID"];
+                    rec.studyUID = tags["StudyInstanceUID"];
+                    rec.seriesUID = tags["SeriesInstanceUID"];
+                    if (newSeries(tags))
+                        rec.tags = TagsToJson(tags);
+                }
+                r.records.insert(f, rec);
+            }
+        }
+
+        if (ok && (tags["FileType"] == "DICOM")) {
+            r.foundFileCount++;
+            dicomSeriesScan &series = r.dcms[tags["PatientID"]][tags["StudyInstanceUID"]][tags["SeriesInstanceUID"]];
+            if (series.files.isEmpty())
+                series.tags = tags;
+            series.files.append(f);
+            series.size += rec.size;
+        }
+    }
+    return r;
+}
 
 
 /* ---------------------------------------------------------------------------- */
@@ -31,6 +172,8 @@
  */
 dicom::dicom()
 {
+    numFiles = 0;
+    threads = 0;
 }
 
 
@@ -55,63 +198,101 @@ bool dicom::LoadToSquirrel(QString dir, squirrel *sqrl) {
         return false;
     }
 
-    squirrelImageIO *img = new squirrelImageIO();
-
     /* find all files in the directory. DICOM files can have any extension, not just .dcm
      * so we need to check if all files to see if they are readable by gdcm */
     qint64 processedFileCount(0);
     qint64 foundFileCount(0);
-    QString m;
     QStringList files = utils::FindAllFiles(dir, "*", true);
     numFiles = files.size();
-    foreach (QString f, files) {
-        processedFileCount++;
 
-        if (processedFileCount%1000 == 0) {
+    /* files that haven't changed since an earlier load of this directory are taken from the ingest cache */
+    QHash<QString, dicomFileRecord> cached;
+    bool useCache = false;
+    if (!cacheDir.isEmpty()) {
+        QString m;
+        useCache = OpenIngestCache(dir, cached, m);
+        sqrl->Log(m);
+    }
+    const QHash<QString, dicomFileRecord> *cachedPtr = useCache ? &cached : nullptr;
+    QHash<QString, dicomFileRecord> changed;
+    qint64 cachedFileCount(0);
+
+    /* the headers are read by a pool of workers, each on a contiguous chunk of the file list. The chunks
+       are merged in order, so every series lists its files in the same order as a serial scan */
+    QThreadPool scanPool;
+    scanPool.setMaxThreadCount((threads > 0) ? threads : QThread::idealThreadCount());
+    const qsizetype chunkSize = qBound<qsizetype>(1, files.size() / (scanPool.maxThreadCount() * 4), 1000);
+    std::vector<std::future<dicomScanResult>> chunks;
+    for (qsizetype begin=0; begin<files.size(); begin+=chunkSize) {
+        qsizetype end = qMin(begin + chunkSize, files.size());
+        auto task = std::make_shared<std::packaged_task<dicomScanResult()>>([&files, begin, end, cachedPtr]() { return ScanFiles(files, begin, end, cachedPtr); });
+        chunks.push_back(task->get_future());
+        scanPool.start([task]() { (*task)(); });
+    }
+    for (qsizetype i=0; i<static_cast<qsizetype>(chunks.size()); i++) {
+        dicomScanResult r = chunks[static_cast<size_t>(i)].get();
+        for (auto a = r.dcms.constBegin(); a != r.dcms.constEnd(); ++a)
+            for (auto b = a.value().constBegin(); b != a.value().constEnd(); ++b)
+                for (auto c = b.value().constBegin(); c != b.value().constEnd(); ++c) {
+                    dicomSeriesScan &series = dcms[a.key()][b.key()][c.key()];
+                    if (series.files.isEmpty())
+                        series.tags = c.value().tags;
+                    series.files.append(c.value().files);
+                    series.size += c.value().size;
+                }
+        foundFileCount += r.foundFileCount;
+        cachedFileCount += r.cachedFileCount;
+        changed.insert(r.records);
+
+        qint64 previousCount = processedFileCount;
+        processedFileCount = qMin((i + 1) * chunkSize, files.size());
+        if (processedFileCount/1000 > previousCount/1000) {
             double percent = static_cast<double>(processedFileCount)/static_cast<double>(numFiles) * 100.0;
             sqrl->Log(QString("Processed %1 of %2 files [%3%%]").arg(processedFileCount).arg(numFiles).arg(percent));
         }
+    }
+    scanPool.waitForDone();
 
-        QHash<QString, QString> tags;
-        //if (img->GetImageFileTags(f, binpath, false, tags, m)) {
-        if (img->GetImageFileTags(f, tags, m)) {
-            if (tags["FileType"] == "DICOM") {
-                foundFileCount++;
-                dcms[tags["PatientID"]][tags["StudyInstanceUID"]][tags["SeriesInstanceUID"]].append(f);
-            }
+    /* save the files that were read, and drop the ones that are gone */
+    if (useCache) {
+        QSet<QString> present(files.constBegin(), files.constEnd());
+        QStringList removed;
+        for (auto i = cached.constBegin(); i != cached.constEnd(); ++i) {
+            if (!present.contains(i.key()))
+                removed.append(i.key());
         }
+        QString m;
+        UpdateIngestCache(changed, removed, m);
+        sqrl->Log(m);
+        sqrl->Log(QString("Read %1 of %2 files. %3 unchanged files were taken from the ingest cache").arg(changed.size()).arg(numFiles).arg(cachedFileCount));
     }
     sqrl->Log(QString("Found %1 subjects in %2 files").arg(dcms.size()).arg(foundFileCount));
 
     if (foundFileCount > 0) {
         /* ---------- iterate through the subjects ---------- */
-        for(QMap<QString, QMap<QString, QMap<QString, QStringList> > >::iterator a = dcms.begin(); a != dcms.end(); ++a) {
+        for(QMap<QString, QMap<QString, QMap<QString, dicomSeriesScan> > >::iterator a = dcms.begin(); a != dcms.end(); ++a) {
             QString subjectID = a.key();
 
             /* create a subject */
             squirrelSubject currSubject(sqrl->GetDatabaseUUID());
             /* ---------- iterate through the studies ---------- */
-            for(QMap<QString, QMap<QString, QStringList> >::iterator b = dcms[subjectID].begin(); b != dcms[subjectID].end(); ++b) {
+            for(QMap<QString, QMap<QString, dicomSeriesScan> >::iterator b = dcms[subjectID].begin(); b != dcms[subjectID].end(); ++b) {
                 QString studyID = b.key();
 
                 /* create a study */
                 squirrelStudy currStudy(sqrl->GetDatabaseUUID());
                 /* ---------- iterate through the series ---------- */
-                for(QMap<QString, QStringList>::iterator c = dcms[subjectID][studyID].begin(); c != dcms[subjectID][studyID].end(); ++c) {
+                for(QMap<QString, dicomSeriesScan>::iterator c = dcms[subjectID][studyID].begin(); c != dcms[subjectID][studyID].end(); ++c) {
                     QString seriesID = c.key();
 
-                    QStringList files = dcms[subjectID][studyID][seriesID];
+                    /* the tags of the first file and the series size were read by the scan */
+                    const dicomSeriesScan &series = c.value();
+                    QStringList files = series.files;
                     qint64 numfiles = files.size();
-
-                    QHash<QString, QString> tags;
-                    QString m;
-                    if (!img->GetImageFileTags(files[0], tags, m)) {
-                        sqrl->Log(QString("Warning: could not read tags from [%1]: %2").arg(files[0]).arg(m));
-                        continue;
-                    }
+                    QHash<QString, QString> tags = series.tags;
 
                     /* create/update the subject — use the outer-loop key (subjectID) for lookup
-                     * so subject identity is stable even if tag re-read returns a different value */
+                     * so subject identity is stable even if the first file of the series has a different value */
                     qint64 subjectRowID;
                     subjectRowID = sqrl->FindSubject(subjectID);
                     if (subjectRowID < 0) {
@@ -155,12 +336,7 @@ bool dicom::LoadToSquirrel(QString dir, squirrel *sqrl) {
                     currSeries.SeriesUID = tags["SeriesInstanceUID"];
                     currSeries.stagedFiles = files;
 
-                    qint64 totalSize(0);
-                    foreach (QString f, files) {
-                        QFileInfo fi(f);
-                        totalSize += fi.size();
-                    }
-                    currSeries.Size = totalSize;
+                    currSeries.Size = series.size;
                     currSeries.studyRowID = studyRowID;
                     currSeries.params = tags;
                     currSeries.AnonymizeParams();
@@ -174,7 +350,178 @@ bool dicom::LoadToSquirrel(QString dir, squirrel *sqrl) {
         }
     }
 
-    delete img;
+    return true;
+}
+
 
+/* ---------------------------------------------------------------------------- */
+/* ----- OpenIngestCache ------------------------------------------------------ */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Open the ingest cache of a directory, and read the records of the files found by the last load
+ * @param dir the directory being loaded
+ * @param records the cached records, by file path
+ * @param m output message
+ * @return true if the cache is open, false otherwise
+ *
+ * Each loaded directory has its own SQLite file in the cache directory, named
+ * by a hash of the directory's absolute path. A cache written by a different
+ * build of squirrel is emptied, since the readers may have changed. The file
+ * holds the PatientID and a few other identifying tags of every series, so it
+ * is only readable and writable by its owner.
+ */
+bool dicom::OpenIngestCache(QString dir, QHash<QString, dicomFileRecord> &records, QString &m) {
+    records.clear();
+    if (!QDir().mkpath(cacheDir)) {
+        m = QString("Unable to create ingest cache directory [%1]").arg(cacheDir);
+        return false;
+    }
+
+    QByteArray pathHash = QCryptographicHash::hash(QFileInfo(dir).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    QString cachePath = QString("%1/ingest-%2.sqlite").arg(cacheDir).arg(QString(pathHash.toHex()));
+
+    /* SQLite creates its journal with the permissions of the database file */
+    QFile cacheFile(cachePath);
+    if (!cacheFile.exists() && !cacheFile.open(QIODevice::WriteOnly)) {
+        m = QString("Unable to create ingest cache [%1]. Error [%2]").arg(cachePath).arg(cacheFile.errorString());
+        return false;
+    }
+    cacheFile.close();
+    if (!cacheFile.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner)) {
+        m = QString("Unable to make ingest cache [%1] private. Error [%2]").arg(cachePath).arg(cacheFile.errorString());
+        return false;
+    }
+
+    cacheConnection = QUuid::createUuid().toString(QUuid::WithoutBraces);
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", cacheConnection);
+    db.setDatabaseName(cachePath);
+    if (!db.open()) {
+        m = QString("Unable to open ingest cache [%1]. Error [%2]").arg(cachePath).arg(db.lastError().text());
+        db = QSqlDatabase();
+        CloseIngestCache();
+        return false;
+    }
+
+    QSqlQuery q(db);
+    bool ok = true;
+    QStringList schema;
+    schema << "pragma secure_delete = on"; /* records that are replaced or removed are overwritten, not left in free pages */
+    schema << "create table if not exists CacheInfo (Name text primary key, Value text)";
+    schema << "create table if not exists IngestFiles (Path text primary key, Size integer, Modified integer, Inode integer, FileType text, PatientID text, StudyInstanceUID text, SeriesInstanceUID text, Tags blob)";
+    for (const QString &sql : schema) {
+        q.prepare(sql);
+        ok = ok && utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+    }
+
+    /* the suffix is the version of the stored tags. Version 2 keeps only the tags in TagsToJson() */
+    QString build = QString("%1.%2.%3-tags2").arg(UTIL_VERSION_MAJ).arg(UTIL_VERSION_MIN).arg(UTIL_BUILD_NUM);
+    QString cacheBuild;
+    q.prepare("select Value from CacheInfo where Name = 'LibraryBuild'");
+    if (ok && utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__) && q.next())
+        cacheBuild = q.value("Value").toString();
+    if (ok && (cacheBuild != build)) {
+        q.prepare("delete from IngestFiles");
+        ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        q.prepare("insert or replace into CacheInfo (Name, Value) values ('LibraryBuild', :build)");
+        q.bindValue(":build", build);
+        ok = ok && utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+    }
+
+    if (ok) {
+        q.setForwardOnly(true);
+        q.prepare("select Path, Size, Modified, Inode, FileType, PatientID, StudyInstanceUID, SeriesInstanceUID, Tags from IngestFiles");
+        ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        while (ok && q.next()) {
+            dicomFileRecord rec;
+            rec.size = q.value(1).toLongLong();
+            rec.modified = q.value(2).toLongLong();
+            rec.inode = q.value(3).toLongLong();
+            rec.fileType = q.value(4).toString();
+            rec.patientID = q.value(5).toString();
+            rec.studyUID = q.value(6).toString();
+            rec.seriesUID = q.value(7).toString();
+            rec.tags = q.value(8).toByteArray();
+            records.insert(q.value(0).toString(), rec);
+        }
+    }
+
+    if (!ok) {
+        m = QString("Unable to read ingest cache [%1]. Error [%2]").arg(cachePath).arg(db.lastError().text());
+        records.clear();
+        q = QSqlQuery();
+        db = QSqlDatabase();
+        CloseIngestCache();
+        return false;
+    }
+
+    m = QString("Read %1 file records from ingest cache [%2]").arg(records.size()).arg(cachePath);
     return true;
 }
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- UpdateIngestCache ---------------------------------------------------- */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Save the records of the files that were read, remove the records of files that are gone, and close the ingest cache
+ * @param changed records of the files that were read by this load, by file path
+ * @param removed paths of cached files that were not found by this load
+ * @param m output message
+ * @return true if successful
+ */
+bool dicom::UpdateIngestCache(const QHash<QString, dicomFileRecord> &changed, const QStringList &removed, QString &m) {
+    bool ok;
+    {
+        QSqlDatabase db = QSqlDatabase::database(cacheConnection);
+        QSqlQuery q(db);
+        ok = db.transaction();
+        q.prepare("insert or replace into IngestFiles (Path, Size, Modified, Inode, FileType, PatientID, StudyInstanceUID, SeriesInstanceUID, Tags) values (:path, :size, :modified, :inode, :filetype, :patientid, :studyuid, :seriesuid, :tags)");
+        for (auto i = changed.constBegin(); ok && (i != changed.constEnd()); ++i) {
+            q.bindValue(":path", i.key());
+            q.bindValue(":size", i.value().size);
+            q.bindValue(":modified", i.value().modified);
+            q.bindValue(":inode", i.value().inode);
+            q.bindValue(":filetype", i.value().fileType);
+            q.bindValue(":patientid", i.value().patientID);
+            q.bindValue(":studyuid", i.value().studyUID);
+            q.bindValue(":seriesuid", i.value().seriesUID);
+            q.bindValue(":tags", i.value().tags);
+            ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        }
+        q.prepare("delete from IngestFiles where Path = :path");
+        for (qsizetype i=0; ok && (i<removed.size()); i++) {
+            q.bindValue(":path", removed.at(i));
+            ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        }
+        if (ok)
+            ok = db.commit();
+
+        if (ok)
+            m = QString("Saved %1 and removed %2 file records in ingest cache [%3]").arg(changed.size()).arg(removed.size()).arg(db.databaseName());
+        else {
+            m = QString("Unable to update ingest cache [%1]. Error [%2]").arg(db.databaseName()).arg(db.lastError().text());
+            db.rollback();
+        }
+    }
+    CloseIngestCache();
+    return ok;
+}
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- CloseIngestCache ----------------------------------------------------- */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Close the ingest cache's database connection, if it is open
+ */
+void dicom::CloseIngestCache() {
+    if (cacheConnection.isEmpty())
+        return;
+    {
+        QSqlDatabase db = QSqlDatabase::database(cacheConnection, false);
+        if (db.isOpen())
+            db.close();
+    }
+    QSqlDatabase::removeDatabase(cacheConnection);
+    cacheConnection.clear();
+}
@@ -28,6 +28,25 @@
 #include "squirrelImageIO.h"
 #include "squirrel.h"
 
+/* the files of one series found by dicom::LoadToSquirrel(), and what the scan read from them */
+struct dicomSeriesScan {
+    QStringList files;              /* the files, in scan order */
+    qint64 size = 0;                /* total size of the files in bytes */
+    QHash<QString, QString> tags;   /* every tag of files[0], as GetImageFileTags() returns them */
+};
+
+/* what the scan found in one file. Kept in the ingest cache, so an unchanged file isn't read again */
+struct dicomFileRecord {
+    qint64 size = -1;               /* file size in bytes */
+    qint64 modified = 0;            /* modification time in nanoseconds since the epoch */
+    qint64 inode = 0;               /* inode number. 0 where it is not available */
+    QString fileType;               /* FileType found by the readers. Empty if no reader could read the file */
+    QString patientID;              /* the grouping tags, if the file is DICOM */
+    QString studyUID;
+    QString seriesUID;
+    QByteArray tags;                /* the tags series creation needs, as JSON, if the file was the first of its series when it was read. Empty otherwise */
+};
+
 class dicom
 {
 public:
@@ -36,10 +55,19 @@ public:
     bool LoadToSquirrel(QString dir, squirrel *sqrl);
 
     qint64 FileCount() { return numFiles; }
+    void SetThreads(int t) { threads = t; } /*!< Set the number of threads that read the DICOM headers. 0 uses one per core */
+    void SetCacheDir(QString dir) { cacheDir = dir; } /*!< Set the ingest cache directory. Files that are unchanged since an earlier load of the same directory are not read again. Empty disables the cache */
 
 private:
+    bool OpenIngestCache(QString dir, QHash<QString, dicomFileRecord> &records, QString &m);
+    bool UpdateIngestCache(const QHash<QString, dicomFileRecord> &changed, const QStringList &removed, QString &m);
+    void CloseIngestCache();
+
     qint64 numFiles;
-    QMap<QString, QMap<QString, QMap<QString, QStringList> > > dcms;
+    int threads;
+    QString cacheDir; /* directory of the ingest cache. Empty to disable the cache */
+    QString cacheConnection; /* name of the ingest cache's database connection, while it is open */
+    QMap<QString, QMap<QString, QMap<QString, dicomSeriesScan> > > dcms;
 
 };
 
@@ -47,7 +47,8 @@ bool extract::DoExtract(QString packagePath, QString outputPath, QString objectT
     squirrel *sqrl = new squirrel();
     sqrl->SetFileMode(FileMode::ExistingPackage);
     sqrl->SetPackagePath(packagePath);
-    sqrl->SetQuickRead(true);
+    /* only the subject being extracted needs its studies and series read */
+    sqrl->SetReadMode(ReadMode::Lazy);
     sqrl->Read();
 
     /* create outputDir */
@@ -39,6 +39,7 @@ bool info::DisplayInfo(QString packagePath, const infoQuery &query, QString &m)
         sqrl->SetPackagePath(packagePath);
         sqrl->SetFileMode(FileMode::ExistingPackage);
         sqrl->SetQuickRead(true);
+        sqrl->SetCacheDir(query.cacheDir);
         sqrl->Read();
         if (sqrl->IsValid()) {
             sqrl->Debug("Reading package...", __FUNCTION__);
@@ -22,6 +22,7 @@
 
 #include <QCoreApplication>
 #include <QCommandLineParser>
+#include <QJsonDocument>
 #include <iostream>
 #include "squirrelVersion.h"
 #include "dicom.h"
@@ -89,13 +90,38 @@ int main(int argc, char *argv[])
     p.setOptionsAfterPositionalArgumentsMode(QCommandLineParser::ParseAsOptions);
     p.addHelpOption();
     p.addVersionOption();
+    p.addOption(QCommandLineOption(QStringList() << "stats", "Print phase timers and I/O counters as JSON when the command finishes"));
+    p.addOption(QCommandLineOption(QStringList() << "compression", "Compression method for written packages [lzma2  deflate  store] (default: lzma2). Zip packages use deflate in place of lzma2", "method"));
+    p.addOption(QCommandLineOption(QStringList() << "compressionlevel", "Compression level, 0 (store) to 9 (ultra) (default: 1)", "level"));
+    p.addOption(QCommandLineOption(QStringList() << "compressionthreads", "Number of compression threads (default: chosen by 7-zip)", "num"));
+    p.addOption(QCommandLineOption(QStringList() << "dictionarysize", "LZMA2 dictionary size in MB (default: set by the compression level). Not used by deflate", "MB"));
+    p.addOption(QCommandLineOption(QStringList() << "storecompressed", "Store, instead of compress, a batch of files that is at least 90% already-compressed files (.nii.gz, .gz, .zip, JPEG DICOM) by size"));
+    p.addOption(QCommandLineOption(QStringList() << "dedup", "Store files with identical contents once in new packages. The other copies are recorded as aliases of the stored file"));
+    p.addOption(QCommandLineOption(QStringList() << "append", "Update the files of existing packages by appending a segment next to the package, instead of rewriting it. Header-only updates always use a small header segment. Use the compact tool to fold the segments back in"));
 
     /* setup and obtain the tool we're supposed to run */
-    p.addPositionalArgument("tool", "Available tools:\n   convert - Convert DICOM or BIDS data into a squirrel package\n   info - Display information about a package or its contents\n   merge - Merge two or more packages into one\n   modify - Add/remove objects from a package\n   extract - Extract data from a package\n   validate - Check if a package is valid");
+    p.addPositionalArgument("tool", "Available tools:\n   convert - Convert DICOM or BIDS data into a squirrel package\n   info - Display information about a package or its contents\n   merge - Merge two or more packages into one\n   compact - Fold the appended segments of a package back into it\n   modify - Add/remove objects from a package\n   extract - Extract data from a package\n   validate - Check if a package is valid");
     p.parse(QCoreApplication::arguments());
     const QStringList args = p.positionalArguments();
     const QString command = args.isEmpty() ? QString() : args.first();
 
+    /* compression profile for packages written by any of the tools */
+    compressionProfile profile;
+    if (p.isSet("compression"))
+        profile.method = p.value("compression").trimmed().toLower();
+    if (p.isSet("compressionlevel"))
+        profile.level = p.value("compressionlevel").toInt();
+    profile.threads = p.value("compressionthreads").toInt();
+    profile.dictionarySize = p.value("dictionarysize").toInt();
+    profile.storeCompressed = p.isSet("storecompressed");
+    QString profileMsg;
+    if (!squirrel::SetDefaultCompressionProfile(profile, profileMsg)) {
+        CommandLineError(p, profileMsg);
+        return 1;
+    }
+    squirrel::SetDefaultAppendUpdates(p.isSet("append"));
+    squirrel::SetDefaultDeduplicate(p.isSet("dedup"));
+
     /* check which tool to run */
     if (command == "convert") {
         p.clearPositionalArguments();
@@ -119,12 +145,16 @@ int main(int argc, char *argv[])
         p.addOption(QCommandLineOption(QStringList() << "dirformat", "Output directory structure\n  seq - Sequentially numbered\n  orig - Original ID (default)", "format"));
         p.addOption(QCommandLineOption(QStringList() << "overwrite", "Overwrite existing squirrel package if a package with same name exists"));
         p.addOption(QCommandLineOption(QStringList() << "debugsql", "Enable debugging of SQL statements"));
+        p.addOption(QCommandLineOption(QStringList() << "threads", "Number of threads reading DICOM headers, and series to stage concurrently when writing the package (default: number of cores)", "num"));
+        p.addOption(QCommandLineOption(QStringList() << "cachedir", "DICOM ingest cache directory. Files unchanged since an earlier conversion of the same input directory are not read again. The cache holds identifying tags (PatientID, birth date, study and series dates and descriptions), unencrypted, in files only the owner can read. Keep it on a disk cleared for PHI", "dir"));
 
         p.process(a);
 
         bool debug = p.isSet("d");
         bool quiet = p.isSet("q");
         bool overwrite = p.isSet("overwrite");
+        int threads = p.value("threads").toInt();
+        QString cacheDir = p.value("cachedir").trimmed();
         bool debugsql = p.isSet("debugsql");
         QString inputFormat = p.value("inputformat").trimmed();
         QString outputFormat = p.value("outputformat").trimmed();
@@ -157,7 +187,7 @@ int main(int argc, char *argv[])
 
         QString m;
         convert converter;
-        if (!converter.DoConvert(inputPath, outputPath, inputFormat, outputFormat, paramOutputDataFormat, paramOutputDirFormat, overwrite, debug, debugsql, quiet, m)) {
+        if (!converter.DoConvert(inputPath, outputPath, inputFormat, outputFormat, paramOutputDataFormat, paramOutputDirFormat, overwrite, debug, debugsql, quiet, threads, cacheDir, m)) {
             CommandLineError(p, m);
         }
     }
@@ -178,6 +208,7 @@ int main(int argc, char *argv[])
         p.addOption(QCommandLineOption(QStringList() << "studynum", "Study Number\n  --subjectid must also be specified.", "studynum"));
         p.addOption(QCommandLineOption(QStringList() << "dataset", "Dataset type [id  basic  full]", "dataset"));
         p.addOption(QCommandLineOption(QStringList() << "format", "Printing format [list  csv]", "format"));
+        p.addOption(QCommandLineOption(QStringList() << "cachedir", "Metadata cache directory. An unchanged package is loaded from the cache instead of being read again.", "dir"));
         p.process(a);
 
         if (inputPath == "") {
@@ -193,6 +224,7 @@ int main(int argc, char *argv[])
             query.object = squirrel::ObjectTypeToEnum(p.value("object").trimmed());
             query.subjectID = p.value("subjectid").trimmed();
             query.studyNum = p.value("studynum").toInt();
+            query.cacheDir = p.value("cachedir").trimmed();
 
             if (dataset == "id")
                 query.dataset = DatasetID;
@@ -396,6 +428,34 @@ int main(int argc, char *argv[])
         }
         delete sqrl;
     }
+    else if (command == "compact") {
+        p.clearPositionalArguments();
+        p.addPositionalArgument("compact", "Fold the segments appended to a squirrel package back into a single archive.", "compact [options]");
+        p.addPositionalArgument("package", "The squirrel package.", "package");
+        p.parse(QCoreApplication::arguments());
+        QStringList args = p.positionalArguments();
+        QString inputPath;
+        if (args.size() > 1)
+            inputPath = args[1];
+
+        p.process(a);
+
+        if (inputPath == "") {
+            CommandLineError(p, "Missing input parameter. Specify the package to compact.");
+            return 0;
+        }
+
+        /* create squirrel object and compact */
+        QString m;
+        squirrel *sqrl = new squirrel();
+        sqrl->SetPackagePath(inputPath);
+        sqrl->SetFileMode(FileMode::ExistingPackage);
+        if (sqrl->Compact(m))
+            std::cout << m.toStdString().c_str() << "\n";
+        else
+            CommandLineError(p, m);
+        delete sqrl;
+    }
     else {
         bool v = p.isSet("v");
         if (v)
@@ -406,6 +466,9 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (p.isSet("stats"))
+        std::cout << "\n" << QJsonDocument(squirrel::GetStatsJSON()).toJson().toStdString();
+
     a.exit();
     return 0;
 }
@@ -1241,7 +1241,14 @@ bool modify::RemovePHI(QString packagePath, const modification &mod, QString &m)
     utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
     sqrl->Log("Removed subject birthdates");
 
-    sqrl->WriteUpdate();
+    /* the new header supersedes the old one, which is then removed from the older layers, so no layer keeps
+       the old header with its dates. That rewrites each layer with an old header, since an archive entry can't
+       be deleted in place, but the layer's other files are copied without being compressed again */
+    if (!sqrl->WriteUpdate(true)) {
+        m = QString("Unable to write the header without PHI to package [%1]. Log [%2]").arg(packagePath).arg(sqrl->GetLog());
+        delete sqrl;
+        return false;
+    }
 
     delete sqrl;
     return true;
@@ -22,6 +22,7 @@
 
 #include "squirrel.h"
 #include "squirrelImageIO.h"
+#include "squirrelJsonReader.h"
 #include "utils.h"
 #include "squirrel.sql.h"
 #include "bit7z.hpp"
@@ -30,6 +31,14 @@
 #include "bitfileextractor.hpp"
 #include "squirrelVersion.h"
 #include "squirrelTypes.h"
+#include <QThreadPool>
+#include <QLockFile>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <future>
+#include <filesystem>
 
 /* ----- bit7z progress callbacks ----- */
 qint64 totalbytes(0);
@@ -52,6 +61,396 @@ bool progressCallback(qint64 val) {
     return true;
 }
 
+/* ----- process-wide instrumentation, shared by all squirrel objects and threads. See GetStats() ----- */
+static std::atomic<qint64> archiveOpenCount(0);
+static std::atomic<qint64> bytesCompressedCount(0);
+static std::atomic<qint64> bytesDecompressedCount(0);
+static std::atomic<qint64> filesCopiedCount(0);
+static std::atomic<qint64> sqlStatementBase(0);
+
+enum StatsPhase { HeaderExtractPhase, JsonParsePhase, SqlInsertPhase, StagingPhase, ConversionPhase, CompressionPhase, ExtractionPhase, NumStatsPhases };
+
+struct phaseCounter {
+    std::atomic<qint64> wallNs{0};
+    std::atomic<qint64> cpuNs{0};
+    std::atomic<qint64> calls{0};
+};
+static phaseCounter phaseCounters[NumStatsPhases];
+
+/* ----- adds the wall and CPU time from its construction to its destruction to a phase ----- */
+class phaseTimer {
+public:
+    phaseTimer(StatsPhase p) : phase(p), cpuStart(utils::GetProcessCPUTime()) { timer.start(); }
+    ~phaseTimer() {
+        qint64 cpuEnd = utils::GetProcessCPUTime();
+        phaseCounters[phase].wallNs += timer.nsecsElapsed();
+        if ((cpuStart >= 0) && (cpuEnd >= cpuStart))
+            phaseCounters[phase].cpuNs += cpuEnd - cpuStart;
+        phaseCounters[phase].calls++;
+    }
+private:
+    StatsPhase phase;
+    qint64 cpuStart;
+    QElapsedTimer timer;
+};
+
+/* ----- decoded subject records, passed from the Read() decode workers to the writer, or decoded on first access in the lazy read mode ----- */
+struct studyRecord {
+    studyRecord(QString dbID) : study(dbID) {}
+    squirrelStudy study;
+    QList<squirrelSeries> series;
+    QList<squirrelAnalysis> analyses;
+};
+
+struct subjectRecord {
+    subjectRecord(QString dbID) : subject(dbID) {}
+    squirrelSubject subject;
+    QList<studyRecord> studies;
+    QList<squirrelObservation> observations;
+    QList<squirrelIntervention> interventions;
+    QStringList log;    /* messages for Log(), written by the writer thread */
+    QStringList debug;  /* messages for Debug(), written by the writer thread */
+};
+
+/* ----- bulk-insert queries for storing decoded subjects. Prepared once to avoid repeated SQLite statement compilation ----- */
+struct readQueries {
+    readQueries(QSqlDatabase dbconn) : subject(dbconn), study(dbconn), series(dbconn), observation(dbconn), intervention(dbconn) {
+        subject.prepare("insert or ignore into Subject (ID, AltIDs, GUID, DateOfBirth, Sex, Gender, Ethnicity1, Ethnicity2, EnrollmentGroup, EnrollmentStatus, Notes, SequenceNumber, VirtualPath) values (:ID, :AltIDs, :GUID, :DateOfBirth, :Sex, :Gender, :Ethnicity1, :Ethnicity2, :EnrollmentGroup, :EnrollmentStatus, :Notes, :SequenceNumber, :VirtualPath)");
+        study.prepare("insert or ignore into Study (SubjectRowID, StudyNumber, Datetime, Age, Height, Weight, Modality, Description, StudyUID, VisitType, DayNumber, TimePoint, Equipment, Notes, SequenceNumber, VirtualPath) values (:SubjectRowID, :StudyNumber, :Datetime, :Age, :Height, :Weight, :Modality, :Description, :StudyUID, :VisitType, :DayNumber, :TimePoint, :Equipment, :Notes, :SequenceNumber, :VirtualPath)");
+        series.prepare("insert or ignore into Series (StudyRowID, SeriesNumber, Datetime, SeriesUID, Description, Protocol, BidsEntity, BidsSuffix, BidsTask, BidsRun, BidsPhaseEncodingDirection, Run, ExperimentRowID, Size, Files, FileCount, BehavioralSize, BehavioralFileCount, SequenceNumber, VirtualPath) values (:StudyRowID, :SeriesNumber, :Datetime, :SeriesUID, :Description, :Protocol, :BidsEntity, :bidssuffix, :BidsTask, :BidsRun, :BidsPhaseEncodingDirection, :Run, :ExperimentRowID, :Size, :Files, :FileCount, :BehavioralSize, :BehavioralFileCount, :SequenceNumber, :VirtualPath)");
+        observation.prepare("insert into Observation (SubjectRowID, ObservationName, ObservationType, DateStart, DateEnd, InstrumentName, Rater, Notes, Value, Duration, DateRecordCreate, DateRecordEntry, DateRecordModify, Description) values (:SubjectRowID, :ObservationName, :ObservationType, :DateStart, :DateEnd, :InstrumentName, :Rater, :Notes, :Value, :Duration, :DateRecordCreate, :DateRecordEntry, :DateRecordModify, :Description)");
+        intervention.prepare("insert into Intervention (SubjectRowID, InterventionName, DateStart, DateEnd, DateRecordCreate, DateRecordEntry, DateRecordModify, DoseString, DoseAmount, DoseFrequency, AdministrationRoute, InterventionClass, DoseKey, DoseUnit, FrequencyModifier, FrequencyValue, FrequencyUnit, Description, Rater, Notes) values (:SubjectRowID, :InterventionName, :DateStart, :DateEnd, :DateRecordCreate, :DateRecordEntry, :DateRecordModify, :DoseString, :DoseAmount, :DoseFrequency, :AdministrationRoute, :InterventionClass, :DoseKey, :DoseUnit, :FrequencyModifier, :FrequencyValue, :FrequencyUnit, :Description, :Rater, :Notes)");
+    }
+    QSqlQuery subject;
+    QSqlQuery study;
+    QSqlQuery series;
+    QSqlQuery observation;
+    QSqlQuery intervention;
+};
+
+/* ----- a series staged for a new package by a Write() staging worker. Applied in series order by the calling thread ----- */
+struct stagedSeriesFile {
+    QString diskPath;       /* path of the file on disk */
+    QString archiveFile;    /* path of the file within the package */
+    qint64 size;            /* size of the file in bytes */
+    QByteArray hash;        /* ContentHash() of the file, if the package is deduplicated. Empty otherwise */
+};
+
+struct seriesStagingRecord {
+    QList<stagedSeriesFile> files;
+    QString stagingDir; /* directory the series was converted in, within the working directory. Empty if not converted */
+    QStringList log;    /* messages for Log(), written by the calling thread */
+    QStringList debug;  /* messages for Debug(), written by the calling thread */
+};
+
+/* ----- list the files of a series converted in the working directory ----- */
+static void ListStagedFiles(const QString &seriesPath, const QString &seriesArchivePath, QList<stagedSeriesFile> &files) {
+    QDir seriesDir(seriesPath);
+    foreach (QString f, utils::FindAllFiles(seriesPath, "*", true)) {
+        QFileInfo fi(f);
+        files.append({fi.absoluteFilePath(), seriesArchivePath + "/" + QDir::fromNativeSeparators(seriesDir.relativeFilePath(f)), fi.size()});
+    }
+}
+
+/* ----- hash of a file's contents, for deduplication. Empty if the file can't be read ----- */
+static QByteArray ContentHash(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QCryptographicHash hash(QCryptographicHash::Blake2b_256);
+    if (!hash.addData(&f))
+        return QByteArray();
+    return hash.result();
+}
+
+/* ----- checksum of a staged series' file listing (archive paths and sizes), in hex ----- */
+static QByteArray StagedFilesChecksum(const QList<stagedSeriesFile> &files) {
+    QStringList entries;
+    for (const auto &f : files)
+        entries.append(QString("%1\t%2").arg(f.archiveFile).arg(f.size));
+    entries.sort();
+    return QCryptographicHash::hash(entries.join("\n").toUtf8(), QCryptographicHash::Sha1).toHex();
+}
+
+/* ----- a series in the Write() checkpoint journal ----- */
+struct journalSeries {
+    QString archivePath;    /* path of the series within the package */
+    qint64 fileCount = 0;   /* number of files in the series */
+    qint64 size = 0;        /* size of the series' files in bytes */
+    QByteArray checksum;    /* StagedFilesChecksum() of a converted series. Empty for archived series */
+};
+
+/* ----- checkpoint journal of a Write() that converts series, kept in its working directory. It records each
+   series converted in the working directory, and each batch of series written to the package, so a Write()
+   of the same package with the same options resumes where an interrupted one stopped ----- */
+class writeJournal {
+public:
+    /* load the journal in dir, or start a new one. A journal written with other options is discarded. Batch n
+       is layer n of the package (the package, then its segments), and the batches already written count only if
+       each of their layers is still the size it was when it was written. If they don't, the journal is left as
+       it is and Open() fails, unless discardMismatch is true */
+    bool Open(const QString &dir, const QString &options, const QStringList &layers, bool discardMismatch, QString &m) {
+        QByteArray optionsLine = "options\t" + QCryptographicHash::hash(options.toUtf8(), QCryptographicHash::Sha1).toHex();
+        file.setFileName(dir + "/write.journal");
+        resumed = false;
+        if (file.open(QIODevice::ReadOnly)) {
+            QList<QByteArray> lines = file.readAll().split('\n');
+            file.close();
+            if (!lines.isEmpty() && (lines.first() == optionsLine)) {
+                resumed = true;
+                QList<journalSeries> batch;
+                QHash<QString, QString> batchAliases;
+                QList<qint64> layerSizes;
+                for (const QByteArray &line : lines) {
+                    QList<QByteArray> f = line.split('\t');
+                    if ((f.at(0) == "staged") && (f.size() == 5))
+                        staged.insert(QString::fromUtf8(f.at(1)), {QString::fromUtf8(f.at(1)), f.at(2).toLongLong(), f.at(3).toLongLong(), f.at(4)});
+                    else if ((f.at(0) == "archived") && (f.size() == 4))
+                        batch.append({QString::fromUtf8(f.at(1)), f.at(2).toLongLong(), f.at(3).toLongLong(), QByteArray()});
+                    else if ((f.at(0) == "alias") && (f.size() == 3))
+                        batchAliases.insert(QString::fromUtf8(f.at(1)), QString::fromUtf8(f.at(2)));
+                    else if ((f.at(0) == "segment") && (f.size() == 3)) {
+                        for (const auto &s : batch)
+                            archived.insert(s.archivePath, s);
+                        aliases.insert(batchAliases);
+                        batch.clear();
+                        batchAliases.clear();
+                        segments = f.at(1).toInt();
+                        layerSizes.append(f.at(2).toLongLong());
+                    }
+                }
+                bool layersMatch = (layers.size() >= segments) && (layerSizes.size() == segments);
+                for (int i=0; layersMatch && (i < segments); i++)
+                    layersMatch = (QFileInfo(layers.at(i)).size() == layerSizes.at(i));
+                if ((segments > 0) && !layersMatch) {
+                    m = QString("Package [%1] does not match the journal of the earlier write").arg(layers.first());
+                    mismatch = true;
+                    if (!discardMismatch)
+                        return false;
+                    archived.clear();
+                    aliases.clear();
+                    segments = 0;
+                }
+            }
+        }
+
+        if (resumed && !mismatch)
+            return file.open(QIODevice::WriteOnly | QIODevice::Append);
+
+        /* a new journal. After a mismatch, only the converted series are kept */
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            return false;
+        Append(optionsLine);
+        for (const auto &s : staged)
+            Staged(s);
+        return true;
+    }
+
+    bool Resumed() { return resumed; }
+    bool Mismatch() { return mismatch; }
+    int Segments() { return segments; }
+    bool IsStaged(const QString &archivePath, journalSeries &s) { s = staged.value(archivePath); return staged.contains(archivePath); }
+    bool IsArchived(const QString &archivePath, journalSeries &s) { s = archived.value(archivePath); return archived.contains(archivePath); }
+    QHash<QString, QString> Aliases() { return aliases; }
+
+    void Staged(const journalSeries &s) {
+        Append(QString("staged\t%1\t%2\t%3\t").arg(s.archivePath).arg(s.fileCount).arg(s.size).toUtf8() + s.checksum);
+    }
+    void Segment(const QList<journalSeries> &series, const QHash<QString, QString> &batchAliases, qint64 layerSize) {
+        for (const auto &s : series)
+            Append(QString("archived\t%1\t%2\t%3").arg(s.archivePath).arg(s.fileCount).arg(s.size).toUtf8());
+        for (auto it = batchAliases.constBegin(); it != batchAliases.constEnd(); ++it)
+            Append(QString("alias\t%1\t%2").arg(it.key()).arg(it.value()).toUtf8());
+        segments++;
+        Append(QString("segment\t%1\t%2").arg(segments).arg(layerSize).toUtf8());
+    }
+
+private:
+    /* each line is flushed, so a killed process leaves every completed step in the journal */
+    void Append(const QByteArray &line) { file.write(line + "\n"); file.flush(); }
+
+    QFile file;
+    QHash<QString, journalSeries> staged;   /* series converted in the working directory */
+    QHash<QString, journalSeries> archived; /* series written to the package in a completed batch */
+    QHash<QString, QString> aliases;        /* deduplicated files in a completed batch. Alias path -> stored file */
+    int segments = 0;                       /* number of batches written to the package */
+    bool resumed = false;                   /* true if the journal of an earlier write was loaded */
+    bool mismatch = false;                  /* true if the package does not match the journal's batches */
+};
+
+/* ----- archive format, from the package file extension ----- */
+static const bit7z::BitInOutFormat &ArchiveFormat(QString archivePath) {
+    if (archivePath.endsWith(".zip", Qt::CaseInsensitive))
+        return bit7z::BitFormat::Zip;
+    else
+        return bit7z::BitFormat::SevenZip;
+}
+
+/* ----- path of an appended segment of a package: <package>.seg<n>.7z, or .zip for zip packages. A segment is
+   written under its partial name, and renamed when it is complete ----- */
+static QString ArchiveSegmentPath(QString archivePath, int segment, bool partial = false) {
+    QString ext = archivePath.endsWith(".zip", Qt::CaseInsensitive) ? ".zip" : ".7z";
+    return QString("%1.seg%2%3%4").arg(archivePath).arg(segment).arg(partial ? ".partial" : "").arg(ext);
+}
+
+/* ----- the appended segments of a package, oldest first ----- */
+static QStringList ArchiveSegments(QString archivePath) {
+    QStringList segments;
+    for (int i=1; QFile::exists(ArchiveSegmentPath(archivePath, i)); i++)
+        segments.append(ArchiveSegmentPath(archivePath, i));
+    return segments;
+}
+
+/* ----- the package followed by its appended segments. Later archives replace files in earlier ones ----- */
+static QStringList ArchiveLayers(QString archivePath) {
+    return QStringList(archivePath) + ArchiveSegments(archivePath);
+}
+
+/* ----- the aliases.json of a layer. Alias path -> path of the stored file in the same layer ----- */
+static QByteArray AliasesToJson(const QHash<QString, QString> &aliases) {
+    QJsonObject aliasObject;
+    for (auto it = aliases.constBegin(); it != aliases.constEnd(); ++it)
+        aliasObject.insert(it.key(), it.value());
+    return QJsonDocument(aliasObject).toJson();
+}
+
+/* ----- the object an archive item belongs to: data/subject/study/series for files in a series (or the
+   subject or study directory for items above it), the first two levels, such as pipelines/name, for
+   other items, and "" for top level files such as squirrel.json ----- */
+static QString ArchiveObjectPath(const QString &itemPath) {
+    QStringList parts = itemPath.split("/");
+    parts.removeLast();
+    int depth = (!parts.isEmpty() && (parts.first() == "data")) ? 4 : 2;
+    return parts.mid(0, depth).join("/");
+}
+
+/* ----- group the items of an index by object, in archive order ----- */
+static void IndexArchiveObjects(archiveIndex &index) {
+    QList<QPair<quint32, QString>> items;
+    items.reserve(index.items.size());
+    for (auto it = index.items.constBegin(); it != index.items.constEnd(); ++it)
+        items.append(qMakePair(it.value().index, it.key()));
+    std::sort(items.begin(), items.end());
+
+    index.objects.clear();
+    for (const auto &item : items)
+        index.objects[ArchiveObjectPath(item.second)].append(item.second);
+}
+
+/* ----- compression profile given to new squirrel objects. See SetDefaultCompressionProfile() ----- */
+static compressionProfile defaultCompressionProfile;
+
+/* ----- append mode given to new squirrel objects. See SetDefaultAppendUpdates() ----- */
+static bool defaultAppendUpdates(false);
+
+/* ----- deduplication given to new squirrel objects. See SetDefaultDeduplicate() ----- */
+static bool defaultDeduplicate(false);
+
+/* ----- set the method, level, dictionary, and threads of an archive writer or editor from a compression profile.
+   store is true to add the files without compressing them ----- */
+static void ApplyCompressionProfile(bit7z::BitAbstractArchiveCreator &creator, const compressionProfile &profile, QString archivePath, bool store = false) {
+    using namespace bit7z;
+    bool zip = archivePath.endsWith(".zip", Qt::CaseInsensitive);
+
+    if (store || (profile.method == "store") || (profile.level == 0)) {
+        creator.setCompressionMethod(BitCompressionMethod::Copy);
+        creator.setCompressionLevel(BitCompressionLevel::None);
+    }
+    else {
+        /* LZMA2 is not a zip method, so zip packages use deflate */
+        if (zip || (profile.method == "deflate"))
+            creator.setCompressionMethod(BitCompressionMethod::Deflate);
+        else
+            creator.setCompressionMethod(BitCompressionMethod::Lzma2);
+        creator.setCompressionLevel(static_cast<BitCompressionLevel>(profile.level));
+        /* the dictionary size is an LZMA setting. Deflate has a fixed 32 KB window */
+        if ((profile.dictionarySize > 0) && (creator.compressionMethod() == BitCompressionMethod::Lzma2))
+            creator.setDictionarySize(static_cast<uint32_t>(profile.dictionarySize) * 1024 * 1024);
+    }
+    if (profile.threads > 0)
+        creator.setThreadsCount(static_cast<uint32_t>(profile.threads));
+    if (!zip)
+        creator.setSolidMode(false);
+}
+
+/* ----- true if a file is already compressed, so compressing it again costs CPU for no size gain. Checks the
+   file extension, and the transfer syntax of DICOM files (JPEG, JPEG-LS, JPEG 2000, and RLE) ----- */
+static bool IsCompressedFile(const QString &path) {
+    static const QSet<QString> compressedSuffixes = { "gz", "tgz", "zip", "7z", "bz2", "xz", "zst", "sqrl", "jpg", "jpeg", "png", "gif", "mp4", "mov", "avi" };
+    if (compressedSuffixes.contains(QFileInfo(path).suffix().toLower()))
+        return true;
+
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+    QByteArray head = f.read(2048);
+    if ((head.size() < 132) || (head.mid(128, 4) != "DICM"))
+        return false;
+    return head.contains("1.2.840.10008.1.2.4.") || head.contains("1.2.840.10008.1.2.5");
+}
+
+/* ----- true if a compression profile stores the files of filePaths, which are written along with otherBytes bytes of other
+   files. An archive is written in one pass with one method, so the files are stored when files that are already
+   compressed make up at least 90% of the bytes. The few compressible bytes are stored along with them ----- */
+static bool StoreCompressedFiles(const compressionProfile &profile, const QStringList &filePaths, qint64 otherBytes) {
+    if (!profile.storeCompressed || (profile.method == "store") || (profile.level == 0))
+        return false;
+    qint64 compressedBytes(0), totalBytes(otherBytes);
+    for (const QString &f : filePaths) {
+        qint64 size = QFileInfo(f).size();
+        totalBytes += size;
+        if (IsCompressedFile(f))
+            compressedBytes += size;
+    }
+    return (totalBytes > 0) && (compressedBytes * 10 >= totalBytes * 9);
+}
+
+/* ----- writes a JSON document to a device a member at a time, in the indented format of QJsonDocument::toJson().
+   Members must be written in the order QJsonObject keeps its keys (sorted) for the output to be identical ----- */
+class jsonStreamWriter {
+public:
+    jsonStreamWriter(QIODevice &device) : dev(device) {}
+
+    void BeginObject() { Separator(); Open("{\n"); }
+    void BeginObject(const QString &key) { Key(key); Open("{\n"); }
+    void BeginArray(const QString &key) { Key(key); Open("[\n"); }
+    void Value(const QJsonValue &value) { Separator(); Write(Serialize(value)); }
+    void Value(const QString &key, const QJsonValue &value) { Key(key); Write(Serialize(value)); }
+    void Members(const QJsonObject &obj) { for (auto it = obj.begin(); it != obj.end(); ++it) Value(it.key(), it.value()); }
+    void End(char close) {
+        bool hasMembers = levels.takeLast();
+        if (hasMembers) Write("\n");
+        Write(QByteArray(4 * levels.size(), ' ') + close);
+        if (levels.isEmpty()) Write("\n");
+    }
+    void EndObject() { End('}'); }
+    void EndArray() { End(']'); }
+    bool Ok() { return ok; }
+
+private:
+    void Write(const QByteArray &b) { if (ok && (dev.write(b) != b.size())) ok = false; }
+    void Open(const char *open) { Write(open); levels.append(false); }
+    void Separator() {
+        if (levels.isEmpty()) return;
+        if (levels.last()) Write(",\n");
+        levels.last() = true;
+        Write(QByteArray(4 * levels.size(), ' '));
+    }
+    void Key(const QString &key) { Separator(); Write(Serialize(key) + ": "); }
+
+    /* the value as QJsonDocument writes it at the current depth. A value alone in an array is at depth 1 */
+    QByteArray Serialize(const QJsonValue &value) {
+        QByteArray b = QJsonDocument(QJsonArray{value}).toJson();
+        b = b.mid(6, b.size() - 9); /* strip "[\n    " and "\n]\n" */
+        if (levels.size() > 1) b.replace("\n", "\n" + QByteArray(4 * (levels.size() - 1), ' '));
+        return b;
+    }
+
+    QIODevice &dev;
+    QList<bool> levels; /* open objects and arrays, and whether each has a member yet */
+    bool ok = true;
+};
+
 
 /* ------------------------------------------------------------ */
 /* ----- squirrel --------------------------------------------- */
@@ -80,8 +479,12 @@ squirrel::squirrel(bool dbg, bool q)
     isOkToDelete = true;
     isValid = true;
     quickRead = true;
+    readMode = ReadMode::Quick;
     quiet = q;
     writeLog = false;
+    compression = defaultCompressionProfile;
+    appendUpdates = defaultAppendUpdates;
+    deduplicate = defaultDeduplicate;
     databaseUUID = QUuid::createUuid().toString(QUuid::WithoutBraces);
     Log(QString("Generated UUID [%1]").arg(databaseUUID));
 
@@ -119,6 +522,8 @@ squirrel::~squirrel()
         if (!utils::RemoveDir(workingDir, m))
             Log(QString("Error removing working directory [%1]. Message [%2]").arg(workingDir).arg(m));
     }
+    CloseArchiveReader();
+    archiveLib.reset();
     db.close();
     db = QSqlDatabase(); /* release the member handle so removeDatabase() doesn't warn about connections still in use */
     QSqlDatabase::removeDatabase(databaseUUID);
@@ -281,6 +686,216 @@ bool squirrel::InitializeDatabase() {
 }
 
 
+/* ---------------------------------------------------------- */
+/* --------- DatabaseCachePath ------------------------------ */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Get the path of the metadata cache file for the current package
+ * @return path of the cache file, named by a hash of the package's absolute path
+ */
+QString squirrel::DatabaseCachePath() {
+    QByteArray pathHash = QCryptographicHash::hash(QFileInfo(GetPackagePath()).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    return QString("%1/%2.sqlite").arg(cacheDir).arg(QString(pathHash.toHex()));
+}
+
+
+/* ---------------------------------------------------------- */
+/* --------- ReadDatabaseCache ------------------------------ */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Load the database from the metadata cache, if the cache matches the package
+ * @param jsonHash SHA-1 of the package's squirrel.json
+ * @param m output message
+ * @return true if the database was loaded from the cache, false if the package must be read
+ *
+ * The cache is used only if its fingerprint (package path, size, modification
+ * time, and squirrel.json hash) matches the package, it was written by this
+ * build of the library, and it holds at least as much as the current read mode
+ * needs. A Quick cache doesn't have the series params, so it is not used for a
+ * Full or Lazy read.
+ */
+bool squirrel::ReadDatabaseCache(const QByteArray &jsonHash, QString &m) {
+    QString cachePath = DatabaseCachePath();
+    if (!QFile::exists(cachePath)) {
+        m = QString("No metadata cache found [%1]").arg(cachePath);
+        return false;
+    }
+
+    QSqlDatabase dbconn = QSqlDatabase::database(databaseUUID);
+    QSqlQuery q(dbconn);
+    q.prepare("attach database :path as cache");
+    q.bindValue(":path", cachePath);
+    if (!utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__)) {
+        m = QString("Unable to attach metadata cache [%1]").arg(cachePath);
+        return false;
+    }
+
+    QHash<QString, QString> info;
+    q.prepare("select Name, Value from cache.CacheInfo");
+    if (utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__)) {
+        while (q.next())
+            info.insert(q.value("Name").toString(), q.value("Value").toString());
+    }
+
+    QFileInfo fi(GetPackagePath());
+    QString cacheMode = info.value("ReadMode");
+    bool modeOk = (cacheMode == "Full") || ((cacheMode == "Quick") && (readMode == ReadMode::Quick));
+    if ((info.value("CacheVersion") != "1") || (info.value("LibraryBuild") != QString("%1.%2.%3").arg(UTIL_VERSION_MAJ).arg(UTIL_VERSION_MIN).arg(UTIL_BUILD_NUM))) {
+        m = QString("Metadata cache [%1] was written by a different version of squirrel").arg(cachePath);
+    }
+    else if ((info.value("PackagePath") != fi.absoluteFilePath()) || (info.value("PackageSize").toLongLong() != fi.size()) || (info.value("PackageModified").toLongLong() != fi.lastModified().toMSecsSinceEpoch()) || (info.value("HeaderHash") != QString(jsonHash.toHex()))) {
+        m = QString("Metadata cache [%1] is out of date with the package").arg(cachePath);
+    }
+    else if (!modeOk) {
+        m = QString("Metadata cache [%1] was written by a [%2] read, which does not have everything this read needs").arg(cachePath).arg(cacheMode);
+    }
+    else {
+        /* copy every table from the cache. The tables have the same schema, and the rowIDs are kept, so the links between objects are unchanged */
+        QStringList tables;
+        q.prepare("select name from cache.sqlite_master where type = 'table' and name <> 'CacheInfo'");
+        if (utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__)) {
+            while (q.next())
+                tables.append(q.value("name").toString());
+        }
+
+        bool ok = dbconn.transaction();
+        for (const QString &table : tables) {
+            if (!ok)
+                break;
+            q.prepare(QString("insert into main.%1 select * from cache.%1").arg(table));
+            ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        }
+        if (ok)
+            ok = dbconn.commit();
+
+        if (ok) {
+            Changes = info.value("Changes");
+            DataFormat = info.value("DataFormat");
+            Datetime = QDateTime::fromString(info.value("Datetime"), Qt::ISODateWithMs);
+            Description = info.value("Description");
+            License = info.value("License");
+            Notes = info.value("Notes");
+            PackageFormat = info.value("PackageFormat");
+            PackageName = info.value("PackageName");
+            Readme = info.value("Readme");
+            SeriesDirFormat = info.value("SeriesDirFormat");
+            SquirrelBuild = info.value("SquirrelBuild");
+            SquirrelVersion = info.value("SquirrelVersion");
+            StudyDirFormat = info.value("StudyDirFormat");
+            SubjectDirFormat = info.value("SubjectDirFormat");
+            headerTotalFileCount = info.value("TotalFileCount").toLongLong();
+            headerTotalSize = info.value("TotalSize").toLongLong();
+            m = QString("Loaded [%1] tables from metadata cache [%2]").arg(tables.size()).arg(cachePath);
+        }
+        else {
+            dbconn.rollback();
+            m = QString("Error loading metadata cache [%1]. Error [%2]").arg(cachePath).arg(dbconn.lastError().text());
+        }
+
+        q.prepare("detach database cache");
+        utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        return ok;
+    }
+
+    q.prepare("detach database cache");
+    utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+    return false;
+}
+
+
+/* ---------------------------------------------------------- */
+/* --------- WriteDatabaseCache ----------------------------- */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Save the database to the metadata cache, so the next Read() of this package can skip parsing it
+ * @param jsonHash SHA-1 of the package's squirrel.json
+ * @param m output message
+ * @return true if successful
+ *
+ * The database is copied with VACUUM INTO, then the package fields and the
+ * package fingerprint are added in a CacheInfo table. The file is written
+ * under a temporary name and renamed, so a reader never sees a partial cache.
+ */
+bool squirrel::WriteDatabaseCache(const QByteArray &jsonHash, QString &m) {
+    if (!QDir().mkpath(cacheDir)) {
+        m = QString("Unable to create metadata cache directory [%1]").arg(cacheDir);
+        return false;
+    }
+
+    QString cachePath = DatabaseCachePath();
+    QString tmpPath = cachePath + ".tmp";
+    QFile::remove(tmpPath);
+
+    QSqlQuery q(QSqlDatabase::database(databaseUUID));
+    q.prepare("vacuum into :path");
+    q.bindValue(":path", tmpPath);
+    if (!utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__)) {
+        m = QString("Unable to write metadata cache [%1]").arg(tmpPath);
+        return false;
+    }
+
+    QFileInfo fi(GetPackagePath());
+    QList<QStringPair> info;
+    info.append(qMakePair(QString("CacheVersion"), QString("1")));
+    info.append(qMakePair(QString("LibraryBuild"), QString("%1.%2.%3").arg(UTIL_VERSION_MAJ).arg(UTIL_VERSION_MIN).arg(UTIL_BUILD_NUM)));
+    info.append(qMakePair(QString("PackagePath"), fi.absoluteFilePath()));
+    info.append(qMakePair(QString("PackageSize"), QString::number(fi.size())));
+    info.append(qMakePair(QString("PackageModified"), QString::number(fi.lastModified().toMSecsSinceEpoch())));
+    info.append(qMakePair(QString("HeaderHash"), QString(jsonHash.toHex())));
+    info.append(qMakePair(QString("ReadMode"), QString(readMode == ReadMode::Quick ? "Quick" : "Full")));
+    info.append(qMakePair(QString("Changes"), Changes));
+    info.append(qMakePair(QString("DataFormat"), DataFormat));
+    info.append(qMakePair(QString("Datetime"), Datetime.toString(Qt::ISODateWithMs)));
+    info.append(qMakePair(QString("Description"), Description));
+    info.append(qMakePair(QString("License"), License));
+    info.append(qMakePair(QString("Notes"), Notes));
+    info.append(qMakePair(QString("PackageFormat"), PackageFormat));
+    info.append(qMakePair(QString("PackageName"), PackageName));
+    info.append(qMakePair(QString("Readme"), Readme));
+    info.append(qMakePair(QString("SeriesDirFormat"), SeriesDirFormat));
+    info.append(qMakePair(QString("SquirrelBuild"), SquirrelBuild));
+    info.append(qMakePair(QString("SquirrelVersion"), SquirrelVersion));
+    info.append(qMakePair(QString("StudyDirFormat"), StudyDirFormat));
+    info.append(qMakePair(QString("SubjectDirFormat"), SubjectDirFormat));
+    info.append(qMakePair(QString("TotalFileCount"), QString::number(headerTotalFileCount)));
+    info.append(qMakePair(QString("TotalSize"), QString::number(headerTotalSize)));
+
+    q.prepare("attach database :path as cache");
+    q.bindValue(":path", tmpPath);
+    bool ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+    if (ok) {
+        q.prepare("create table cache.CacheInfo (Name text primary key, Value text)");
+        ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        for (const QStringPair &pair : info) {
+            if (!ok)
+                break;
+            q.prepare("insert into cache.CacheInfo (Name, Value) values (:name, :value)");
+            q.bindValue(":name", pair.first);
+            q.bindValue(":value", pair.second);
+            ok = utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        }
+        q.prepare("detach database cache");
+        utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+    }
+
+    if (!ok) {
+        QFile::remove(tmpPath);
+        m = QString("Unable to write package information to metadata cache [%1]").arg(tmpPath);
+        return false;
+    }
+
+    QFile::remove(cachePath);
+    if (!QFile::rename(tmpPath, cachePath)) {
+        QFile::remove(tmpPath);
+        m = QString("Unable to rename metadata cache [%1] to [%2]").arg(tmpPath).arg(cachePath);
+        return false;
+    }
+
+    m = QString("Wrote metadata cache [%1]").arg(cachePath);
+    return true;
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- GetPackagePath --------------------------------------- */
 /* ------------------------------------------------------------ */
@@ -324,7 +939,12 @@ bool squirrel::Read() {
 
     QByteArray jsonbytes;
     utils::Print("Extracting squirrel package header...");
-    if (!ExtractArchiveFileToMemory(GetPackagePath(), "squirrel.json", jsonbytes)) {
+    bool headerOk;
+    {
+        phaseTimer t(HeaderExtractPhase);
+        headerOk = ExtractArchiveFileToMemory(GetPackagePath(), "squirrel.json", jsonbytes);
+    }
+    if (!headerOk) {
         Log(QString("Error reading squirrel package. Unable to find squirrel.json"));
         utils::Print(QString("Error reading squirrel package. Unable to find squirrel.json"));
         return false;
@@ -333,14 +953,39 @@ bool squirrel::Read() {
         Debug(QString("Extracted package header [%1]").arg(utils::HumanReadableSize(jsonbytes.size())), __FUNCTION__);
     }
 
+    /* a sidecar index that doesn't describe this header is not used for the rest of the read. The header
+       is in the newest layer that has a squirrel.json, whose index was loaded by the extract above */
+    QByteArray jsonHash = QCryptographicHash::hash(jsonbytes, QCryptographicHash::Sha1);
+    QStringList layers = ArchiveLayers(GetPackagePath());
+    for (int layer = static_cast<int>(layers.size()) - 1; layer >= 0; layer--) {
+        auto index = archiveIndexes.constFind(layers.at(layer));
+        if ((index == archiveIndexes.constEnd()) || !index.value().items.contains("squirrel.json"))
+            continue;
+        if (!index.value().jsonHash.isEmpty() && (index.value().jsonHash != jsonHash)) {
+            Log(QString("Sidecar index [%1] does not match the package header. Reading the package without it").arg(ArchiveIndexFilePath(layers.at(layer))));
+            ignoreArchiveIndexFile = true;
+            CloseArchiveReader();
+        }
+        break;
+    }
+
     double elapsedSec = static_cast<double>(timer.elapsed())/1000.0;
     utils::Print(QString("\nExtracted package header in %1 sec").arg(elapsedSec, 0, 'f', 2));
 
     timer.restart();
 
-    /* get the JSON document and root object */
-    QJsonDocument d = QJsonDocument::fromJson(jsonbytes);
-    QJsonObject root = d.object();
+    /* a package that was read before, and hasn't changed since, is loaded from the metadata cache */
+    lazySubjects.clear();
+    if (!cacheDir.isEmpty()) {
+        QString m;
+        if (ReadDatabaseCache(jsonHash, m)) {
+            Log(m);
+            elapsedSec = static_cast<double>(timer.elapsed())/1000.0;
+            utils::Print(QString("Loaded package from metadata cache in %1 sec").arg(elapsedSec, 0, 'f', 2));
+            return true;
+        }
+        Log(m);
+    }
 
     QSqlDatabase dbconn = QSqlDatabase::database(databaseUUID);
     if (!dbconn.transaction()) {
@@ -349,261 +994,126 @@ bool squirrel::Read() {
         return false;
     }
 
-    /* get the package info */
-    QJsonObject pkgObj = root["package"].toObject();
-    Changes = pkgObj["Changes"].toString();
-    DataFormat = pkgObj["DataFormat"].toString();
-    Datetime = utils::StringToDatetime(pkgObj["Datetime"].toString());
-    Description = pkgObj["Description"].toString();
-    License = pkgObj["License"].toString();
-    Notes = pkgObj["Notes"].toString();
-    PackageFormat = pkgObj["PackageFormat"].toString();
-    PackageName = pkgObj["PackageName"].toString();
-    Readme = pkgObj["Readme"].toString();
-    SeriesDirFormat = pkgObj["SeriesDirectoryFormat"].toString();
-    SquirrelBuild = pkgObj["SquirrelBuild"].toString();
-    SquirrelVersion = pkgObj["SquirrelVersion"].toString();
-    StudyDirFormat = pkgObj["StudyDirectoryFormat"].toString();
-    SubjectDirFormat = pkgObj["SubjectDirectoryFormat"].toString();
-
-    /* get the data object, and check for any subjects */
-    QJsonArray jsonSubjects;
-    qint64 numSubjects;
-    if (root.contains("data")) {
-        QJsonValue dataVal = root.value("data");
-        QJsonObject dataObj = dataVal.toObject();
-        jsonSubjects = dataObj["subjects"].toArray();
-        numSubjects = jsonSubjects.size();
-        Debug(QString("Found [%1] subjects").arg(numSubjects), __FUNCTION__);
-    }
-    else if (root.contains("subjects")) {
-        jsonSubjects = root["subjects"].toArray();
-        Log(QString("NOTICE: Found [%1] subjects in the root of the JSON. (This is a slightly malformed squirrel file, but I'll accept it)").arg(jsonSubjects.size()));
-    }
-    else {
-        Log("root JSON object does not contain 'data' or 'subjects'");
-    }
-
-    Debug(QString("TotalFileCount: [%1]").arg(root["TotalFileCount"].toInt()), __FUNCTION__);
-    Debug(QString("TotalSize: [%1]").arg(root["TotalSize"].toInt()), __FUNCTION__);
-
-    /* Prepare all bulk-insert queries once to avoid repeated SQLite statement compilation */
-    QSqlQuery qSubjectInsert(dbconn);
-    qSubjectInsert.prepare("insert or ignore into Subject (ID, AltIDs, GUID, DateOfBirth, Sex, Gender, Ethnicity1, Ethnicity2, EnrollmentGroup, EnrollmentStatus, Notes, SequenceNumber, VirtualPath) values (:ID, :AltIDs, :GUID, :DateOfBirth, :Sex, :Gender, :Ethnicity1, :Ethnicity2, :EnrollmentGroup, :EnrollmentStatus, :Notes, :SequenceNumber, :VirtualPath)");
-    QSqlQuery qStudyInsert(dbconn);
-    qStudyInsert.prepare("insert or ignore into Study (SubjectRowID, StudyNumber, Datetime, Age, Height, Weight, Modality, Description, StudyUID, VisitType, DayNumber, TimePoint, Equipment, Notes, SequenceNumber, VirtualPath) values (:SubjectRowID, :StudyNumber, :Datetime, :Age, :Height, :Weight, :Modality, :Description, :StudyUID, :VisitType, :DayNumber, :TimePoint, :Equipment, :Notes, :SequenceNumber, :VirtualPath)");
-    QSqlQuery qSeriesInsert(dbconn);
-    qSeriesInsert.prepare("insert or ignore into Series (StudyRowID, SeriesNumber, Datetime, SeriesUID, Description, Protocol, BidsEntity, BidsSuffix, BidsTask, BidsRun, BidsPhaseEncodingDirection, Run, ExperimentRowID, Size, Files, FileCount, BehavioralSize, BehavioralFileCount, SequenceNumber, VirtualPath) values (:StudyRowID, :SeriesNumber, :Datetime, :SeriesUID, :Description, :Protocol, :BidsEntity, :bidssuffix, :BidsTask, :BidsRun, :BidsPhaseEncodingDirection, :Run, :ExperimentRowID, :Size, :Files, :FileCount, :BehavioralSize, :BehavioralFileCount, :SequenceNumber, :VirtualPath)");
-    QSqlQuery qObservationInsert(dbconn);
-    qObservationInsert.prepare("insert into Observation (SubjectRowID, ObservationName, ObservationType, DateStart, DateEnd, InstrumentName, Rater, Notes, Value, Duration, DateRecordCreate, DateRecordEntry, DateRecordModify, Description) values (:SubjectRowID, :ObservationName, :ObservationType, :DateStart, :DateEnd, :InstrumentName, :Rater, :Notes, :Value, :Duration, :DateRecordCreate, :DateRecordEntry, :DateRecordModify, :Description)");
-    QSqlQuery qInterventionInsert(dbconn);
-    qInterventionInsert.prepare("insert into Intervention (SubjectRowID, InterventionName, DateStart, DateEnd, DateRecordCreate, DateRecordEntry, DateRecordModify, DoseString, DoseAmount, DoseFrequency, AdministrationRoute, InterventionClass, DoseKey, DoseUnit, FrequencyModifier, FrequencyValue, FrequencyUnit, Description, Rater, Notes) values (:SubjectRowID, :InterventionName, :DateStart, :DateEnd, :DateRecordCreate, :DateRecordEntry, :DateRecordModify, :DoseString, :DoseAmount, :DoseFrequency, :AdministrationRoute, :InterventionClass, :DoseKey, :DoseUnit, :FrequencyModifier, :FrequencyValue, :FrequencyUnit, :Description, :Rater, :Notes)");
-
-    /* loop through and read any subjects */
-    utils::Print(QString("\nReading %1 subjects...").arg(jsonSubjects.size()));
-    qint64 i(0);
-    for (const auto &a : jsonSubjects) {
-        i++;
-        Debug(QString("Reading subject %1 of %2 - %3").arg(i).arg(jsonSubjects.size()).arg(QDateTime::currentDateTime().toString("yyyy/MM/dd hh:mm:ss.zzz")));
-        //utils::Print(QString("Reading subject %1 of %2 - %3").arg(i).arg(jsonSubjects.size()).arg(QDateTime::currentDateTime().toString("yyyy/MM/dd hh:mm:ss.zzz")), __FUNCTION__);
-        utils::PrintProgress((double)i/(double)jsonSubjects.size());
-
-        QJsonObject jsonSubject = a.toObject();
-
-        squirrelSubject sqrlSubject(databaseUUID);
-        sqrlSubject.ID = jsonSubject["SubjectID"].toString();
-        sqrlSubject.AlternateIDs = jsonSubject["AlternateIDs"].toVariant().toStringList();
-        sqrlSubject.GUID = jsonSubject["GUID"].toString();
-        sqrlSubject.DateOfBirth = QDate::fromString(jsonSubject["DateOfBirth"].toString(), "yyyy-MM-dd");
-        sqrlSubject.Sex = jsonSubject["Sex"].toString();
-        sqrlSubject.Gender = jsonSubject["Gender"].toString();
-        sqrlSubject.EnrollmentGroup = jsonSubject["EnrollmentGroup"].toString();
-        sqrlSubject.EnrollmentStatus = jsonSubject["EnrollmentStatus"].toString();
-        sqrlSubject.Ethnicity1 = jsonSubject["Ethnicity1"].toString();
-        sqrlSubject.Ethnicity2 = jsonSubject["Ethnicity2"].toString();
-        sqrlSubject.Notes = jsonSubject["Notes"].toString();
-        sqrlSubject.Store(qSubjectInsert);
-        qint64 subjectRowID = sqrlSubject.GetObjectID();
+    readQueries queries(dbconn);
 
-        //Log(QString("Reading subject [%1]").arg(sqrlSubject.ID), __FUNCTION__);
+    /* a full read needs every series' params.json and file listing. Get all of them in one pass
+       over the archive, instead of re-opening and re-scanning the archive for every series. A lazy
+       read indexes only the subjects that are materialized, when they are materialized */
+    if (readMode == ReadMode::Full) {
+        QString m;
+        utils::Print("Indexing package archive...");
+        if (!BuildArchiveIndex(GetPackagePath(), m))
+            Log(QString("Error indexing package archive. Series params and file listings will be empty. Message [%1]").arg(m));
+        else
+            Debug(m, __FUNCTION__);
+    }
 
-        /* loop through and read all studies */
-        QJsonArray jsonStudies = jsonSubject["studies"].toArray();
-        for (const auto &b : jsonStudies) {
-            QJsonObject jsonStudy = b.toObject();
-            squirrelStudy sqrlStudy(databaseUUID);
+    /* walk squirrel.json one subject at a time. Worker threads decode each subject (JSON fields, dates,
+       params.json) into records, and this thread stores the records, in package order, with the
+       prepared queries above. SQLite connections can only be used by the thread that opened them, so
+       the thread calling Read() is the single writer. At most decodeWindow subjects are in flight.
+       A lazy read decodes only the subject's own fields, on this thread, and keeps the subject's JSON */
+    squirrelJsonReader reader(jsonbytes);
+    qint64 numSubjects(0);
+    qint64 i(0);
 
-            sqrlStudy.AgeAtStudy = jsonStudy["AgeAtStudy"].toDouble();
-            sqrlStudy.DateTime = QDateTime::fromString(jsonStudy["StudyDatetime"].toString(), "yyyy-MM-dd hh:mm:ss");
-            sqrlStudy.DayNumber = jsonStudy["DayNumber"].toInt();
-            sqrlStudy.Description = jsonStudy["Description"].toString();
-            sqrlStudy.Equipment = jsonStudy["Equipment"].toString();
-            sqrlStudy.Height = jsonStudy["Height"].toDouble();
-            sqrlStudy.Modality = jsonStudy["Modality"].toString();
-            sqrlStudy.Notes = jsonStudy["Notes"].toString();
-            sqrlStudy.StudyNumber = jsonStudy["StudyNumber"].toInt();
-            sqrlStudy.StudyUID = jsonStudy["StudyUID"].toString();
-            sqrlStudy.TimePoint = jsonStudy["TimePoint"].toInt();
-            sqrlStudy.VisitType = jsonStudy["VisitType"].toString();
-            sqrlStudy.Weight = jsonStudy["Weight"].toDouble();
-            sqrlStudy.subjectRowID = subjectRowID;
-            sqrlStudy.Store(qStudyInsert);
-            qint64 studyRowID = sqrlStudy.GetObjectID();
-
-            Debug(QString("Reading study [%1][%2]").arg(sqrlSubject.ID).arg(sqrlStudy.StudyNumber), __FUNCTION__);
-
-            /* loop through and read all series */
-            QJsonArray jsonSeries = jsonStudy["series"].toArray();
-            for (const auto &c : jsonSeries) {
-                QJsonObject jsonSeries = c.toObject();
-                squirrelSeries sqrlSeries(databaseUUID);
-
-                sqrlSeries.BidsEntity = jsonSeries["BidsEntity"].toString();
-                sqrlSeries.BidsPhaseEncodingDirection = jsonSeries["BidsPhaseEncodingDirection"].toString();
-                sqrlSeries.BidsRun = jsonSeries["BidsRun"].toString();
-                sqrlSeries.BidsSuffix = jsonSeries["BidsSuffix"].toString();
-                sqrlSeries.BidsTask = jsonSeries["BidsTask"].toString();
-                sqrlSeries.BehavioralFileCount = jsonSeries["BehavioralFileCount"].toInteger();
-                sqrlSeries.BehavioralSize = jsonSeries["BehavioralSize"].toInteger();
-                //sqrlSeries.DateTime = utils::StringToDatetime(jsonSeries["SeriesDatetime"].toString());
-                sqrlSeries.DateTime = QDateTime::fromString(jsonSeries["SeriesDatetime"].toString(), "yyyy-MM-dd hh:mm:ss");
-                sqrlSeries.Description = jsonSeries["Description"].toString();
-                //sqrlSeries.FileCount = jsonSeries["FileCount"].toInteger();
-                sqrlSeries.Protocol = jsonSeries["Protocol"].toString();
-                sqrlSeries.SeriesNumber = jsonSeries["SeriesNumber"].toInteger();
-                sqrlSeries.SeriesUID = jsonSeries["SeriesUID"].toString();
-                sqrlSeries.Size = jsonSeries["Size"].toInteger();
-                sqrlSeries.studyRowID = studyRowID;
-
-                Debug(QString("Reading series [%1][%2][%3]").arg(sqrlSubject.ID).arg(sqrlStudy.StudyNumber).arg(sqrlSeries.SeriesNumber), __FUNCTION__);
-
-                if (!quickRead) {
-                    /* read any params from the data/Subject/Study/Series/params.json file */
-                    QString parms;
-                    QString paramsfilepath;
-                    QString seriesPath;
-                    #ifdef Q_OS_WINDOWS
-                        seriesPath = QString("data\\%1\\%2\\%3").arg(sqrlSubject.ID).arg(sqrlStudy.StudyNumber).arg(sqrlSeries.SeriesNumber);
-                        paramsfilepath = seriesPath + "\\params.json";
-                    #else
-                        seriesPath = QString("data/%1/%2/%3").arg(sqrlSubject.ID).arg(sqrlStudy.StudyNumber).arg(sqrlSeries.SeriesNumber);
-                        paramsfilepath = seriesPath + "/params.json";
-                    #endif
-                    if (ExtractArchiveFileToMemory(GetPackagePath(), paramsfilepath, parms)) {
-                        sqrlSeries.params = ReadParamsFile(parms);
-                        Debug(QString("Read params file [%1]. series.params contains [%2] items").arg(paramsfilepath).arg(sqrlSeries.params.size()));
-                    }
-                    else {
-                        Log("Unable to read params file [" + paramsfilepath + "]");
-                    }
+    reader.onRoot = [&](const QJsonObject &root) {
+        if (root.contains("subjects"))
+            Log(QString("NOTICE: Found subjects in the root of the JSON. (This is a slightly malformed squirrel file, but I'll accept it)"));
+        else if (!root.contains("data"))
+            Log("root JSON object does not contain 'data' or 'subjects'");
 
-                    /* get file listing */
+        headerTotalFileCount = root["TotalFileCount"].toInteger();
+        headerTotalSize = root["TotalSize"].toInteger();
+        Debug(QString("TotalFileCount: [%1]").arg(headerTotalFileCount), __FUNCTION__);
+        Debug(QString("TotalSize: [%1]").arg(headerTotalSize), __FUNCTION__);
+        return true;
+    };
 
-                    QStringList files;
-                    QString m;
-                    GetArchiveFileListing(GetPackagePath(), seriesPath, files, m);
-                    Debug(QString("archiveSeriesPath [%1] found [%2] files [%3]").arg(seriesPath).arg(files.size()).arg(files.join(",")));
-                    sqrlSeries.files = files;
-                    sqrlSeries.FileCount = files.size();
-                }
+    /* get the package info */
+    reader.onPackage = [&](const QJsonObject &pkgObj) {
+        Changes = pkgObj["Changes"].toString();
+        DataFormat = pkgObj["DataFormat"].toString();
+        Datetime = utils::StringToDatetime(pkgObj["Datetime"].toString());
+        Description = pkgObj["Description"].toString();
+        License = pkgObj["License"].toString();
+        Notes = pkgObj["Notes"].toString();
+        PackageFormat = pkgObj["PackageFormat"].toString();
+        PackageName = pkgObj["PackageName"].toString();
+        Readme = pkgObj["Readme"].toString();
+        SeriesDirFormat = pkgObj["SeriesDirectoryFormat"].toString();
+        SquirrelBuild = pkgObj["SquirrelBuild"].toString();
+        SquirrelVersion = pkgObj["SquirrelVersion"].toString();
+        StudyDirFormat = pkgObj["StudyDirectoryFormat"].toString();
+        SubjectDirFormat = pkgObj["SubjectDirectoryFormat"].toString();
+        return true;
+    };
 
-                sqrlSeries.Store(qSeriesInsert);
-            }
+    reader.onData = [&](const QJsonObject &dataObj) {
+        numSubjects = dataObj["SubjectCount"].toInteger();
+        Debug(QString("Found [%1] subjects").arg(numSubjects), __FUNCTION__);
+        utils::Print(QString("\nReading %1 subjects...").arg(numSubjects));
+        return true;
+    };
 
-            /* loop through and read all analyses */
-            QJsonArray jsonAnalyses = jsonStudy["analyses"].toArray();
-            for (const auto &d : jsonAnalyses) {
-                QJsonObject jsonAnalysis = d.toObject();
-                squirrelAnalysis sqrlAnalysis(databaseUUID);
-                sqrlAnalysis.AnalysisName = jsonAnalysis["AnalysisName"].toString();
-                sqrlAnalysis.DateClusterEnd = utils::StringToDatetime(jsonAnalysis["DateClusterEnd"].toString());
-                sqrlAnalysis.DateClusterStart = utils::StringToDatetime(jsonAnalysis["DateClusterStart"].toString());
-                sqrlAnalysis.DateEnd = utils::StringToDatetime(jsonAnalysis["DateEnd"].toString());
-                sqrlAnalysis.DateStart = utils::StringToDatetime(jsonAnalysis["DateStart"].toString());
-                sqrlAnalysis.Hostname = jsonAnalysis["Hostname"].toString();
-                sqrlAnalysis.StatusMessage = jsonAnalysis["StatusMessage"].toString();
-                sqrlAnalysis.PipelineName = jsonAnalysis["PipelineName"].toString();
-                sqrlAnalysis.PipelineVersion = jsonAnalysis["PipelineVersion"].toInt();
-                sqrlAnalysis.RunTime = jsonAnalysis["RunTime"].toInteger();
-                sqrlAnalysis.SeriesCount = jsonAnalysis["SeriesCount"].toInt();
-                sqrlAnalysis.SetupTime = jsonAnalysis["SetupTime"].toInteger();
-                sqrlAnalysis.Size = jsonAnalysis["Size"].toInteger();
-                sqrlAnalysis.Status = jsonAnalysis["Status"].toString();
-                sqrlAnalysis.Successful = jsonAnalysis["Successful"].toBool();
-                sqrlAnalysis.studyRowID = studyRowID;
-                sqrlAnalysis.Store();
-
-                Debug(QString("Added analysis [%1]").arg(sqrlAnalysis.PipelineName), __FUNCTION__);
-            }
+    /* store one decoded subject, and its child objects, linking each to its parent's new rowID */
+    auto storeSubject = [&](subjectRecord &rec) {
+        i++;
+        Debug(QString("Reading subject %1 of %2 - %3").arg(i).arg(numSubjects).arg(QDateTime::currentDateTime().toString("yyyy/MM/dd hh:mm:ss.zzz")));
+        if (numSubjects > 0)
+            utils::PrintProgress((double)i/(double)numSubjects);
+
+        StoreSubjectRecord(rec, queries);
+    };
+
+    QThreadPool decodePool;
+    decodePool.setMaxThreadCount(QThread::idealThreadCount());
+    const size_t decodeWindow = static_cast<size_t>(decodePool.maxThreadCount()) * 4;
+    std::deque<std::future<subjectRecord>> decoding;
+
+    auto storeNextSubject = [&]() {
+        subjectRecord rec = decoding.front().get();
+        decoding.pop_front();
+        storeSubject(rec);
+    };
+    auto storeAllSubjects = [&]() {
+        while (!decoding.empty())
+            storeNextSubject();
+    };
+
+    reader.onSubjectJson = [&](const QByteArray &subjectJson) {
+        while (decoding.size() >= decodeWindow)
+            storeNextSubject();
+
+        if (readMode == ReadMode::Lazy) {
+            subjectRecord rec = DecodeSubject(subjectJson, true);
+            storeSubject(rec);
+            /* subjectJson points into the package header, which is released at the end of Read() */
+            lazySubjects.insert(rec.subject.GetObjectID(), QByteArray(subjectJson.constData(), subjectJson.size()));
+            return true;
         }
 
-        /* read all observations */
-        QJsonArray jsonObservations = jsonSubject["observations"].toArray();
-        Debug(QString("Reading [%1] observations").arg(jsonObservations.size()), __FUNCTION__);
-        for (const auto &e : jsonObservations) {
-            QJsonObject jsonObservation = e.toObject();
-            squirrelObservation sqrlObservation(databaseUUID);
-            sqrlObservation.DateEnd = utils::StringToDatetime(jsonObservation["DateEnd"].toString());
-            sqrlObservation.DateStart = utils::StringToDatetime(jsonObservation["DateStart"].toString());
-            sqrlObservation.DateRecordCreate = utils::StringToDatetime(jsonObservation["DateRecordCreate"].toString());
-            sqrlObservation.DateRecordEntry = utils::StringToDatetime(jsonObservation["DateRecordEntry"].toString());
-            sqrlObservation.DateRecordModify = utils::StringToDatetime(jsonObservation["DateRecordModify"].toString());
-            sqrlObservation.Description = jsonObservation["Description"].toString();
-            sqrlObservation.Duration = jsonObservation["Duration"].toDouble();
-            sqrlObservation.InstrumentName = jsonObservation["InstrumentName"].toString();
-            sqrlObservation.ObservationName = jsonObservation["ObservationName"].toString();
-            sqrlObservation.ObservationType = jsonObservation["ObservationType"].toString();
-            sqrlObservation.Notes = jsonObservation["Notes"].toString();
-            sqrlObservation.Rater = jsonObservation["Rater"].toString();
-            sqrlObservation.Value = jsonObservation["Value"].toString();
-            sqrlObservation.subjectRowID = subjectRowID;
-            sqrlObservation.Store(qObservationInsert);
-        }
-
-        /* read all Interventions */
-        QJsonArray jsonInterventions = jsonSubject["Interventions"].toArray();
-        Debug(QString("Reading [%1] Interventions").arg(jsonInterventions.size()), __FUNCTION__);
-        for (const auto &f : jsonInterventions) {
-            QJsonObject jsonIntervention = f.toObject();
-            squirrelIntervention sqrlIntervention(databaseUUID);
-            sqrlIntervention.DateEnd = utils::StringToDatetime(jsonIntervention["DateEnd"].toString());
-            sqrlIntervention.DateRecordEntry = utils::StringToDatetime(jsonIntervention["DateRecordEntry"].toString());
-            sqrlIntervention.DateStart = utils::StringToDatetime(jsonIntervention["DateStart"].toString());
-            sqrlIntervention.DoseAmount = jsonIntervention["DoseAmount"].toDouble();
-            sqrlIntervention.DoseFrequency = jsonIntervention["DoseFrequency"].toString();
-            sqrlIntervention.DoseKey = jsonIntervention["DoseKey"].toString();
-            sqrlIntervention.DoseString = jsonIntervention["DoseString"].toString();
-            sqrlIntervention.DoseUnit = jsonIntervention["DoseUnit"].toString();
-            sqrlIntervention.InterventionClass = jsonIntervention["InterventionClass"].toString();
-            sqrlIntervention.InterventionName = jsonIntervention["InterventionName"].toString();
-            sqrlIntervention.Notes = jsonIntervention["Notes"].toString();
-            sqrlIntervention.Rater = jsonIntervention["Rater"].toString();
-            sqrlIntervention.AdministrationRoute = jsonIntervention["AdministrationRoute"].toString();
-            sqrlIntervention.subjectRowID = subjectRowID;
-            sqrlIntervention.Store(qInterventionInsert);
-        }
-    }
+        auto task = std::make_shared<std::packaged_task<subjectRecord()>>([this, subjectJson]() { return DecodeSubject(subjectJson); });
+        decoding.push_back(task->get_future());
+        decodePool.start([task]() { (*task)(); });
+        return true;
+    };
 
     /* read all experiments */
-    QJsonArray jsonExperiments;
-    jsonExperiments = root["experiments"].toArray();
-    Debug(QString("Reading [%1] experiments").arg(jsonExperiments.size()), __FUNCTION__);
-    for (const auto &g : jsonExperiments) {
-        QJsonObject jsonExperiment = g.toObject();
+    reader.onExperiment = [&](const QJsonObject &jsonExperiment) {
+        storeAllSubjects();
         squirrelExperiment sqrlExperiment(databaseUUID);
 
         sqrlExperiment.ExperimentName = jsonExperiment["ExperimentName"].toString();
         sqrlExperiment.FileCount = jsonExperiment["FileCount"].toInt();
         sqrlExperiment.Size = jsonExperiment["Size"].toInt();
         sqrlExperiment.Store();
-    }
+        return true;
+    };
 
     /* read all pipelines */
-    QJsonArray jsonPipelines;
-    jsonPipelines = root["pipelines"].toArray();
-    Debug(QString("Reading [%1] pipelines").arg(jsonPipelines.size()), __FUNCTION__);
-    for (const auto &v : jsonPipelines) {
-        QJsonObject jsonPipeline = v.toObject();
+    reader.onPipeline = [&](const QJsonObject &jsonPipeline) {
+        storeAllSubjects();
         squirrelPipeline sqrlPipeline(databaseUUID);
 
         sqrlPipeline.ClusterEngine = jsonPipeline["ClusterEngine"].toString();
@@ -672,6 +1182,23 @@ bool squirrel::Read() {
             sqrlPipeline.dataSteps.append(ds);
         }
         sqrlPipeline.Store();
+        return true;
+    };
+
+    bool readOk;
+    {
+        phaseTimer t(JsonParsePhase);
+        readOk = reader.Read();
+        storeAllSubjects();
+        decodePool.waitForDone();
+    }
+    ClearArchiveIndex();
+    if (!readOk) {
+        Log(reader.Error());
+        utils::Print(reader.Error());
+        dbconn.rollback();
+        lazySubjects.clear();
+        return false;
     }
 
     if (!dbconn.commit()) {
@@ -684,315 +1211,789 @@ bool squirrel::Read() {
     elapsedSec = static_cast<double>(timer.elapsed())/1000.0;
     utils::Print(QString("Reading package took %1 sec").arg(elapsedSec, 0, 'f', 2));
 
+    /* a lazy read can't be cached until all of its subjects have been read */
+    if (!cacheDir.isEmpty() && lazySubjects.isEmpty()) {
+        QString m;
+        if (WriteDatabaseCache(jsonHash, m))
+            Debug(m, __FUNCTION__);
+        else
+            Log(m);
+    }
+
     return true;
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- Write ------------------------------------------------ */
+/* ----- DecodeSubject ---------------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Write a squirrel package. All parameters should be set first
- * @param writeLog true if logfile should be written
- * @return true if successfuly written, false otherwise
+ * @brief Decode one subject, and all of its child objects, from the subject's JSON
+ * @param subjectJson JSON of a single subject object
+ * @param subjectOnly true to decode only the subject's own fields
+ * @return the decoded record
+ *
+ * Series params and file listings come from the current archive index, which
+ * the caller builds first. This runs on the Read() worker threads, so it must
+ * not touch the database or the log; messages are saved in the record and
+ * logged by StoreSubjectRecord().
  */
-bool squirrel::Write() {
+subjectRecord squirrel::DecodeSubject(const QByteArray &subjectJson, bool subjectOnly) {
+    subjectRecord rec(databaseUUID);
+    squirrelJsonReader subjectReader(subjectJson);
 
-    /* create the log file */
-    QFileInfo finfo(GetPackagePath());
-    logfile = QString(finfo.absolutePath() + "/squirrel-" + utils::CreateLogDate() + ".log");
+    subjectReader.onSubject = [&](const QJsonObject &jsonSubject) {
+        squirrelSubject &sqrlSubject = rec.subject;
+        sqrlSubject.ID = jsonSubject["SubjectID"].toString();
+        sqrlSubject.AlternateIDs = jsonSubject["AlternateIDs"].toVariant().toStringList();
+        sqrlSubject.GUID = jsonSubject["GUID"].toString();
+        sqrlSubject.DateOfBirth = QDate::fromString(jsonSubject["DateOfBirth"].toString(), "yyyy-MM-dd");
+        sqrlSubject.Sex = jsonSubject["Sex"].toString();
+        sqrlSubject.Gender = jsonSubject["Gender"].toString();
+        sqrlSubject.EnrollmentGroup = jsonSubject["EnrollmentGroup"].toString();
+        sqrlSubject.EnrollmentStatus = jsonSubject["EnrollmentStatus"].toString();
+        sqrlSubject.Ethnicity1 = jsonSubject["Ethnicity1"].toString();
+        sqrlSubject.Ethnicity2 = jsonSubject["Ethnicity2"].toString();
+        sqrlSubject.Notes = jsonSubject["Notes"].toString();
+        return true;
+    };
+
+    if (subjectOnly) {
+        if (!subjectReader.ReadSubjectDocument())
+            rec.log.append(subjectReader.Error());
+        return rec;
+    }
+
+    subjectReader.onStudy = [&](const QJsonObject &jsonStudy) {
+        rec.studies.append(studyRecord(databaseUUID));
+        squirrelStudy &sqrlStudy = rec.studies.last().study;
+
+        sqrlStudy.AgeAtStudy = jsonStudy["AgeAtStudy"].toDouble();
+        sqrlStudy.DateTime = QDateTime::fromString(jsonStudy["StudyDatetime"].toString(), "yyyy-MM-dd hh:mm:ss");
+        sqrlStudy.DayNumber = jsonStudy["DayNumber"].toInt();
+        sqrlStudy.Description = jsonStudy["Description"].toString();
+        sqrlStudy.Equipment = jsonStudy["Equipment"].toString();
+        sqrlStudy.Height = jsonStudy["Height"].toDouble();
+        sqrlStudy.Modality = jsonStudy["Modality"].toString();
+        sqrlStudy.Notes = jsonStudy["Notes"].toString();
+        sqrlStudy.StudyNumber = jsonStudy["StudyNumber"].toInt();
+        sqrlStudy.StudyUID = jsonStudy["StudyUID"].toString();
+        sqrlStudy.TimePoint = jsonStudy["TimePoint"].toInt();
+        sqrlStudy.VisitType = jsonStudy["VisitType"].toString();
+        sqrlStudy.Weight = jsonStudy["Weight"].toDouble();
+        return true;
+    };
+
+    subjectReader.onSeries = [&](const QJsonObject &jsonSeries) {
+        squirrelSeries sqrlSeries(databaseUUID);
+
+        sqrlSeries.BidsEntity = jsonSeries["BidsEntity"].toString();
+        sqrlSeries.BidsPhaseEncodingDirection = jsonSeries["BidsPhaseEncodingDirection"].toString();
+        sqrlSeries.BidsRun = jsonSeries["BidsRun"].toString();
+        sqrlSeries.BidsSuffix = jsonSeries["BidsSuffix"].toString();
+        sqrlSeries.BidsTask = jsonSeries["BidsTask"].toString();
+        sqrlSeries.BehavioralFileCount = jsonSeries["BehavioralFileCount"].toInteger();
+        sqrlSeries.BehavioralSize = jsonSeries["BehavioralSize"].toInteger();
+        //sqrlSeries.DateTime = utils::StringToDatetime(jsonSeries["SeriesDatetime"].toString());
+        sqrlSeries.DateTime = QDateTime::fromString(jsonSeries["SeriesDatetime"].toString(), "yyyy-MM-dd hh:mm:ss");
+        sqrlSeries.Description = jsonSeries["Description"].toString();
+        //sqrlSeries.FileCount = jsonSeries["FileCount"].toInteger();
+        sqrlSeries.Protocol = jsonSeries["Protocol"].toString();
+        sqrlSeries.SeriesNumber = jsonSeries["SeriesNumber"].toInteger();
+        sqrlSeries.SeriesUID = jsonSeries["SeriesUID"].toString();
+        sqrlSeries.Size = jsonSeries["Size"].toInteger();
+
+        if (readMode != ReadMode::Quick) {
+            /* params.json and the file listing both come from the archive index built by the caller.
+               The index keys always use '/' as the separator, regardless of platform */
+            QString seriesPath = QString("data/%1/%2/%3").arg(rec.subject.ID).arg(rec.studies.last().study.StudyNumber).arg(sqrlSeries.SeriesNumber);
+            if (archiveParams.contains(seriesPath)) {
+                sqrlSeries.params = ReadParamsFile(QString::fromUtf8(archiveParams.value(seriesPath)));
+                if (debug)
+                    rec.debug.append(QString("Read params file [%1/params.json]. series.params contains [%2] items").arg(seriesPath).arg(sqrlSeries.params.size()));
+            }
+            else {
+                rec.log.append("Unable to read params file [" + seriesPath + "/params.json]");
+            }
 
-    //PrintPackage();
+            /* get file listing */
+            QStringList files = archiveSeriesFiles.value(seriesPath);
+            if (debug)
+                rec.debug.append(QString("archiveSeriesPath [%1] found [%2] files [%3]").arg(seriesPath).arg(files.size()).arg(files.join(",")));
+            sqrlSeries.files = files;
+            sqrlSeries.FileCount = files.size();
+        }
 
-    if (fileMode == NewPackage) {
-        MakeTempDir(workingDir);
-        Log(QString("Writing NEW squirrel package [%1]").arg(GetPackagePath()));
-        Debug(QString("Writing NEW squirrel package. Working directory [%1]  packagePath [%2]").arg(workingDir).arg(GetPackagePath()));
+        rec.studies.last().series.append(sqrlSeries);
+        return true;
+    };
+
+    subjectReader.onAnalysis = [&](const QJsonObject &jsonAnalysis) {
+        squirrelAnalysis sqrlAnalysis(databaseUUID);
+        sqrlAnalysis.AnalysisName = jsonAnalysis["AnalysisName"].toString();
+        sqrlAnalysis.DateClusterEnd = utils::StringToDatetime(jsonAnalysis["DateClusterEnd"].toString());
+        sqrlAnalysis.DateClusterStart = utils::StringToDatetime(jsonAnalysis["DateClusterStart"].toString());
+        sqrlAnalysis.DateEnd = utils::StringToDatetime(jsonAnalysis["DateEnd"].toString());
+        sqrlAnalysis.DateStart = utils::StringToDatetime(jsonAnalysis["DateStart"].toString());
+        sqrlAnalysis.Hostname = jsonAnalysis["Hostname"].toString();
+        sqrlAnalysis.StatusMessage = jsonAnalysis["StatusMessage"].toString();
+        sqrlAnalysis.PipelineName = jsonAnalysis["PipelineName"].toString();
+        sqrlAnalysis.PipelineVersion = jsonAnalysis["PipelineVersion"].toInt();
+        sqrlAnalysis.RunTime = jsonAnalysis["RunTime"].toInteger();
+        sqrlAnalysis.SeriesCount = jsonAnalysis["SeriesCount"].toInt();
+        sqrlAnalysis.SetupTime = jsonAnalysis["SetupTime"].toInteger();
+        sqrlAnalysis.Size = jsonAnalysis["Size"].toInteger();
+        sqrlAnalysis.Status = jsonAnalysis["Status"].toString();
+        sqrlAnalysis.Successful = jsonAnalysis["Successful"].toBool();
+        rec.studies.last().analyses.append(sqrlAnalysis);
+        return true;
+    };
+
+    subjectReader.onObservation = [&](const QJsonObject &jsonObservation) {
+        squirrelObservation sqrlObservation(databaseUUID);
+        sqrlObservation.DateEnd = utils::StringToDatetime(jsonObservation["DateEnd"].toString());
+        sqrlObservation.DateStart = utils::StringToDatetime(jsonObservation["DateStart"].toString());
+        sqrlObservation.DateRecordCreate = utils::StringToDatetime(jsonObservation["DateRecordCreate"].toString());
+        sqrlObservation.DateRecordEntry = utils::StringToDatetime(jsonObservation["DateRecordEntry"].toString());
+        sqrlObservation.DateRecordModify = utils::StringToDatetime(jsonObservation["DateRecordModify"].toString());
+        sqrlObservation.Description = jsonObservation["Description"].toString();
+        sqrlObservation.Duration = jsonObservation["Duration"].toDouble();
+        sqrlObservation.InstrumentName = jsonObservation["InstrumentName"].toString();
+        sqrlObservation.ObservationName = jsonObservation["ObservationName"].toString();
+        sqrlObservation.ObservationType = jsonObservation["ObservationType"].toString();
+        sqrlObservation.Notes = jsonObservation["Notes"].toString();
+        sqrlObservation.Rater = jsonObservation["Rater"].toString();
+        sqrlObservation.Value = jsonObservation["Value"].toString();
+        rec.observations.append(sqrlObservation);
+        return true;
+    };
+
+    subjectReader.onIntervention = [&](const QJsonObject &jsonIntervention) {
+        squirrelIntervention sqrlIntervention(databaseUUID);
+        sqrlIntervention.DateEnd = utils::StringToDatetime(jsonIntervention["DateEnd"].toString());
+        sqrlIntervention.DateRecordEntry = utils::StringToDatetime(jsonIntervention["DateRecordEntry"].toString());
+        sqrlIntervention.DateStart = utils::StringToDatetime(jsonIntervention["DateStart"].toString());
+        sqrlIntervention.DoseAmount = jsonIntervention["DoseAmount"].toDouble();
+        sqrlIntervention.DoseFrequency = jsonIntervention["DoseFrequency"].toString();
+        sqrlIntervention.DoseKey = jsonIntervention["DoseKey"].toString();
+        sqrlIntervention.DoseString = jsonIntervention["DoseString"].toString();
+        sqrlIntervention.DoseUnit = jsonIntervention["DoseUnit"].toString();
+        sqrlIntervention.InterventionClass = jsonIntervention["InterventionClass"].toString();
+        sqrlIntervention.InterventionName = jsonIntervention["InterventionName"].toString();
+        sqrlIntervention.Notes = jsonIntervention["Notes"].toString();
+        sqrlIntervention.Rater = jsonIntervention["Rater"].toString();
+        sqrlIntervention.AdministrationRoute = jsonIntervention["AdministrationRoute"].toString();
+        rec.interventions.append(sqrlIntervention);
+        return true;
+    };
+
+    if (!subjectReader.ReadSubjectDocument())
+        rec.log.append(subjectReader.Error());
+
+    return rec;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- StoreSubjectRecord ----------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Store a decoded subject, and its child objects, linking each to its parent's new rowID
+ * @param rec the decoded subject
+ * @param queries prepared bulk-insert queries
+ * @param subjectRowID rowID of the subject if it is already stored, or -1 to store it
+ */
+void squirrel::StoreSubjectRecord(subjectRecord &rec, readQueries &queries, qint64 subjectRowID) {
+    phaseTimer t(SqlInsertPhase);
+    for (const QString &msg : rec.log)
+        Log(msg);
+    if (debug) {
+        for (const QString &msg : rec.debug)
+            Debug(msg, __FUNCTION__);
     }
-    else {
-        Log(QString("Updating existing squirrel package [%1]").arg(GetPackagePath()));
+
+    if (subjectRowID < 0) {
+        rec.subject.Store(queries.subject);
+        subjectRowID = rec.subject.GetObjectID();
     }
 
-    pairList stagedFiles;
+    for (studyRecord &studyRec : rec.studies) {
+        studyRec.study.subjectRowID = subjectRowID;
+        studyRec.study.Store(queries.study);
+        qint64 studyRowID = studyRec.study.GetObjectID();
 
-    /* ----- 1) Write data. And set the relative paths in the objects ----- */
-    /* iterate through subjects */
-    QSqlDatabase writeDbconn = QSqlDatabase::database(databaseUUID);
-    if (!writeDbconn.transaction())
-        Log(QString("Warning: could not start write transaction: %1").arg(writeDbconn.lastError().text()));
-    QList<squirrelSubject> subjects = GetSubjectList();
-    for (auto &subject : subjects) {
-        qint64 subjectRowID = subject.GetObjectID();
-        Debug(QString("Writing subject [%1] to virtualPath [%2]").arg(subject.ID).arg(subject.VirtualPath()));
+        Debug(QString("Reading study [%1][%2]").arg(rec.subject.ID).arg(studyRec.study.StudyNumber), __FUNCTION__);
 
-        /* iterate through studies */
-        QList<squirrelStudy> studies = GetStudyList(subjectRowID);
-        for (auto &study : studies) {
-            qint64 studyRowID = study.GetObjectID();
-            Debug(QString("Writing study [%1] to virtualPath [%2]").arg(study.StudyNumber).arg(study.VirtualPath()));
+        for (squirrelSeries &sqrlSeries : studyRec.series) {
+            sqrlSeries.studyRowID = studyRowID;
+            sqrlSeries.Store(queries.series);
+        }
 
-            /* iterate through series */
-            QList<squirrelSeries> serieses = GetSeriesList(studyRowID);
-            Debug(QString("Writing [%1] series for [%2][%3]").arg(serieses.size()).arg(subject.ID).arg(study.StudyNumber));
-            for (auto series : serieses) {
-                QString m;
-                QString seriesPath;
-                #ifdef Q_OS_WINDOWS
-                    seriesPath = QString("%1\\%2").arg(workingDir).arg(series.VirtualPath());
-                #else
-                    seriesPath = QString("%1/%2").arg(workingDir).arg(series.VirtualPath());
-                #endif
-
-                if (fileMode == FileMode::NewPackage) {
-                    utils::MakePath(seriesPath,m);
-                    Log(QString("Preparing series [%1-%2-%3]...").arg(subject.ID).arg(study.StudyNumber).arg(series.SeriesNumber));
-                    Debug(QString("Staging [%1-%2-%3] to tmpdir [%4]. Data format [%5]").arg(subject.ID).arg(study.StudyNumber).arg(series.SeriesNumber).arg(seriesPath).arg(DataFormat));
-
-                    /* orig vs other formats */
-                    if (DataFormat == "orig") {
-                        Debug(QString("Export data format is 'orig'. Copying [%1] files...").arg(series.stagedFiles.size()), __FUNCTION__);
-                        /* copy all of the series files to the temp directory */
-                        foreach (QString f, series.stagedFiles) {
-                            if (utils::CopyFileToDir(f, seriesPath))
-                                Debug(QString("  ... copying original files from %1 to %2").arg(f).arg(seriesPath));
-                            else
-                                Log(QString("  ERROR copying original files from %1 to %2").arg(f).arg(seriesPath));
-                        }
-                    }
-                    else if (study.Modality.toUpper() != "MR") {
-                        Debug(QString("Study modality is [%1]. Copying files...").arg(study.Modality.toUpper()), __FUNCTION__);
-                        /* copy all of the series files to the temp directory */
-                        foreach (QString f, series.stagedFiles) {
-                            if (utils::CopyFileToDir(f, seriesPath))
-                                Debug(QString("  ... copying original files from %1 to %2").arg(f).arg(seriesPath));
-                            else
-                                Log(QString("  ERROR copying original files from %1 to %2").arg(f).arg(seriesPath));
-                        }
-                    }
-                    else if ((DataFormat == "anon") || (DataFormat == "anonfull")) {
-                        /* create temp directory for the anonymization */
-                        QString td;
-                        if (MakeTempDir(td)) {
-                            /* copy all files to temp directory */
-                            QString systemstring;
-                            foreach (QString f, series.stagedFiles) {
-                                if (utils::CopyFileToDir(f, td))
-                                    Debug(QString("  ... copying original files from %1 to %2").arg(f).arg(td));
-                                else
-                                    Log(QString("  ERROR copying original files from %1 to %2").arg(f).arg(td));
-                            }
+        for (squirrelAnalysis &sqrlAnalysis : studyRec.analyses) {
+            sqrlAnalysis.studyRowID = studyRowID;
+            sqrlAnalysis.Store();
+            Debug(QString("Added analysis [%1]").arg(sqrlAnalysis.PipelineName), __FUNCTION__);
+        }
+    }
 
-                            /* copy all dicom files from indir to outdir */
-                            systemstring = QString("rsync %1/* %2/").arg(td).arg(seriesPath);
-                            utils::SystemCommand(systemstring);
-
-                            /* anonymize the directory */
-                            squirrelImageIO io;
-                            QString m;
-                            if (DataFormat == "anon")
-                                io.AnonymizeDicomDirInPlace(seriesPath, 1, m);
-                            else
-                                io.AnonymizeDicomDirInPlace(seriesPath, 2, m);
-
-                            /* move the anonymized files to the staging area */
-                            //systemstring = QString("mv %1/* %2/").arg(td).arg(seriesPath);
-                            //Log(QString("  ... anonymizing DICOM files from %1 to %2").arg(td).arg(seriesPath));
-                            //Debug(utils::SystemCommand(systemstring), __FUNCTION__);
-
-                            /* delete temp directory */
-                            DeleteTempDir(td);
-                        }
-                        else
-                            Log("Error creating temp directory for DICOM anonymization");
-                    }
-                    else if (DataFormat.contains("nifti")) {
-                        int numConv(0), numRename(0);
-                        bool gzip;
-                        if (DataFormat.contains("gz"))
-                            gzip = true;
-                        else
-                            gzip = false;
-
-                        /* get path of first file to be converted */
-                        if (series.stagedFiles.size() > 0) {
-                            Log(QString("   ...converting %1 files to Nifti").arg(series.stagedFiles.size()));
-
-                            QFileInfo f(series.stagedFiles[0]);
-                            QString origSeriesPath = f.absoluteDir().absolutePath();
-                            squirrelImageIO io;
-                            QString m3;
-                            if (io.ConvertDicom(DataFormat, origSeriesPath, seriesPath, QDir::currentPath(), gzip, utils::CleanString(subject.ID), QString("%1").arg(study.StudyNumber), QString("%1").arg(series.SeriesNumber), "dicom", numConv, numRename, m3))
-                                Debug(QString("ConvertDicom() returned [%1]").arg(m3), __FUNCTION__);
-                            else
-                                Log(QString("ConvertDicom() failed. Returned [%1]").arg(m3));
-                        }
-                        else {
-                            Debug(QString("Variable squirrelSeries.stagedFiles is empty. No files to convert to Nifti"));
-                        }
-                    }
-                    else
-                        Log(QString("DataFormat [%1] not recognized").arg(DataFormat));
-
-                    /* get the number of files and size of the series */
-                    qint64 c(0), b(0);
-                    utils::GetDirSizeAndFileCount(seriesPath, c, b, false);
-                    series.FileCount = c;
-                    series.Size = b;
-                    series.Store();
-
-                    /* write the series .json file, containing the dicom header params */
-                    QString paramFilePath = QString("%1/params.json").arg(seriesPath);
-                    QByteArray j = QJsonDocument(series.ParamsToJSON()).toJson();
-                    if (!utils::WriteTextFile(paramFilePath, j))
-                        Log("Error writing [" + paramFilePath + "]");
-                }
-            }
-        }
+    for (squirrelObservation &sqrlObservation : rec.observations) {
+        sqrlObservation.subjectRowID = subjectRowID;
+        sqrlObservation.Store(queries.observation);
     }
-    if (!writeDbconn.commit())
-        Log(QString("Warning: could not commit write transaction: %1").arg(writeDbconn.lastError().text()));
 
-    /* ----- 2) write .json file ----- */
-    Debug("Creating header file...");
-    /* create JSON object */
-    QJsonObject root;
+    for (squirrelIntervention &sqrlIntervention : rec.interventions) {
+        sqrlIntervention.subjectRowID = subjectRowID;
+        sqrlIntervention.Store(queries.intervention);
+    }
+}
 
-    QJsonObject pkgInfo;
-    pkgInfo["Changes"] = Changes;
-    pkgInfo["DataFormat"] = DataFormat;
-    pkgInfo["Datetime"] = utils::CreateCurrentDateTime(2);
-    pkgInfo["Description"] = Description;
-    pkgInfo["License"] = License;
-    pkgInfo["Notes"] = Notes;
-    pkgInfo["PackageFormat"] = PackageFormat;
-    pkgInfo["PackageName"] = PackageName;
-    pkgInfo["Readme"] = Readme;
-    pkgInfo["SeriesDirectoryFormat"] = SeriesDirFormat;
-    pkgInfo["SquirrelBuild"] = SquirrelBuild;
-    pkgInfo["SquirrelVersion"] = SquirrelVersion;
-    pkgInfo["StudyDirectoryFormat"] = StudyDirFormat;
-    pkgInfo["SubjectDirectoryFormat"] = SubjectDirFormat;
 
-    root["package"] = pkgInfo;
+/* ------------------------------------------------------------ */
+/* ----- MaterializeSubject ----------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read the child objects of a subject that was read in lazy mode
+ * @param subjectRowID database row ID of the subject
+ * @return true if successful, or if the subject's children were already read
+ *
+ * Decodes the subject's studies, series, analyses, observations, and
+ * interventions from the JSON saved by Read(), and stores them. The series
+ * params and file listings come from an index of only this subject's data
+ * directory in the archive, so a package can be opened and one subject
+ * browsed without reading the rest of the package.
+ */
+bool squirrel::MaterializeSubject(qint64 subjectRowID) {
+    if ((subjectRowID < 0) || !lazySubjects.contains(subjectRowID))
+        return true;
+
+    squirrelSubject subject = GetSubject(subjectRowID);
+    Debug(QString("Reading child objects of subject [%1]").arg(subject.ID), __FUNCTION__);
+    phaseTimer t(JsonParsePhase);
+
+    QString m;
+    if (!BuildArchiveIndex(GetPackagePath(), m, QString("data/%1/").arg(subject.ID)))
+        Log(QString("Error indexing package archive. Series params and file listings will be empty. Message [%1]").arg(m));
+    else
+        Debug(m, __FUNCTION__);
 
-    QJsonObject data;
-    QJsonArray JSONsubjects;
+    QByteArray subjectJson = lazySubjects.take(subjectRowID);
+    subjectRecord rec = DecodeSubject(subjectJson);
+    ClearArchiveIndex();
 
-    /* add subjects to JSON */
-    Log(QString("Adding %1 subjects").arg(subjects.size()));
-    for (auto &subject : subjects) {
-        JSONsubjects.append(subject.ToJSON());
+    QSqlDatabase dbconn = QSqlDatabase::database(databaseUUID);
+    bool inTransaction = dbconn.transaction();
+    readQueries queries(dbconn);
+    StoreSubjectRecord(rec, queries, subjectRowID);
+    if (inTransaction && !dbconn.commit()) {
+        Log(QString("Error committing subject [%1]. Error [%2]").arg(subject.ID).arg(dbconn.lastError().text()));
+        dbconn.rollback();
+        return false;
     }
 
-    /* add group-analyses */
-    QList <squirrelGroupAnalysis> groupAnalyses = GetGroupAnalysisList();
-    if (groupAnalyses.size() > 0) {
-        Log(QString("Adding %1 group-analyses").arg(groupAnalyses.size()));
-        QJsonArray JSONgroupanalyses;
-        for (auto &g : groupAnalyses) {
-            JSONgroupanalyses.append(g.ToJSON());
-            stagedFiles += g.GetStagedFileList();
-            Log(QString("Added group-analysis [%1]").arg(g.GroupAnalysisName));
-        }
-        data["GroupAnalysisCount"] = JSONgroupanalyses.size();
-        data["group-analysis"] = JSONgroupanalyses;
+    return true;
+}
+
+
+/**
+ * @brief Read the child objects of a subject that was read in lazy mode
+ * @param subjectID the subject's ID
+ * @return true if successful, or if the subject doesn't exist or its children were already read
+ */
+bool squirrel::MaterializeSubject(QString subjectID) {
+    if (lazySubjects.isEmpty())
+        return true;
+
+    qint64 subjectRowID = FindSubject(subjectID);
+    if (subjectRowID < 0)
+        return true;
+
+    return MaterializeSubject(subjectRowID);
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- MaterializeAllSubjects ------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read the child objects of every subject that was read in lazy mode
+ * @return true if successful
+ *
+ * Used by operations that need the whole package, such as Write(). The
+ * archive is indexed once for all of the remaining subjects.
+ */
+bool squirrel::MaterializeAllSubjects() {
+    if (lazySubjects.isEmpty())
+        return true;
+
+    Log(QString("Reading child objects of the remaining [%1] subjects").arg(lazySubjects.size()));
+
+    QString m;
+    if (!BuildArchiveIndex(GetPackagePath(), m))
+        Log(QString("Error indexing package archive. Series params and file listings will be empty. Message [%1]").arg(m));
+    else
+        Debug(m, __FUNCTION__);
+
+    QSqlDatabase dbconn = QSqlDatabase::database(databaseUUID);
+    bool inTransaction = dbconn.transaction();
+    readQueries queries(dbconn);
+
+    QList<qint64> subjectRowIDs = lazySubjects.keys();
+    std::sort(subjectRowIDs.begin(), subjectRowIDs.end());
+    for (qint64 subjectRowID : subjectRowIDs) {
+        subjectRecord rec = DecodeSubject(lazySubjects.take(subjectRowID));
+        StoreSubjectRecord(rec, queries, subjectRowID);
     }
+    ClearArchiveIndex();
 
-    data["SubjectCount"] = JSONsubjects.size();
-    data["subjects"] = JSONsubjects;
-    root["data"] = data;
+    if (inTransaction && !dbconn.commit()) {
+        Log(QString("Error committing subjects. Error [%1]").arg(dbconn.lastError().text()));
+        dbconn.rollback();
+        return false;
+    }
 
-    /* add pipelines */
-    QList <squirrelPipeline> pipelines = GetPipelineList();
-    if (pipelines.size() > 0) {
-        Log(QString("Adding %1 pipelines").arg(pipelines.size()));
-        QJsonArray JSONpipelines;
-        for (auto &p : pipelines) {
-            JSONpipelines.append(p.ToJSON(workingDir));
-            stagedFiles += p.GetStagedFileList();
-            Log(QString("Added pipeline [%1]").arg(p.PipelineName));
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- Write ------------------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Write a squirrel package. All parameters should be set first
+ * @param writeLog true if logfile should be written
+ * @return true if successfuly written, false otherwise
+ */
+bool squirrel::Write() {
+
+    /* create the log file */
+    QFileInfo finfo(GetPackagePath());
+    logfile = QString(finfo.absolutePath() + "/squirrel-" + utils::CreateLogDate() + ".log");
+
+    //PrintPackage();
+
+    if (fileMode == NewPackage) {
+        Log(QString("Writing NEW squirrel package [%1]").arg(GetPackagePath()));
+        Debug(QString("Writing NEW squirrel package. packagePath [%1]").arg(GetPackagePath()));
+    }
+    else {
+        Log(QString("Updating existing squirrel package [%1]").arg(GetPackagePath()));
+    }
+
+    /* a package read in lazy mode is written whole */
+    if (!MaterializeAllSubjects())
+        return false;
+
+    pairList stagedFiles;
+
+    /* files for a new package, added to the archive from where they are. Only series that need
+       to be converted are staged to the working directory first. Generated files (params.json and
+       squirrel.json) are added from memory */
+    QStringList archiveDiskPaths, archiveFilePaths;
+    QSet<QString> archiveFileSet;
+    QMap<QString, QByteArray> archiveMemoryFiles;
+
+    /* a deduplicated package stores each file's contents once per layer. A file whose contents are already in
+       the layer being written is recorded as an alias of the stored file, in the layer's aliases.json, instead
+       of being added again. An alias is only resolved within its own layer */
+    const bool dedup = deduplicate && (fileMode == FileMode::NewPackage);
+    QHash<QByteArray, QString> storedContents;
+    QHash<QString, QString> aliases, batchAliases, compressingAliases;
+    auto addArchiveFile = [&](QString diskPath, QString archiveFile, QByteArray hash = QByteArray()) {
+        if (archiveFileSet.contains(archiveFile)) {
+            Log(QString("  ERROR adding [%1]. [%2] is already in the package").arg(diskPath).arg(archiveFile));
+            return false;
+        }
+        archiveFileSet.insert(archiveFile);
+        if (dedup && !hash.isEmpty()) {
+            auto stored = storedContents.constFind(hash);
+            if (stored != storedContents.constEnd()) {
+                aliases.insert(archiveFile, stored.value());
+                batchAliases.insert(archiveFile, stored.value());
+                return true;
+            }
+            storedContents.insert(hash, archiveFile);
+        }
+        archiveDiskPaths.append(diskPath);
+        archiveFilePaths.append(archiveFile);
+        return true;
+    };
+
+    /* when series are converted, the package is written in batches of series on a separate thread, so the
+       compression of one batch overlaps the staging of the next. Each batch is written once, as its own layer
+       of the package: the first batch creates the package, and each later batch is written to a new segment,
+       so no batch is read or rewritten after it is compressed. The package is left in its layers, which
+       Read() and the extract functions handle, and CompactArchive() can join. A batch's converted series are
+       deleted from the working directory once it is compressed, so at most a few batches of converted series
+       are on disk at a time */
+    std::future<QPair<bool, QString>> compressing;
+    QStringList compressingStagingDirs, batchStagingDirs;
+    QList<journalSeries> compressingSeries, batchSeries;
+    QString compressingLayer;
+    int batchSeriesCount(0);
+    int layersWritten(0);
+    bool batchesOk(true);
+    auto writeLayer = [this, packagePath = GetPackagePath()](int layer, const QStringList &diskPaths, const QStringList &filePaths, const QMap<QString, QByteArray> &memoryFiles, QString &m) {
+        if (layer == 1)
+            return CompressFilesToArchive(diskPaths, filePaths, memoryFiles, packagePath, m);
+        /* a segment appears under its final name only once it is complete */
+        QString partialPath = ArchiveSegmentPath(packagePath, layer - 1, true);
+        QString segmentPath = ArchiveSegmentPath(packagePath, layer - 1);
+        QFile::remove(partialPath);
+        if (!CompressFilesToArchive(diskPaths, filePaths, memoryFiles, partialPath, m) || !QFile::rename(partialPath, segmentPath)) {
+            QFile::remove(partialPath);
+            if (m.isEmpty())
+                m = QString("Unable to rename segment [%1] to [%2]").arg(partialPath).arg(segmentPath);
+            return false;
+        }
+        return true;
+    };
+    auto layerPath = [packagePath = GetPackagePath()](int layer) {
+        return (layer == 1) ? packagePath : ArchiveSegmentPath(packagePath, layer - 1);
+    };
+
+    /* the working directory has a checkpoint journal. A batch's converted series are kept until the batch is
+       in the package and in the journal, so an interrupted write can be resumed with the same package path
+       and options. It skips the series already in the package, and reuses the series already converted */
+    writeJournal journal;
+    bool journalOpen(false);
+    std::unique_ptr<QLockFile> workingDirLock;
+    QStringList writeOptions = {QFileInfo(GetPackagePath()).absoluteFilePath(), DataFormat, SubjectDirFormat, StudyDirFormat, SeriesDirFormat, compression.method, QString::number(compression.level), QString::number(compression.dictionarySize), QString::number(compression.storeCompressed), QString::number(dedup)};
+    /* open the working directory and its journal. Returns false if the write can't go ahead: another write of the
+       package holds the working directory, or the package doesn't match the journal and may not be overwritten */
+    auto openWorkingDir = [&]() {
+        QString m;
+        workingDir = WriteWorkingDirPath();
+        if (!utils::MakePath(workingDir, m)) {
+            Log("Error [" + m + "] creating working directory [" + workingDir + "]");
+            workingDir = "";
+            return true;
+        }
+
+        /* the lock is held until the write finishes, so two writes of the same package can't share the journal.
+           A lock left by a process that is no longer running is taken over */
+        workingDirLock = std::make_unique<QLockFile>(workingDir + "/write.lock");
+        workingDirLock->setStaleLockTime(0);
+        if (!workingDirLock->tryLock(0)) {
+            Log(QString("Error. Working directory [%1] is in use by another write of package [%2]").arg(workingDir).arg(GetPackagePath()));
+            workingDirLock.reset();
+            workingDir = "";
+            return false;
+        }
+        Debug(QString("Working directory [%1]").arg(workingDir), __FUNCTION__);
+
+        journalOpen = journal.Open(workingDir, writeOptions.join("\t"), ArchiveLayers(GetPackagePath()), overwritePackage, m);
+        if (!m.isEmpty())
+            Log(m);
+        if (journal.Mismatch()) {
+            if (!overwritePackage) {
+                Log(QString("Error. Package [%1] was changed after the earlier write of it was interrupted. Use the overwrite option to write it again from the start").arg(GetPackagePath()));
+                workingDirLock.reset();
+                workingDir = "";
+                return false;
+            }
+            Log(QString("Overwrite option specified. Package [%1] will be written again from the start").arg(GetPackagePath()));
+            for (const QString &layer : ArchiveLayers(GetPackagePath())) {
+                QFile::remove(layer);
+                QFile::remove(ArchiveIndexFilePath(layer));
+            }
         }
-        root["PipelineCount"] = JSONpipelines.size();
-        root["pipelines"] = JSONpipelines;
+        if (!journalOpen)
+            Log("Error opening the write journal in [" + workingDir + "]. This write can not be resumed");
+        else if (journal.Resumed())
+            Log(QString("Resuming an earlier write of this package. [%1] batches of series are already in the package").arg(journal.Segments()));
+        /* segments past the journal's batches are from a batch that didn't finish, and are written again */
+        layersWritten = journal.Segments();
+        if (journal.Resumed()) {
+            for (const QString &segment : ArchiveSegments(GetPackagePath()).mid(std::max(layersWritten - 1, 0))) {
+                QFile::remove(segment);
+                QFile::remove(ArchiveIndexFilePath(segment));
+            }
+        }
+        aliases = journal.Aliases();
+        return true;
+    };
+
+    auto finishBatch = [&]() {
+        if (!compressing.valid())
+            return;
+        QPair<bool, QString> result = compressing.get();
+        if (result.first) {
+            Debug(result.second, "Write");
+            if (journalOpen)
+                journal.Segment(compressingSeries, compressingAliases, QFileInfo(compressingLayer).size());
+            QString im;
+            if (!WriteArchiveIndexFile(compressingLayer, im))
+                Log(im);
+            for (const QString &dir : compressingStagingDirs) {
+                QString m;
+                if (!utils::RemoveDir(dir, m))
+                    Log("Error [" + m + "] removing directory [" + dir + "]");
+            }
+        }
+        else {
+            Log("Error writing a batch of series to the package [" + result.second + "]");
+            batchesOk = false;
+        }
+        compressingStagingDirs.clear();
+        compressingSeries.clear();
+        compressingAliases.clear();
+    };
+    auto startBatch = [&]() {
+        finishBatch();
+        if (!batchesOk)
+            return;
+        if (!batchAliases.isEmpty())
+            archiveMemoryFiles.insert("aliases.json", AliasesToJson(batchAliases));
+        Debug(QString("Writing batch of [%1] series. [%2] files, [%3] generated files").arg(batchSeriesCount).arg(archiveDiskPaths.size()).arg(archiveMemoryFiles.size()), "Write");
+        layersWritten++;
+        compressing = std::async(std::launch::async, [writeLayer, layer = layersWritten, diskPaths = archiveDiskPaths, filePaths = archiveFilePaths, memoryFiles = archiveMemoryFiles]() {
+            QString m;
+            bool ok = writeLayer(layer, diskPaths, filePaths, memoryFiles, m);
+            return QPair<bool, QString>(ok, m);
+        });
+        compressingLayer = layerPath(layersWritten);
+        compressingStagingDirs = batchStagingDirs;
+        compressingSeries = batchSeries;
+        compressingAliases = batchAliases;
+        batchStagingDirs.clear();
+        batchSeries.clear();
+        batchAliases.clear();
+        storedContents.clear();
+        archiveDiskPaths.clear();
+        archiveFilePaths.clear();
+        archiveMemoryFiles.clear();
+        batchSeriesCount = 0;
+    };
+
+    /* ----- 1) Write data. And set the relative paths in the objects ----- */
+    /* series are staged on a bounded pool of workers. The workers do no database access; their
+       results are applied in series order on this thread, which owns the database connection */
+    const QString bindir = QDir::currentPath();
+    QThreadPool stagingPool;
+    stagingPool.setMaxThreadCount(GetWriteThreads());
+    const size_t stagingWindow = static_cast<size_t>(stagingPool.maxThreadCount()) * 2;
+    struct pendingSeries {
+        squirrelSeries series;
+        QString archivePath;
+        std::future<seriesStagingRecord> result;
+    };
+    std::deque<pendingSeries> staging;
+
+    auto storeNextSeries = [&]() {
+        pendingSeries &p = staging.front();
+        seriesStagingRecord rec = p.result.get();
+        for (const QString &msg : rec.log)
+            Log(msg);
+        if (debug) {
+            for (const QString &msg : rec.debug)
+                Debug(msg, "StageSeries");
+        }
+
+        /* the number of files and size of the series */
+        qint64 c(0), b(0);
+        for (const auto &f : rec.files) {
+            if (addArchiveFile(f.diskPath, f.archiveFile, f.hash)) {
+                c++;
+                b += f.size;
+            }
+        }
+        p.series.FileCount = c;
+        p.series.Size = b;
+        p.series.Store();
+        batchSeries.append({p.archivePath, c, b, QByteArray()});
+        if (journalOpen && !rec.stagingDir.isEmpty())
+            journal.Staged({p.archivePath, c, b, StagedFilesChecksum(rec.files)});
+
+        /* the series params.json, containing the dicom header params */
+        archiveMemoryFiles.insert(p.archivePath + "/params.json", QJsonDocument(p.series.ParamsToJSON()).toJson());
+        if (!rec.stagingDir.isEmpty())
+            batchStagingDirs.append(rec.stagingDir);
+        staging.pop_front();
+
+        batchSeriesCount++;
+        if ((fileMode == FileMode::NewPackage) && !workingDir.isEmpty() && (batchSeriesCount >= static_cast<int>(stagingWindow)))
+            startBatch();
+    };
+
+    /* a working directory with a journal is left by an interrupted write of this package */
+    if ((fileMode == FileMode::NewPackage) && (DataFormat != "orig") && QFileInfo::exists(WriteWorkingDirPath() + "/write.journal")) {
+        if (!openWorkingDir())
+            return false;
     }
 
-    /* add experiments */
-    QList <squirrelExperiment> exps = GetExperimentList();
-    if (exps.size() > 0) {
-        Log(QString("Adding %1 experiments").arg(exps.size()));
-        QJsonArray JSONexperiments;
-        for (auto &e : exps) {
-            JSONexperiments.append(e.ToJSON());
-            stagedFiles += e.GetStagedFileList();
-            Log(QString("Added experiment [%1]").arg(e.ExperimentName));
+    /* iterate through subjects */
+    QSqlDatabase writeDbconn = QSqlDatabase::database(databaseUUID);
+    if (!writeDbconn.transaction())
+        Log(QString("Warning: could not start write transaction: %1").arg(writeDbconn.lastError().text()));
+    QList<squirrelSubject> subjects = GetSubjectList();
+    for (auto &subject : subjects) {
+        qint64 subjectRowID = subject.GetObjectID();
+        Debug(QString("Writing subject [%1] to virtualPath [%2]").arg(subject.ID).arg(subject.VirtualPath()));
+
+        /* iterate through studies */
+        QList<squirrelStudy> studies = GetStudyList(subjectRowID);
+        for (auto &study : studies) {
+            qint64 studyRowID = study.GetObjectID();
+            Debug(QString("Writing study [%1] to virtualPath [%2]").arg(study.StudyNumber).arg(study.VirtualPath()));
+
+            /* iterate through series */
+            QList<squirrelSeries> serieses = GetSeriesList(studyRowID);
+            Debug(QString("Writing [%1] series for [%2][%3]").arg(serieses.size()).arg(subject.ID).arg(study.StudyNumber));
+            for (auto series : serieses) {
+                /* a new package writes every series. An existing package already has its series, except the ones
+                   added since it was read, which have staged files */
+                if ((fileMode == FileMode::NewPackage) || !series.stagedFiles.isEmpty()) {
+                    QString seriesArchivePath = series.VirtualPath();
+
+                    /* series appended to the package by an interrupted write are not written again */
+                    journalSeries js;
+                    if (journalOpen && journal.IsArchived(seriesArchivePath, js)) {
+                        Log(QString("Series [%1-%2-%3] is already in the package").arg(subject.ID).arg(study.StudyNumber).arg(series.SeriesNumber));
+                        series.FileCount = js.fileCount;
+                        series.Size = js.size;
+                        series.Store();
+                        continue;
+                    }
+
+                    Log(QString("Preparing series [%1-%2-%3]...").arg(subject.ID).arg(study.StudyNumber).arg(series.SeriesNumber));
+                    Debug(QString("Staging [%1-%2-%3] to [%4]. Data format [%5]").arg(subject.ID).arg(study.StudyNumber).arg(series.SeriesNumber).arg(seriesArchivePath).arg(DataFormat));
+
+                    /* series that are converted are staged in the working directory */
+                    if ((DataFormat != "orig") && (study.Modality.toUpper() == "MR") && workingDir.isEmpty()) {
+                        if (fileMode == FileMode::NewPackage) {
+                            if (!openWorkingDir()) {
+                                stagingPool.waitForDone();
+                                writeDbconn.rollback();
+                                return false;
+                            }
+                        }
+                        else if (!MakeTempDir(workingDir))
+                            Log("Error creating working directory");
+                    }
+
+                    while (staging.size() >= stagingWindow)
+                        storeNextSeries();
+
+                    QByteArray resumeChecksum;
+                    if (journalOpen && journal.IsStaged(seriesArchivePath, js))
+                        resumeChecksum = js.checksum;
+                    auto task = std::make_shared<std::packaged_task<seriesStagingRecord()>>([this, seriesArchivePath, stagedFiles = series.stagedFiles, subjectID = subject.ID, studyNumber = study.StudyNumber, seriesNumber = series.SeriesNumber, modality = study.Modality, bindir, resumeChecksum, dedup]() {
+                        seriesStagingRecord rec = StageSeries(seriesArchivePath, stagedFiles, subjectID, studyNumber, seriesNumber, modality, bindir, resumeChecksum);
+                        if (dedup) {
+                            for (auto &f : rec.files)
+                                f.hash = ContentHash(f.diskPath);
+                        }
+                        return rec;
+                    });
+                    staging.push_back({series, seriesArchivePath, task->get_future()});
+                    stagingPool.start([task]() { (*task)(); });
+                }
+            }
         }
-        root["ExperimentCount"] = JSONexperiments.size();
-        root["experiments"] = JSONexperiments;
     }
+    while (!staging.empty())
+        storeNextSeries();
+    stagingPool.waitForDone();
+    if (!writeDbconn.commit())
+        Log(QString("Warning: could not commit write transaction: %1").arg(writeDbconn.lastError().text()));
 
-    /* add data-dictionary */
+    /* ----- 2) write .json file ----- */
+    /* the non-subject objects' files, and the pipeline scripts, which are added to the new package from memory */
+    QList <squirrelGroupAnalysis> groupAnalyses = GetGroupAnalysisList();
+    for (auto &g : groupAnalyses) {
+        stagedFiles += g.GetStagedFileList();
+        Log(QString("Added group-analysis [%1]").arg(g.GroupAnalysisName));
+    }
+    QList <squirrelPipeline> pipelines = GetPipelineList();
+    for (auto &p : pipelines) {
+        stagedFiles += p.GetStagedFileList();
+        archiveMemoryFiles.insert(QString("pipelines/%1/primaryScript.sh").arg(p.PipelineName), p.PipelinePrimaryScript.toUtf8());
+        archiveMemoryFiles.insert(QString("pipelines/%1/secondaryScript.sh").arg(p.PipelineName), p.PipelineSecondaryScript.toUtf8());
+        Log(QString("Added pipeline [%1]").arg(p.PipelineName));
+    }
+    QList <squirrelExperiment> exps = GetExperimentList();
+    for (auto &e : exps) {
+        stagedFiles += e.GetStagedFileList();
+        Log(QString("Added experiment [%1]").arg(e.ExperimentName));
+    }
     QList <squirrelDataDictionary> dicts = GetDataDictionaryList();
-    if (dicts.size() > 0) {
-        Log(QString("Adding %1 data-dictionaries").arg(dicts.size()));
-        QJsonArray JSONdataDictionaries;
-        for (auto &d : dicts) {
-            JSONdataDictionaries.append(d.ToJSON());
-            stagedFiles += d.GetStagedFileList();
-            Log("Added data-dictionary");
-        }
-        root["DataDictionaryCount"] = JSONdataDictionaries.size();
-        root["data-dictionaries"] = JSONdataDictionaries;
+    for (auto &d : dicts) {
+        stagedFiles += d.GetStagedFileList();
+        Log("Added data-dictionary");
     }
-    root["TotalSize"] = GetUnzipSize();
-    root["TotalFileCount"] = GetFileCount();
 
-    QString j = QJsonDocument(root).toJson();
+    /* the header is streamed to a file, and added to the package from there */
+    Debug("Creating header file...");
+    QString headerDir, jsonPath, jm;
+    bool headerOk = MakeTempDir(headerDir);
+    if (headerOk) {
+        jsonPath = headerDir + "/squirrel.json";
+        headerOk = WriteJsonHeader(jsonPath, "", jm);
+    }
+    else
+        jm = "Error creating temporary directory for the package header";
+    if (!headerOk) {
+        Log(jm);
+        finishBatch();
+        DeleteTempDir(headerDir);
+        return false;
+    }
 
     /* write the final .json file */
     if (fileMode == NewPackage) {
 
-        /* copy in all files from the staged files list */
+        /* add all files from the staged files list */
         Debug(QString("stagedFiles size is [%1]").arg(stagedFiles.size()));
-        for (int i=0; i<stagedFiles.size(); i++) {
-            Debug(QString("[%1] , [%2]").arg(stagedFiles.at(i).first).arg(stagedFiles.at(i).second), __FUNCTION__);
-        }
-
         for (int i=0; i<stagedFiles.size(); i++) {
             QStringPair file = stagedFiles.at(i);
-
-            QString sourcePath = file.first;
             QFileInfo fi(file.first);
-            QString fname = fi.fileName();
-
-            QString destPath = workingDir + "/" + file.second + "/" + fname;
-            QString destDir = workingDir + "/" + file.second;
-            QString m;
-            if (!utils::MakePath(destDir,m))
-                Log(QString("Error creating directory [%1] - message [%2]").arg(destDir).arg(m));
+            Debug(QString("Adding [%1] to [%2]").arg(file.first).arg(file.second), __FUNCTION__);
+            if (!fi.isFile())
+                Log(QString("Error adding [%1] to [%2]. File does not exist").arg(file.first).arg(file.second));
             else
-                Debug(QString("Successfully created directory [%1] - message [%2]").arg(destDir).arg(m), __FUNCTION__);
-
-            Debug(QString("Copying [%1] to [%2]").arg(sourcePath).arg(destPath), __FUNCTION__);
-            if (!QFile::copy(sourcePath, destPath))
-                Log(QString("Error copying [%1] to [%2]").arg(sourcePath).arg(destPath));
+                addArchiveFile(fi.absoluteFilePath(), file.second + "/" + fi.fileName(), dedup ? ContentHash(fi.absoluteFilePath()) : QByteArray());
         }
 
-        //Log("Zipping the archive from a temp directory");
-
-        /* write the .json file to the temp dir */
-        QString jsonFilePath = workingDir + "/squirrel.json";
-        if (!utils::WriteTextFile(jsonFilePath, j))
-            Log("Error writing [" + jsonFilePath + "]");
+        addArchiveFile(jsonPath, "squirrel.json");
+        if (!batchAliases.isEmpty())
+            archiveMemoryFiles.insert("aliases.json", AliasesToJson(batchAliases));
+        if (!aliases.isEmpty())
+            Log(QString("[%1] files have the same contents as another file in the package, and are stored as aliases").arg(aliases.size()));
 
+        /* the last batch, with the header and the non-series files. If it is the only one, it is the package */
         QString m;
-        Log("Writing package...");
-        if (CompressDirectoryToArchive(workingDir, GetPackagePath(), m)) {
-            QFileInfo fi(GetPackagePath());
-            qint64 zipSize = fi.size();
-            Log(QString("Finished writing package [%1]. Size is [%2] bytes").arg(GetPackagePath()).arg(zipSize));
+        bool writeOk(false);
+        finishBatch();
+        Log(QString("Writing package. [%1] files, [%2] generated files...").arg(archiveDiskPaths.size()).arg(archiveMemoryFiles.size()));
+        if (batchesOk)
+            writeOk = writeLayer(++layersWritten, archiveDiskPaths, archiveFilePaths, archiveMemoryFiles, m);
+        else
+            m = "An earlier batch of series could not be written";
+
+        /* delete the working directory, if any series were converted. After an error it is kept, with its
+           journal, for the next write of this package to resume from */
+        if (!workingDir.isEmpty()) {
+            workingDirLock.reset();
+            if (writeOk)
+                DeleteTempDir(workingDir);
+            else
+                Log(QString("Keeping working directory [%1]. Write the package again, with the same options, to resume").arg(workingDir));
+            workingDir = "";
+        }
+        DeleteTempDir(headerDir);
+
+        if (writeOk) {
+            qint64 zipSize(0);
+            for (const QString &layer : ArchiveLayers(GetPackagePath()))
+                zipSize += QFileInfo(layer).size();
+            if (layersWritten > 1)
+                Log(QString("Finished writing package [%1] and [%2] segments. Size is [%3] bytes").arg(GetPackagePath()).arg(layersWritten - 1).arg(zipSize));
+            else
+                Log(QString("Finished writing package [%1]. Size is [%2] bytes").arg(GetPackagePath()).arg(zipSize));
 
-            /* delete the squirrel temp dir */
-            DeleteTempDir(workingDir);
+            /* write the sidecar index of the last layer for fast opening. The earlier layers have theirs */
+            if (!WriteArchiveIndexFile(layerPath(layersWritten), m))
+                Log(m);
         }
         else {
             Log("Error creating zip file [" + GetPackagePath() + "]  message [" + m + "]");
@@ -1001,24 +2002,45 @@ bool squirrel::Write() {
     }
     else {
 
-        /* update all files from the staged files list */
-        QStringList diskPaths, archivePaths;
+        /* the files of the objects added since the package was read: the staged files, the new series, and the
+           generated files, which are written to the header directory first */
+        QStringList diskPaths(archiveDiskPaths), archivePaths(archiveFilePaths);
         for (int i=0; i<stagedFiles.size(); i++) {
             QStringPair file = stagedFiles.at(i);
-            QString source = file.first;
-            QString dest = workingDir + "/" + file.second;
-            diskPaths.append(source);
-            archivePaths.append(dest);
+            QFileInfo fi(file.first);
+            if (!fi.isFile()) {
+                Log(QString("Error adding [%1] to [%2]. File does not exist").arg(file.first).arg(file.second));
+                continue;
+            }
+            diskPaths.append(fi.absoluteFilePath());
+            archivePaths.append(file.second + "/" + fi.fileName());
+        }
+        for (auto it = archiveMemoryFiles.constBegin(); it != archiveMemoryFiles.constEnd(); ++it) {
+            QString path = headerDir + "/generated/" + it.key();
+            QString m;
+            utils::MakePath(QFileInfo(path).absolutePath(), m);
+            QFile f(path);
+            if (f.open(QIODevice::WriteOnly) && (f.write(it.value()) == it.value().size())) {
+                diskPaths.append(path);
+                archivePaths.append(it.key());
+            }
+            else
+                Log(QString("Error writing [%1] to [%2]. [%3]").arg(it.key()).arg(path).arg(f.errorString()));
         }
-        Log("Adding/updating files in existing package");
+
+        /* the new .json file replaces the package's header in the same pass */
+        diskPaths.append(jsonPath);
+        archivePaths.append("squirrel.json");
+        Log(QString("Adding/updating [%1] files in existing package").arg(diskPaths.size()));
         QString m;
-        if (!AddFilesToArchive(diskPaths, archivePaths, GetPackagePath(), m))
+        if (UpdatePackageFiles(diskPaths, archivePaths, m))
+            Log(m);
+        else
             Log("Error [" + m + "] adding file(s) to archive");
-
-        /* update the package in place with the new .json file */
-        Log("Updating existing package");
-        if (!UpdateMemoryFileToArchive(j, "squirrel.json", GetPackagePath(), m)) {
-            Log("Error [" + m + "] compressing memory file to archive");
+        DeleteTempDir(headerDir);
+        if (!workingDir.isEmpty()) {
+            DeleteTempDir(workingDir);
+            workingDir = "";
         }
     }
 
@@ -1030,126 +2052,431 @@ bool squirrel::Write() {
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- StageSeries ------------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Stage one series for a new package. Runs on a Write() staging worker, so it does no database
+ * access and does not log directly. Messages are returned in the record and logged by the caller
+ * @param seriesArchivePath path of the series within the package (data/subject/study/series)
+ * @param stagedFiles the series' original files
+ * @param subjectID parent subject ID
+ * @param studyNumber parent study number
+ * @param seriesNumber series number
+ * @param modality study modality. Only MR series are converted
+ * @param bindir directory containing the conversion binaries
+ * @param resumeChecksum checksum of the series' files, if an interrupted write converted it. Empty otherwise
+ * @return the files to add to the package, and any messages
+ */
+seriesStagingRecord squirrel::StageSeries(QString seriesArchivePath, QStringList stagedFiles, QString subjectID, int studyNumber, int seriesNumber, QString modality, QString bindir, QByteArray resumeChecksum) {
+    seriesStagingRecord rec;
+
+    if ((DataFormat == "orig") || (modality.toUpper() != "MR")) {
+        /* no conversion needed. The original files go straight into the archive */
+        phaseTimer t(StagingPhase);
+        rec.debug.append(QString("Data format is [%1], modality is [%2]. Adding [%3] original files...").arg(DataFormat).arg(modality.toUpper()).arg(stagedFiles.size()));
+        foreach (QString f, stagedFiles) {
+            QFileInfo fi(f);
+            if (!fi.isFile())
+                rec.log.append(QString("  ERROR adding original file [%1]. File does not exist").arg(f));
+            else
+                rec.files.append({fi.absoluteFilePath(), seriesArchivePath + "/" + fi.fileName(), fi.size()});
+        }
+        return rec;
+    }
+
+    /* the series is converted in the working directory, and the converted files are added to the archive */
+    QString m;
+    QString seriesPath;
+    #ifdef Q_OS_WINDOWS
+        seriesPath = QString("%1\\%2").arg(workingDir).arg(seriesArchivePath);
+    #else
+        seriesPath = QString("%1/%2").arg(workingDir).arg(seriesArchivePath);
+    #endif
+    rec.stagingDir = seriesPath;
+
+    /* a series converted completely by an interrupted write is reused if its files are unchanged. Anything
+       else left in its directory is partial, and is removed */
+    if (QFileInfo::exists(seriesPath)) {
+        if (!resumeChecksum.isEmpty()) {
+            ListStagedFiles(seriesPath, seriesArchivePath, rec.files);
+            if (StagedFilesChecksum(rec.files) == resumeChecksum) {
+                rec.log.append(QString("   ...reusing [%1] files converted by an earlier write").arg(rec.files.size()));
+                return rec;
+            }
+            rec.files.clear();
+        }
+        if (!utils::RemoveDir(seriesPath, m))
+            rec.log.append("Error [" + m + "] removing directory [" + seriesPath + "]");
+    }
+    utils::MakePath(seriesPath,m);
+
+    if ((DataFormat == "anon") || (DataFormat == "anonfull")) {
+        phaseTimer t(ConversionPhase);
+        /* stage the original files straight into the series directory. The anonymizer rewrites them in
+           place, so each is a copy (or a copy-on-write clone) of the original */
+        qint64 numFiles(0), numBytes(0);
+        foreach (QString f, stagedFiles) {
+            qint64 b(0);
+            QString sm;
+            if (utils::StageFile(f, seriesPath + "/" + QFileInfo(f).fileName(), b, sm)) {
+                filesCopiedCount++;
+                numFiles++;
+                numBytes += b;
+            }
+            else
+                rec.log.append(QString("  ERROR staging original file [%1] to [%2]. [%3]").arg(f).arg(seriesPath).arg(sm));
+        }
+        rec.debug.append(QString("  ... staged [%1] original files, [%2] bytes, to [%3]").arg(numFiles).arg(numBytes).arg(seriesPath));
+
+        /* anonymize the directory */
+        squirrelImageIO io;
+        QString m;
+        if (DataFormat == "anon")
+            io.AnonymizeDicomDirInPlace(seriesPath, 1, m);
+        else
+            io.AnonymizeDicomDirInPlace(seriesPath, 2, m);
+    }
+    else if (DataFormat.contains("nifti")) {
+        phaseTimer t(ConversionPhase);
+        int numConv(0), numRename(0);
+        bool gzip;
+        if (DataFormat.contains("gz"))
+            gzip = true;
+        else
+            gzip = false;
+
+        /* get path of first file to be converted */
+        if (stagedFiles.size() > 0) {
+            rec.log.append(QString("   ...converting %1 files to Nifti").arg(stagedFiles.size()));
+
+            QFileInfo f(stagedFiles[0]);
+            QString origSeriesPath = f.absoluteDir().absolutePath();
+            squirrelImageIO io;
+            QString m3;
+            if (io.ConvertDicom(DataFormat, origSeriesPath, seriesPath, bindir, gzip, utils::CleanString(subjectID), QString("%1").arg(studyNumber), QString("%1").arg(seriesNumber), "dicom", numConv, numRename, m3))
+                rec.debug.append(QString("ConvertDicom() returned [%1]").arg(m3));
+            else
+                rec.log.append(QString("ConvertDicom() failed. Returned [%1]").arg(m3));
+        }
+        else {
+            rec.debug.append(QString("Variable squirrelSeries.stagedFiles is empty. No files to convert to Nifti"));
+        }
+    }
+    else
+        rec.log.append(QString("DataFormat [%1] not recognized").arg(DataFormat));
+
+    ListStagedFiles(seriesPath, seriesArchivePath, rec.files);
+
+    return rec;
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- WriteUpdate ------------------------------------------ */
 /* ------------------------------------------------------------ */
 /**
  * @brief Update the squirrel package *header only*, in place. All parameters should be set first
+ * @param dropOldHeaders true to also remove the superseded header from the package's older layers
  * @return true if successfuly written, false otherwise
  */
-bool squirrel::WriteUpdate() {
+bool squirrel::WriteUpdate(bool dropOldHeaders) {
     QString m;
 
+    /* a package read in lazy mode is written whole */
+    if (!MaterializeAllSubjects())
+        return false;
+
     /* create the log file */
     QFileInfo finfo(GetPackagePath());
     logfile = QString(finfo.absolutePath() + "/squirrel-" + utils::CreateLogDate() + ".log");
 
-    /* create JSON object */
-    QJsonObject root;
+    /* stream the new .json file to disk, and update the package in place with it */
+    QString headerDir;
+    if (!MakeTempDir(headerDir)) {
+        Log("Error creating temporary directory for the package header");
+        return false;
+    }
+    QString jsonPath = headerDir + "/squirrel.json";
+    if (!WriteJsonHeader(jsonPath, workingDir, m)) {
+        Log(m);
+        DeleteTempDir(headerDir);
+        return false;
+    }
+    Log("Updating existing package");
+    bool ok = UpdatePackageHeader(jsonPath, m, dropOldHeaders);
+    if (ok)
+        Log(m);
+    else
+        Log("Error [" + m + "] adding header file to archive");
+    DeleteTempDir(headerDir);
 
-    QJsonObject pkgInfo;
-    pkgInfo["Changes"] = Changes;
-    pkgInfo["DataFormat"] = DataFormat;
-    pkgInfo["Datetime"] = utils::CreateCurrentDateTime(2);
-    pkgInfo["Description"] = Description;
-    pkgInfo["License"] = License;
-    pkgInfo["Notes"] = Notes;
-    pkgInfo["PackageFormat"] = PackageFormat;
-    pkgInfo["PackageName"] = PackageName;
-    pkgInfo["Readme"] = Readme;
-    pkgInfo["SeriesDirectoryFormat"] = SeriesDirFormat;
-    pkgInfo["SquirrelBuild"] = SquirrelBuild;
-    pkgInfo["SquirrelVersion"] = SquirrelVersion;
-    pkgInfo["StudyDirectoryFormat"] = StudyDirFormat;
-    pkgInfo["SubjectDirectoryFormat"] = SubjectDirFormat;
+    /* write the log file */
+    if (writeLog)
+        utils::WriteTextFile(logfile, log);
+
+    return ok;
+}
 
-    root["package"] = pkgInfo;
 
-    QJsonObject data;
-    QJsonArray JSONsubjects;
+/* ------------------------------------------------------------ */
+/* ----- WriteJsonHeader -------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Write the package header (squirrel.json) to a file. The subjects and their child objects are read
+ * with one ordered query per object type and written as they are read, so memory use does not grow with the
+ * size of the package. The output is identical to building the header as one QJsonDocument
+ * @param jsonPath path of the file to write
+ * @param pipelinePath directory to write the pipeline scripts to, or empty to not write them
+ * @param m any messages generated during the operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::WriteJsonHeader(QString jsonPath, QString pipelinePath, QString &m) {
 
-    /* add subjects to JSON */
-    QList<squirrelSubject> subjectses = GetSubjectList();
-    Log(QString("Adding %1 subjects").arg(subjectses.size()));
-    for (auto &subject : subjectses) {
-        JSONsubjects.append(subject.ToJSON());
-        Log("Added subject [" + subject.ID + "]");
+    QFile f(jsonPath);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        m = QString("Error opening [%1] for writing [%2]").arg(jsonPath).arg(f.errorString());
+        return false;
     }
 
-    /* add group-analyses */
+    QSqlDatabase db = QSqlDatabase::database(databaseUUID);
+
+    /* number of child objects of each subject and study, for the counts that precede each array */
+    auto childCounts = [&](QString sql) {
+        QHash<qint64, int> counts;
+        QSqlQuery q(db);
+        q.setForwardOnly(true);
+        q.prepare(sql);
+        utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        while (q.next())
+            counts.insert(q.value(0).toLongLong(), q.value(1).toInt());
+        return counts;
+    };
+    QHash<qint64, int> studyCounts = childCounts("select SubjectRowID, count(*) from Study group by SubjectRowID");
+    QHash<qint64, int> observationCounts = childCounts("select SubjectRowID, count(*) from Observation group by SubjectRowID");
+    QHash<qint64, int> interventionCounts = childCounts("select SubjectRowID, count(*) from Intervention group by SubjectRowID");
+    QHash<qint64, int> seriesCounts = childCounts("select StudyRowID, count(*) from Series group by StudyRowID");
+    QHash<qint64, int> analysisCounts = childCounts("select StudyRowID, count(*) from Analysis group by StudyRowID");
+
+    /* every child query is ordered by its subject in the subject order, then by its study, so each
+       subject's (and study's) rows are read from the cursor as the subject is written */
+    QString subjectOrder = "su.ID asc, su.SequenceNumber asc, su.SubjectRowID asc";
+    auto openCursor = [&](QSqlQuery &q, QString sql) {
+        q.setForwardOnly(true);
+        q.prepare(sql);
+        utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        return q.next();
+    };
+    QSqlQuery qSubject(db), qStudy(db), qObservation(db), qIntervention(db), qSeries(db), qAnalysis(db);
+    qint64 numSubjects(0);
+    {
+        QSqlQuery q(db);
+        q.prepare("select count(*) from Subject");
+        utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
+        if (q.next())
+            numSubjects = q.value(0).toLongLong();
+    }
+    bool moreSubjects = openCursor(qSubject, "select su.* from Subject su order by " + subjectOrder);
+    bool moreStudies = openCursor(qStudy, "select st.* from Study st join Subject su on st.SubjectRowID = su.SubjectRowID order by " + subjectOrder + ", st.StudyRowID asc");
+    bool moreObservations = openCursor(qObservation, "select o.* from Observation o join Subject su on o.SubjectRowID = su.SubjectRowID order by " + subjectOrder + ", o.ObservationRowID asc");
+    bool moreInterventions = openCursor(qIntervention, "select i.* from Intervention i join Subject su on i.SubjectRowID = su.SubjectRowID order by " + subjectOrder + ", i.InterventionRowID asc");
+    bool moreSeries = openCursor(qSeries, "select se.* from Series se join Study st on se.StudyRowID = st.StudyRowID join Subject su on st.SubjectRowID = su.SubjectRowID order by " + subjectOrder + ", st.StudyRowID asc, se.SeriesRowID asc");
+    bool moreAnalyses = openCursor(qAnalysis, "select a.*, b.PipelineName from Analysis a left join Pipeline b on a.PipelineRowID = b.PipelineRowID join Study st on a.StudyRowID = st.StudyRowID join Subject su on st.SubjectRowID = su.SubjectRowID order by " + subjectOrder + ", st.StudyRowID asc, a.AnalysisRowID asc");
+
     QList <squirrelGroupAnalysis> groupAnalyses = GetGroupAnalysisList();
+    QList <squirrelPipeline> pipelines = GetPipelineList();
+    QList <squirrelExperiment> exps = GetExperimentList();
+    QList <squirrelDataDictionary> dicts = GetDataDictionaryList();
+    Log(QString("Writing header. [%1] subjects, [%2] group-analyses, [%3] pipelines, [%4] experiments, [%5] data-dictionaries").arg(numSubjects).arg(groupAnalyses.size()).arg(pipelines.size()).arg(exps.size()).arg(dicts.size()));
+
+    /* the members of each object are written in sorted order, which is how QJsonObject orders them */
+    jsonStreamWriter w(f);
+    w.BeginObject();
+    if (dicts.size() > 0)
+        w.Value("DataDictionaryCount", dicts.size());
+    if (exps.size() > 0)
+        w.Value("ExperimentCount", exps.size());
+    if (pipelines.size() > 0)
+        w.Value("PipelineCount", pipelines.size());
+    w.Value("TotalFileCount", GetFileCount());
+    w.Value("TotalSize", GetUnzipSize());
+
+    w.BeginObject("data");
+    if (groupAnalyses.size() > 0)
+        w.Value("GroupAnalysisCount", groupAnalyses.size());
+    w.Value("SubjectCount", numSubjects);
     if (groupAnalyses.size() > 0) {
-        Log(QString("Adding %1 group-analyses").arg(groupAnalyses.size()));
-        QJsonArray JSONgroupanalyses;
-        for (auto &g : groupAnalyses) {
-            JSONgroupanalyses.append(g.ToJSON());
-            Log(QString("Added group-analysis [%1]").arg(g.GroupAnalysisName));
-        }
-        data["GroupAnalysisCount"] = JSONgroupanalyses.size();
-        data["group-analysis"] = JSONgroupanalyses;
+        w.BeginArray("group-analysis");
+        for (auto &g : groupAnalyses)
+            w.Value(g.ToJSON());
+        w.EndArray();
     }
 
-    data["SubjectCount"] = JSONsubjects.size();
-    data["subjects"] = JSONsubjects;
-    root["data"] = data;
+    w.BeginArray("subjects");
+    while (moreSubjects) {
+        squirrelSubject subject(databaseUUID);
+        subject.Populate(qSubject);
+        subject.SetDirFormat(SubjectDirFormat);
+        qint64 subjectRowID = subject.GetObjectID();
 
-    /* add pipelines */
-    QList <squirrelPipeline> pipelines = GetPipelineList();
-    if (pipelines.size() > 0) {
-        Log(QString("Adding %1 pipelines").arg(pipelines.size()));
-        QJsonArray JSONpipelines;
-        for (auto &p : pipelines) {
-            JSONpipelines.append(p.ToJSON(workingDir));
-            Log(QString("Added pipeline [%1]").arg(p.PipelineName));
+        QJsonObject json = subject.ToJSON(false);
+        if (interventionCounts.contains(subjectRowID))
+            json["InterventionCount"] = interventionCounts.value(subjectRowID);
+        if (observationCounts.contains(subjectRowID))
+            json["ObservationCount"] = observationCounts.value(subjectRowID);
+        if (studyCounts.contains(subjectRowID))
+            json["StudyCount"] = studyCounts.value(subjectRowID);
+        w.BeginObject();
+        w.Members(json);
+
+        if (interventionCounts.contains(subjectRowID)) {
+            w.BeginArray("interventions");
+            while (moreInterventions && (qIntervention.value("SubjectRowID").toLongLong() == subjectRowID)) {
+                squirrelIntervention i(databaseUUID);
+                i.Populate(qIntervention);
+                w.Value(i.ToJSON());
+                moreInterventions = qIntervention.next();
+            }
+            w.EndArray();
         }
-        root["PipelineCount"] = JSONpipelines.size();
-        root["pipelines"] = JSONpipelines;
-    }
 
-    /* add experiments */
-    QList <squirrelExperiment> exps = GetExperimentList();
-    if (exps.size() > 0) {
-        Log(QString("Adding %1 experiments").arg(exps.size()));
-        QJsonArray JSONexperiments;
-        for (auto &e : exps) {
-            JSONexperiments.append(e.ToJSON());
-            Log(QString("Added experiment [%1]").arg(e.ExperimentName));
+        if (observationCounts.contains(subjectRowID)) {
+            w.BeginArray("observations");
+            while (moreObservations && (qObservation.value("SubjectRowID").toLongLong() == subjectRowID)) {
+                squirrelObservation o(databaseUUID);
+                o.Populate(qObservation);
+                w.Value(o.ToJSON());
+                moreObservations = qObservation.next();
+            }
+            w.EndArray();
         }
-        root["ExperimentCount"] = JSONexperiments.size();
-        root["experiments"] = JSONexperiments;
-    }
 
-    /* add data-dictionary */
-    QList <squirrelDataDictionary> dicts = GetDataDictionaryList();
-    if (dicts.size() > 0) {
-        Log(QString("Adding %1 data-dictionaries").arg(dicts.size()));
-        QJsonArray JSONdataDictionaries;
-        for (auto &d : dicts) {
-            JSONdataDictionaries.append(d.ToJSON());
-            Log("Added data-dictionary");
+        if (studyCounts.contains(subjectRowID)) {
+            w.BeginArray("studies");
+            while (moreStudies && (qStudy.value("SubjectRowID").toLongLong() == subjectRowID)) {
+                squirrelStudy study(databaseUUID);
+                study.Populate(qStudy);
+                study.parentSubjectID = subject.ID;
+                study.parentSubjectSeqNum = subject.SequenceNumber;
+                qint64 studyRowID = study.GetObjectID();
+
+                QJsonObject studyJson = study.ToJSON(false);
+                if (analysisCounts.contains(studyRowID))
+                    studyJson["AnalysisCount"] = analysisCounts.value(studyRowID);
+                if (seriesCounts.contains(studyRowID))
+                    studyJson["SeriesCount"] = seriesCounts.value(studyRowID);
+                w.BeginObject();
+                w.Members(studyJson);
+
+                if (analysisCounts.contains(studyRowID)) {
+                    w.BeginArray("analyses");
+                    while (moreAnalyses && (qAnalysis.value("StudyRowID").toLongLong() == studyRowID)) {
+                        squirrelAnalysis a(databaseUUID);
+                        a.Populate(qAnalysis);
+                        a.parentSubjectID = subject.ID;
+                        a.parentSubjectSeqNum = subject.SequenceNumber;
+                        a.parentStudyNumber = study.StudyNumber;
+                        a.parentStudySeqNum = study.SequenceNumber;
+                        w.Value(a.ToJSON());
+                        moreAnalyses = qAnalysis.next();
+                    }
+                    w.EndArray();
+                }
+
+                if (seriesCounts.contains(studyRowID)) {
+                    w.BeginArray("series");
+                    while (moreSeries && (qSeries.value("StudyRowID").toLongLong() == studyRowID)) {
+                        squirrelSeries series(databaseUUID);
+                        series.Populate(qSeries);
+                        series.parentSubjectID = subject.ID;
+                        series.parentSubjectSeqNum = subject.SequenceNumber;
+                        series.parentStudyNumber = study.StudyNumber;
+                        series.parentStudySeqNum = study.SequenceNumber;
+                        w.Value(series.ToJSON());
+                        moreSeries = qSeries.next();
+                    }
+                    w.EndArray();
+                }
+
+                w.EndObject();
+                moreStudies = qStudy.next();
+            }
+            w.EndArray();
         }
-        root["DataDictionaryCount"] = JSONdataDictionaries.size();
-        root["data-dictionaries"] = JSONdataDictionaries;
+
+        w.EndObject();
+        moreSubjects = qSubject.next();
     }
-    root["TotalSize"] = GetUnzipSize();
-    root["TotalFileCount"] = GetFileCount();
+    w.EndArray();
+    w.EndObject();
 
-    QString j = QJsonDocument(root).toJson();
+    if (dicts.size() > 0) {
+        w.BeginArray("data-dictionaries");
+        for (auto &d : dicts)
+            w.Value(d.ToJSON());
+        w.EndArray();
+    }
 
-    /* update the package in place with the new .json file */
-    Log("Updating existing package");
-    if (!UpdateMemoryFileToArchive(j, "squirrel.json", GetPackagePath(), m)) {
-        Log("Error [" + m + "] compressing memory file to archive");
+    if (exps.size() > 0) {
+        w.BeginArray("experiments");
+        for (auto &e : exps)
+            w.Value(e.ToJSON());
+        w.EndArray();
     }
 
-    /* write the log file */
-    if (writeLog)
-        utils::WriteTextFile(logfile, log);
+    QJsonObject pkgInfo;
+    pkgInfo["Changes"] = Changes;
+    pkgInfo["DataFormat"] = DataFormat;
+    pkgInfo["Datetime"] = utils::CreateCurrentDateTime(2);
+    pkgInfo["Description"] = Description;
+    pkgInfo["License"] = License;
+    pkgInfo["Notes"] = Notes;
+    pkgInfo["PackageFormat"] = PackageFormat;
+    pkgInfo["PackageName"] = PackageName;
+    pkgInfo["Readme"] = Readme;
+    pkgInfo["SeriesDirectoryFormat"] = SeriesDirFormat;
+    pkgInfo["SquirrelBuild"] = SquirrelBuild;
+    pkgInfo["SquirrelVersion"] = SquirrelVersion;
+    pkgInfo["StudyDirectoryFormat"] = StudyDirFormat;
+    pkgInfo["SubjectDirectoryFormat"] = SubjectDirFormat;
+    w.Value("package", pkgInfo);
 
+    if (pipelines.size() > 0) {
+        w.BeginArray("pipelines");
+        for (auto &p : pipelines)
+            w.Value(p.ToJSON(pipelinePath));
+        w.EndArray();
+    }
+    w.EndObject();
+
+    f.close();
+    if (!w.Ok() || (f.error() != QFileDevice::NoError)) {
+        m = QString("Error writing package header to [%1] [%2]").arg(jsonPath).arg(f.errorString());
+        return false;
+    }
+    m = QString("Wrote package header [%1] bytes").arg(f.size());
     return true;
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- Compact ---------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Fold the segments appended to the package back into a single archive
+ * @param m output message describing success or failure
+ * @return true if successful, or if the package has no appended segments
+ */
+bool squirrel::Compact(QString &m) {
+    if (!utils::FileExists(GetPackagePath())) {
+        m = QString("Package [%1] does not exist").arg(GetPackagePath());
+        return false;
+    }
+
+    return CompactArchive(GetPackagePath(), m);
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- Extract ---------------------------------------------- */
 /* ------------------------------------------------------------ */
@@ -1177,7 +2504,8 @@ bool squirrel::Extract(QString destinationDir, QString &m) {
  */
 bool squirrel::Validate() {
 
-    if (Read())
+    /* in lazy mode, every subject's child objects must be read to check them */
+    if (Read() && MaterializeAllSubjects())
         return true;
     else
         return false;
@@ -1193,6 +2521,7 @@ bool squirrel::Validate() {
  */
 QString squirrel::GetLogBuffer() {
 
+    QMutexLocker locker(&logMutex);
     QString ret = logBuffer;
     logBuffer = "";
 
@@ -1308,6 +2637,10 @@ QString squirrel::Print(bool detail) {
  */
 qint64 squirrel::GetUnzipSize() {
 
+    /* in lazy mode, the package header has the total until every subject has been read */
+    if (!lazySubjects.isEmpty())
+        return headerTotalSize;
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare(
         "select "
@@ -1332,6 +2665,10 @@ qint64 squirrel::GetUnzipSize() {
  */
 qint64 squirrel::GetFileCount() {
 
+    /* in lazy mode, the package header has the total until every subject has been read */
+    if (!lazySubjects.isEmpty())
+        return headerTotalFileCount;
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare(
         "select "
@@ -1375,6 +2712,10 @@ qint64 squirrel::GetObjectCount(ObjectType object) {
         default: return -1;
     }
 
+    /* counts of child objects include the subjects not yet read in lazy mode */
+    if ((object == Analysis) || (object == Intervention) || (object == Observation) || (object == Series) || (object == Study))
+        MaterializeAllSubjects();
+
     q.prepare("select count(*) 'count' from " + table);
     utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
     if (q.first())
@@ -1456,6 +2797,21 @@ bool squirrel::MakeTempDir(QString &dir) {
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- WriteWorkingDirPath ---------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the path of the working directory for writing the current package. It is named by a hash
+ * of the package's absolute path, so a Write() that was interrupted is found, and resumed, by the next one
+ * @return path of the working directory
+ */
+QString squirrel::WriteWorkingDirPath() {
+    QByteArray pathHash = QCryptographicHash::hash(QFileInfo(GetPackagePath()).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    QString base = cmdLineExec ? QDir::tempPath() : systemTempDir;
+    return QString("%1/squirrel-write-%2").arg(base).arg(QString(pathHash.toHex().left(16)));
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- DeleteTempDir ---------------------------------------- */
 /* ------------------------------------------------------------ */
@@ -1570,6 +2926,7 @@ QString squirrel::GetTempDir() {
  */
 void squirrel::Log(QString s) {
     if (s.trimmed() != "") {
+        QMutexLocker locker(&logMutex);
         log.append(QString("%1\n").arg(s));
         logBuffer.append(QString("%1\n").arg(s));
         if (!quiet) {
@@ -1590,6 +2947,7 @@ void squirrel::Log(QString s) {
 void squirrel::Debug(QString s, QString func) {
     if (debug) {
         if (s.trimmed() != "") {
+            QMutexLocker locker(&logMutex);
             log.append(QString("Debug %1() %2\n").arg(func).arg(s));
             logBuffer.append(QString("Debug %1() %2\n").arg(func).arg(s));
             utils::Print(QString("Debug %1() %2").arg(func).arg(s));
@@ -2117,6 +3475,11 @@ QList<squirrelSubject> squirrel::GetSubjectList() {
  * @return list of studies
  */
 QList<squirrelStudy> squirrel::GetStudyList(qint64 subjectRowID) {
+    if (subjectRowID < 0)
+        MaterializeAllSubjects();
+    else
+        MaterializeSubject(subjectRowID);
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     QList<squirrelStudy> list;
     if (subjectRowID < 0) {
@@ -2148,6 +3511,10 @@ QList<squirrelStudy> squirrel::GetStudyList(qint64 subjectRowID) {
  * @return list of series
  */
 QList<squirrelSeries> squirrel::GetSeriesList(qint64 studyRowID) {
+    /* a study only exists once its subject has been read, so only a list of all series needs the lazy subjects */
+    if (studyRowID < 0)
+        MaterializeAllSubjects();
+
     QSqlDatabase db = QSqlDatabase::database(databaseUUID);
     QList<squirrelSeries> list;
 
@@ -2222,6 +3589,9 @@ QList<squirrelSeries> squirrel::GetSeriesList(qint64 studyRowID) {
  * @return QList of squirrelAnalysis objects
  */
 QList<squirrelAnalysis> squirrel::GetAnalysisList(qint64 studyRowID) {
+    if (studyRowID < 0)
+        MaterializeAllSubjects();
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     QList<squirrelAnalysis> list;
     if (studyRowID < 0) {
@@ -2254,6 +3624,11 @@ QList<squirrelAnalysis> squirrel::GetAnalysisList(qint64 studyRowID) {
  * @return QList of squirrelObservation objects
  */
 QList<squirrelObservation> squirrel::GetObservationList(qint64 subjectRowID) {
+    if (subjectRowID < 0)
+        MaterializeAllSubjects();
+    else
+        MaterializeSubject(subjectRowID);
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     QList<squirrelObservation> list;
     if (subjectRowID < 0) {
@@ -2282,6 +3657,8 @@ QList<squirrelObservation> squirrel::GetObservationList(qint64 subjectRowID) {
  * @return list of all squirrelIntervention objects
  */
 QList<squirrelIntervention> squirrel::GetInterventionList(qint64 subjectRowID) {
+    MaterializeSubject(subjectRowID);
+
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     QList<squirrelIntervention> list;
     q.prepare("select * from Intervention where SubjectRowID = :id");
@@ -2547,6 +3924,8 @@ qint64 squirrel::FindSubject(QString id) {
  * @return the database row ID
  */
 qint64 squirrel::FindStudy(QString subjectID, int studyNum) {
+    MaterializeSubject(subjectID);
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select a.StudyRowID from Study a left join Subject b on a.SubjectRowID = b.SubjectRowID where a.StudyNumber = :studynum and b.ID = :id");
@@ -2573,6 +3952,8 @@ qint64 squirrel::FindStudy(QString subjectID, int studyNum) {
  * @return the database row ID
  */
 qint64 squirrel::FindStudyByUID(QString studyUID) {
+    MaterializeAllSubjects();
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select StudyRowID from Study where StudyUID = :studyuid");
@@ -2597,6 +3978,8 @@ qint64 squirrel::FindStudyByUID(QString studyUID) {
  * @return The database rowid
  */
 qint64 squirrel::FindSeries(QString subjectID, int studyNum, int seriesNum) {
+    MaterializeSubject(subjectID);
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select * from Series a left join Study b on a.StudyRowID = b.StudyRowID left join Subject c on b.SubjectRowID = c.SubjectRowID where a.SeriesNumber = :seriesnum and b.StudyNumber = :studynum and c.ID = :id");
@@ -2620,6 +4003,8 @@ qint64 squirrel::FindSeries(QString subjectID, int studyNum, int seriesNum) {
  * @return The database rowid
  */
 qint64 squirrel::FindSeriesByUID(QString seriesUID) {
+    MaterializeAllSubjects();
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select SeriesRowID from Series where SeriesUID = :seriesuid");
@@ -2643,6 +4028,8 @@ qint64 squirrel::FindSeriesByUID(QString seriesUID) {
  * @return The database rowid
  */
 qint64 squirrel::FindAnalysis(QString subjectID, int studyNum, QString analysisName) {
+    MaterializeSubject(subjectID);
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select AnalysisRowID from Analysis a left join Study b on a.StudyRowID = b.StudyRowID left join Subject c on b.SubjectRowID = c.SubjectRowID where a.AnalysisName = :analysisname and b.StudyNumber = :studynum and c.ID = :id");
@@ -2760,6 +4147,8 @@ qint64 squirrel::FindDataDictionary(QString dataDictionaryName) {
  * @return the InterventionRowID if found, or -1 if not found
  */
 qint64 squirrel::FindIntervention(QString subjectID, QString interventionName, QDateTime dateStart) {
+    MaterializeSubject(subjectID);
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select InterventionRowID from Intervention a left join Subject b on a.SubjectRowID = b.SubjectRowID where a.InterventionName = :InterventionName and b.ID = :SubjectID and a.DateStart = :DateStart");
@@ -2785,6 +4174,8 @@ qint64 squirrel::FindIntervention(QString subjectID, QString interventionName, Q
  * @return the ObservationRowID if found, or -1 if not found
  */
 qint64 squirrel::FindObservation(QString subjectID, QString observationName, QDateTime dateStart) {
+    MaterializeSubject(subjectID);
+
     qint64 rowid(-1);
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select ObservationRowID from Observation a left join Subject b on a.SubjectRowID = b.SubjectRowID where a.ObservationName = :ObservationName and b.ID = :SubjectID and a.DateStart = :DateStart");
@@ -2820,6 +4211,7 @@ bool squirrel::ExtractObject(ObjectType object, qint64 objectRowID, QString outD
     QString jsonPath;
     QString j;
     if (object == Subject) {
+        MaterializeSubject(objectRowID);
         squirrelSubject s = GetSubject(objectRowID);
         virtualPath = s.VirtualPath();
         jsonPath = outDir + "/subject.json";
@@ -3002,6 +4394,9 @@ void squirrel::ResequenceTable(QString table, QString pkCol, QString parentCol,
  */
 bool squirrel::RemoveObject(ObjectType object, qint64 objectRowID) {
     if (object == Subject) {
+        /* the subject's studies must be in the database so their data is removed too */
+        MaterializeSubject(objectRowID);
+
         /* get list of studies associated with this subject, and delete them */
         QSqlQuery q(QSqlDatabase::database(databaseUUID));
         q.prepare("select StudyRowID from Study where SubjectRowID = :subjectRowID");
@@ -3203,409 +4598,1307 @@ bool squirrel::RemoveObject(ObjectType object, qint64 objectRowID) {
         q.bindValue(":dataDictionaryRowID", objectRowID);
         utils::SQLQuery(q, __FUNCTION__, __FILE__, __LINE__);
 
-        /* remove files from archive */
-        if (fileMode == FileMode::ExistingPackage) {
-            squirrelDataDictionary sqrlDataDictionary(databaseUUID);
-            sqrlDataDictionary.SetObjectID(objectRowID);
-            sqrlDataDictionary.Get();
-            QString dataDictionaryArchivePath = sqrlDataDictionary.VirtualPath();
-            QString m;
-            if (!RemoveDirectoryFromArchive(dataDictionaryArchivePath, packagePath, m))
-                return false;
+        /* remove files from archive */
+        if (fileMode == FileMode::ExistingPackage) {
+            squirrelDataDictionary sqrlDataDictionary(databaseUUID);
+            sqrlDataDictionary.SetObjectID(objectRowID);
+            sqrlDataDictionary.Get();
+            QString dataDictionaryArchivePath = sqrlDataDictionary.VirtualPath();
+            QString m;
+            if (!RemoveDirectoryFromArchive(dataDictionaryArchivePath, packagePath, m))
+                return false;
+        }
+        return true;
+    }
+    else {
+        Debug("Unknown object type [" + ObjectTypeToString(object) + "]");
+        return false;
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* ----- ExtractArchiveFileToMemory --------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Extract a single file from an existing archive and return it as a string
+ * @param archivePath Path to the archive
+ * @param filePath File path within the archive
+ * @param fileContents File contents as a QByteArray
+ * @return true if successful, false otherwise
+ */
+bool squirrel::ExtractArchiveFileToMemory(QString archivePath, QString filePath, QByteArray &fileContents) {
+    Debug(QString("Reading file [%1] from archive [%2]...").arg(filePath).arg(archivePath), __FUNCTION__);
+    phaseTimer t(ExtractionPhase);
+    try {
+        /* the newest appended segment that contains the file has its current version */
+        QStringList layers = ArchiveLayers(archivePath);
+        quint32 index(0);
+        int layer = static_cast<int>(layers.size()) - 1;
+        while ((layer >= 0) && !FindArchiveItem(layers.at(layer), filePath, index))
+            layer--;
+        if (layer < 0) {
+            fileContents = QByteArray();
+            Debug(QString("File [%1] not found in archive [%2]").arg(filePath).arg(archivePath), __FUNCTION__);
+            return false;
+        }
+
+        std::vector<unsigned char> buffer;
+        ArchiveReader(layers.at(layer)).extractTo(buffer, index);
+        bytesDecompressedCount += static_cast<qint64>(buffer.size());
+        Debug(QString("Copying buffer to QByteArray. Buffer size [%1] bytes").arg(buffer.size()), __FUNCTION__);
+        fileContents = QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<int>(buffer.size()));
+        Debug(QString("Extracted file [%1]. File is [%2] bytes in length").arg(filePath).arg(fileContents.size()), __FUNCTION__);
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        /* Do something with ex.what()...*/
+        fileContents = QByteArray();
+        Debug("Unable to extract file from archive using bit7z library [" + QString(ex.what()) + "]", __FUNCTION__);
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ExtractArchiveFileToMemory --------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Extract a single file from an existing archive and return it as a string
+ * @param archivePath Path to the archive
+ * @param filePath File path within the archive
+ * @param fileContents File contents as a QString
+ * @return true if successful, false otherwise
+ */
+bool squirrel::ExtractArchiveFileToMemory(QString archivePath, QString filePath, QString &fileContents) {
+    QByteArray bytes;
+    if (!ExtractArchiveFileToMemory(archivePath, filePath, bytes)) {
+        fileContents = "Unable to extract file from archive";
+        return false;
+    }
+
+    fileContents = QString::fromUtf8(bytes);
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- CompressDirectoryToArchive --------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Compress an existing directory to a new archive
+ * @param dir Directory containing the files to compress
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::CompressDirectoryToArchive(QString dir, QString archivePath, QString &m) {
+    Debug(QString("Compressing directory [%1] to archive [%2]...").arg(dir).arg(archivePath));
+
+    /* the files are added individually, so they get the same store policy as a written package */
+    QDir d(dir);
+    QStringList filePaths = utils::FindAllFiles(dir, "*", true);
+    QStringList compressedFilePaths;
+    for (const QString &f : filePaths)
+        compressedFilePaths.append(QDir::fromNativeSeparators(d.relativeFilePath(f)));
+
+    if (!CompressFilesToArchive(filePaths, compressedFilePaths, QMap<QString, QByteArray>(), archivePath, m))
+        return false;
+
+    m = "Successfully compressed directory [" + dir + "] to archive [" + archivePath + "]";
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- CompressFilesToArchive ------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Compress files from disk and from memory to a new archive, without copying them to a directory first
+ * @param filePaths Paths of the files on disk
+ * @param compressedFilePaths Path of each file within the archive
+ * @param memoryFiles Files to add from memory. Path within the archive -> file contents
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::CompressFilesToArchive(QStringList filePaths, QStringList compressedFilePaths, const QMap<QString, QByteArray> &memoryFiles, QString archivePath, QString &m) {
+    Debug(QString("Compressing [%1] files and [%2] memory files to archive [%3]...").arg(filePaths.size()).arg(memoryFiles.size()).arg(archivePath));
+    phaseTimer t(CompressionPhase);
+
+    if (filePaths.size() != compressedFilePaths.size()) {
+        m = QString("Number of files [%1] does not match the number of archive paths [%2]").arg(filePaths.size()).arg(compressedFilePaths.size());
+        return false;
+    }
+
+    /* the archive is about to be replaced, so any open reader on it is stale */
+    CloseArchiveReader();
+    totalbytes = 0;
+
+    try {
+        using namespace bit7z;
+        const Bit7zLibrary &lib = ArchiveLibrary();
+
+        if (overwritePackage) {
+            if (QFile::exists(archivePath) && (archivePath != "")) {
+                Debug("Overwrite option specified. Deleting existing package [" + archivePath + "]", __FUNCTION__);
+                QFile::remove(archivePath);
+            }
+            /* segments appended to the old package would be read as part of the new one */
+            for (const QString &segment : ArchiveSegments(archivePath)) {
+                QFile::remove(segment);
+                QFile::remove(ArchiveIndexFilePath(segment));
+            }
+        }
+
+        /* a pass of files that are mostly already compressed is stored instead of compressed again */
+        qint64 memoryBytes(0);
+        for (auto it = memoryFiles.constBegin(); it != memoryFiles.constEnd(); ++it)
+            memoryBytes += it.value().size();
+        bool store = StoreCompressedFiles(compression, filePaths, memoryBytes);
+
+        /* the writer keeps references to the memory buffers, so they must live until compressTo() returns */
+        std::list<std::vector<byte_t>> buffers;
+
+        archiveOpenCount++;
+        BitArchiveWriter archive(lib, ArchiveFormat(archivePath));
+        archive.setUpdateMode(UpdateMode::Update);
+        ApplyCompressionProfile(archive, compression, archivePath, store);
+        archive.setProgressCallback(progressCallback);
+        archive.setTotalCallback(totalArchiveSizeCallback);
+
+        for (auto it = memoryFiles.constBegin(); it != memoryFiles.constEnd(); ++it) {
+            buffers.emplace_back(it.value().constBegin(), it.value().constEnd());
+            archive.addFile(buffers.back(), it.key().toStdString());
+        }
+        for (int i=0; i<filePaths.size(); i++)
+            archive.addFile(filePaths.at(i).toStdString(), compressedFilePaths.at(i).toStdString());
+        totalbytes = 0;
+        archive.compressTo(archivePath.toStdString());
+        bytesCompressedCount += totalbytes;
+
+        m = QString("Successfully %1 [%2] files and [%3] memory files to archive [%4]").arg(store ? "stored" : "compressed").arg(filePaths.size()).arg(memoryFiles.size()).arg(archivePath);
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        m = "Unable to compress files into archive using bit7z library. Error [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- AddFilesToArchive ------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Add/update files to an existing archive
+ * @param filePaths File paths to add
+ * @param compressedFilePaths Paths to the file paths within the archive
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::AddFilesToArchive(QStringList filePaths, QStringList compressedFilePaths, QString archivePath, QString &m) {
+    phaseTimer t(CompressionPhase);
+
+    /* the editor rewrites the archive, so any open reader on it is stale */
+    CloseArchiveReader();
+    totalbytes = 0;
+
+    try {
+        using namespace bit7z;
+        const Bit7zLibrary &lib = ArchiveLibrary();
+
+        /* a pass of files that are mostly already compressed is stored instead of compressed again */
+        bool store = StoreCompressedFiles(compression, filePaths, 0);
+
+        archiveOpenCount++;
+        bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), ArchiveFormat(archivePath));
+        editor.setUpdateMode(UpdateMode::Update);
+        ApplyCompressionProfile(editor, compression, archivePath, store);
+        editor.setProgressCallback(progressCallback);
+        editor.setTotalCallback(totalArchiveSizeCallback);
+        for (int i=0; i<filePaths.size(); i++) {
+            std::string filePath = filePaths.at(i).toStdString();
+            std::string compressedPath = compressedFilePaths.at(i).toStdString();
+            editor.addFile(filePath, compressedPath);
+        }
+        totalbytes = 0;
+        editor.applyChanges();
+        bytesCompressedCount += totalbytes;
+
+        m = "Successfully added/updated file(s) to archive [" + archivePath + "]";
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        /* Do something with ex.what()...*/
+        m = "Unable to add/update files into archive using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- RemoveDirectoryFromArchive --------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Recursively remove a directory from an archive
+ * @param compressedDirPath The path to delete
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during he operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::RemoveDirectoryFromArchive(QString compressedDirPath, QString archivePath, QString &m) {
+    /* the directory may be in an appended segment, so the segments are folded into the package first */
+    if (!ArchiveSegments(archivePath).isEmpty() && !CompactArchive(archivePath, m))
+        return false;
+
+    /* aliases of files in the directory get their own copy, and aliases within the directory are dropped */
+    QString td;
+    if (!MakeTempDir(td)) {
+        m = "Error creating temporary directory for the package aliases";
+        return false;
+    }
+    QStringList aliasFilePaths, aliasArchivePaths;
+    bool aliasesOk = DetachAliases(archivePath, [compressedDirPath](const QString &path) { return path.startsWith(compressedDirPath); }, td, aliasFilePaths, aliasArchivePaths, m);
+    if (aliasesOk && !aliasFilePaths.isEmpty())
+        aliasesOk = AddFilesToArchive(aliasFilePaths, aliasArchivePaths, archivePath, m);
+    DeleteTempDir(td);
+    if (!aliasesOk)
+        return false;
+
+    phaseTimer t(CompressionPhase);
+    try {
+        using namespace bit7z;
+        const Bit7zLibrary &lib = ArchiveLibrary();
+
+        /* first, get the index of the directory to remove */
+        std::vector<uint32_t> indexes;
+        for (const auto& item : ArchiveReader(archivePath)) {
+            QString archivedPath = QString::fromStdString(item.path());
+            if (archivedPath.startsWith(compressedDirPath)) {
+                indexes.push_back(item.index());
+            }
+        }
+
+        /* the editor rewrites the archive, so the reader must be closed before the editor opens it */
+        CloseArchiveReader();
+
+        /* next, remove the item from the archive and apply changes */
+        archiveOpenCount++;
+        bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), ArchiveFormat(archivePath));
+        editor.setUpdateMode(UpdateMode::Update);
+        for (uint32_t index : indexes) {
+            editor.deleteItem(index);
+        }
+        editor.applyChanges();
+
+        m = "Successfully removed file(s) from archive [" + archivePath + "]";
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        /* Do something with ex.what()...*/
+        CloseArchiveReader();
+        m = "Unable to remove files from archive using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- UpdateMemoryFileToArchive ---------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Update a single file, from memory, into an existing archive
+ * @param file File contents as a QString
+ * @param compressedFilePath File path within the archive
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ */
+bool squirrel::UpdateMemoryFileToArchive(QString file, QString compressedFilePath, QString archivePath, QString &m) {
+    phaseTimer t(CompressionPhase);
+
+    /* the editor rewrites the archive, so any open reader on it is stale */
+    CloseArchiveReader();
+    totalbytes = 0;
+
+    try {
+        using namespace bit7z;
+        const Bit7zLibrary &lib = ArchiveLibrary();
+        /* convert the QString to a istream */
+        std::istringstream i(file.toStdString());
+
+        archiveOpenCount++;
+        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
+            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
+            editor.setUpdateMode(UpdateMode::Update);
+            ApplyCompressionProfile(editor, compression, archivePath);
+            editor.setProgressCallback(progressCallback);
+            editor.setTotalCallback(totalArchiveSizeCallback);
+            editor.updateItem(compressedFilePath.toStdString(), i);
+            editor.applyChanges();
+        }
+        else {
+            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
+            editor.setUpdateMode(UpdateMode::Update);
+            ApplyCompressionProfile(editor, compression, archivePath);
+            editor.setProgressCallback(progressCallback);
+            editor.setTotalCallback(totalArchiveSizeCallback);
+            editor.updateItem(compressedFilePath.toStdString(), i);
+            editor.applyChanges();
+        }
+        bytesCompressedCount += totalbytes;
+        m = "Successfully compressed memory file to archive [" + archivePath + "]";
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        /* Do something with ex.what()...*/
+        m = "Unable to compress directory into archive using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- AppendSegmentToArchive ------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Add/update files in an existing archive by writing them to a new segment next to it
+ * @param filePaths File paths to add
+ * @param compressedFilePaths Paths to the file paths within the archive
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ *
+ * A 7z archive can't be added to without rewriting it, so an update is written
+ * as its own archive, <package>.seg<n>.7z, and the package is left untouched.
+ * Files in a later segment replace files with the same path in the package and
+ * in earlier segments. The segment only appears under its final name once it
+ * is complete, so an interrupted update leaves the package as it was.
+ */
+bool squirrel::AppendSegmentToArchive(QStringList filePaths, QStringList compressedFilePaths, QString archivePath, QString &m) {
+    int segment = static_cast<int>(ArchiveSegments(archivePath).size()) + 1;
+    QString partialPath = ArchiveSegmentPath(archivePath, segment, true);
+    QString segmentPath = ArchiveSegmentPath(archivePath, segment);
+    QFile::remove(partialPath);
+
+    if (!CompressFilesToArchive(filePaths, compressedFilePaths, QMap<QString, QByteArray>(), partialPath, m)) {
+        QFile::remove(partialPath);
+        return false;
+    }
+    if (!QFile::rename(partialPath, segmentPath)) {
+        QFile::remove(partialPath);
+        m = QString("Unable to rename segment [%1] to [%2]").arg(partialPath).arg(segmentPath);
+        return false;
+    }
+
+    /* the segment has its own sidecar index, so reading it doesn't need a pass over its items */
+    QString im;
+    if (!WriteArchiveIndexFile(segmentPath, im))
+        Log(im);
+
+    m = QString("Appended [%1] file(s) to package [%2] as segment [%3]").arg(filePaths.size()).arg(archivePath).arg(segmentPath);
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- CompactArchive --------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Fold an archive's appended segments, and optionally more files, into the archive in one rewrite
+ * @param archivePath Path to the archive
+ * @param m Any messages generated during the operation
+ * @param filePaths File paths to add along with the segments' files
+ * @param compressedFilePaths Paths to the file paths within the archive
+ * @return true if successful, false otherwise
+ *
+ * The segments are extracted oldest first, so each file ends up at its newest
+ * version, and a given file replaces any version of it in the segments. The
+ * segments are deleted only after the archive has been rewritten.
+ */
+bool squirrel::CompactArchive(QString archivePath, QString &m, QStringList filePaths, QStringList compressedFilePaths) {
+    QStringList segments = ArchiveSegments(archivePath);
+    if (segments.isEmpty() && filePaths.isEmpty()) {
+        m = QString("Package [%1] has no appended segments").arg(archivePath);
+        return true;
+    }
+
+    QString td;
+    if (!MakeTempDir(td)) {
+        m = "Error creating temporary directory for the package segments";
+        return false;
+    }
+
+    /* archive path -> disk path. The given files are added last, so they win. A segment's aliases are
+       copied from their stored files, so the aliases.json of the package is the only one */
+    QMap<QString, QString> files;
+    QString segmentsDir = td + "/segments";
+    try {
+        phaseTimer t(ExtractionPhase);
+        for (const QString &segment : segments) {
+            const archiveIndex &index = ArchiveIndex(segment);
+            for (auto it = index.items.constBegin(); it != index.items.constEnd(); ++it) {
+                if (!it.value().isDir && (it.key() != "aliases.json")) {
+                    if (!index.aliases.contains(it.key()))
+                        bytesDecompressedCount += it.value().size;
+                    files.insert(it.key(), segmentsDir + "/" + it.key());
+                }
+            }
+            QHash<QString, QString> aliases = index.aliases;
+            ArchiveReader(segment).extractTo(segmentsDir.toStdString());
+            if (!MaterializeAliases(aliases, segmentsDir, m)) {
+                DeleteTempDir(td);
+                return false;
+            }
+        }
+    }
+    catch ( const bit7z::BitException& ex ) {
+        CloseArchiveReader();
+        DeleteTempDir(td);
+        m = "Unable to extract package segments using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+    for (int i=0; i<filePaths.size(); i++)
+        files.insert(compressedFilePaths.at(i), filePaths.at(i));
+
+    /* aliases in the package of a file that is replaced keep the contents they had */
+    QStringList aliasFilePaths, aliasArchivePaths;
+    if (!DetachAliases(archivePath, [&files](const QString &path) { return files.contains(path); }, td, aliasFilePaths, aliasArchivePaths, m)) {
+        DeleteTempDir(td);
+        return false;
+    }
+    for (int i=0; i<aliasFilePaths.size(); i++)
+        files.insert(aliasArchivePaths.at(i), aliasFilePaths.at(i));
+
+    Debug(QString("Compacting [%1] segments and [%2] files into [%3]").arg(segments.size()).arg(filePaths.size()).arg(archivePath), __FUNCTION__);
+    bool ok = AddFilesToArchive(files.values(), files.keys(), archivePath, m);
+    DeleteTempDir(td);
+    if (!ok)
+        return false;
+
+    for (const QString &segment : segments) {
+        QFile::remove(segment);
+        QFile::remove(ArchiveIndexFilePath(segment));
+    }
+
+    QString im;
+    if (!WriteArchiveIndexFile(archivePath, im))
+        Log(im);
+
+    m = QString("Compacted [%1] segments and [%2] files into package [%3]").arg(segments.size()).arg(filePaths.size()).arg(archivePath);
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- UpdatePackageFiles ----------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Add/update files in the existing package
+ * @param filePaths File paths to add
+ * @param compressedFilePaths Paths to the file paths within the package
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ *
+ * In append mode the files are written to a new segment. Otherwise the package
+ * is rewritten once, with the files and any appended segments folded into it.
+ */
+bool squirrel::UpdatePackageFiles(QStringList filePaths, QStringList compressedFilePaths, QString &m) {
+    if (filePaths.size() != compressedFilePaths.size()) {
+        m = QString("Number of files [%1] does not match the number of archive paths [%2]").arg(filePaths.size()).arg(compressedFilePaths.size());
+        return false;
+    }
+
+    if (appendUpdates)
+        return AppendSegmentToArchive(filePaths, compressedFilePaths, GetPackagePath(), m);
+    else
+        return CompactArchive(GetPackagePath(), m, filePaths, compressedFilePaths);
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- UpdatePackageHeader ---------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Replace the package's squirrel.json
+ * @param jsonPath path of the new squirrel.json on disk
+ * @param m Any messages generated during the operation
+ * @param dropOldHeaders true to also remove the superseded squirrel.json from the older layers, with DropOldHeaders()
+ * @return true if successful, false otherwise
+ *
+ * The header is written to a header segment, an appended segment that holds
+ * only squirrel.json, so the cost is the size of the header and not of the
+ * package. The newest squirrel.json is the package's header, so the old one
+ * is superseded without being touched. If the newest segment is already a
+ * header segment it is replaced, so repeated metadata edits leave a single
+ * small segment instead of a chain.
+ */
+bool squirrel::UpdatePackageHeader(QString jsonPath, QString &m, bool dropOldHeaders) {
+    QString archivePath = GetPackagePath();
+    QStringList segments = ArchiveSegments(archivePath);
+
+    bool replace(false);
+    if (!segments.isEmpty()) {
+        try {
+            const QHash<QString, archiveEntry> &items = ArchiveItems(segments.last());
+            replace = ((items.size() == 1) && items.contains("squirrel.json"));
+        }
+        catch ( const bit7z::BitException& ex ) {
+            Debug(QString("Unable to read segment [%1]. Appending a new header segment. [%2]").arg(segments.last()).arg(ex.what()), __FUNCTION__);
+        }
+    }
+
+    if (replace) {
+        /* the new header segment is written next to the old one, and renamed over it */
+        int segment = static_cast<int>(segments.size());
+        QString partialPath = ArchiveSegmentPath(archivePath, segment, true);
+        QString segmentPath = ArchiveSegmentPath(archivePath, segment);
+        QFile::remove(partialPath);
+        if (!CompressFilesToArchive(QStringList() << jsonPath, QStringList() << "squirrel.json", QMap<QString, QByteArray>(), partialPath, m)) {
+            QFile::remove(partialPath);
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(partialPath.toStdString(), segmentPath.toStdString(), ec);
+        if (ec) {
+            QFile::remove(partialPath);
+            m = QString("Unable to rename segment [%1] to [%2]. Error [%3]").arg(partialPath).arg(segmentPath).arg(QString::fromStdString(ec.message()));
+            return false;
+        }
+
+        QString im;
+        if (!WriteArchiveIndexFile(segmentPath, im))
+            Log(im);
+
+        m = QString("Replaced the header of package [%1] in header segment [%2]").arg(archivePath).arg(segmentPath);
+    }
+    else if (!AppendSegmentToArchive(QStringList() << jsonPath, QStringList() << "squirrel.json", archivePath, m))
+        return false;
+
+    if (!dropOldHeaders)
+        return true;
+
+    QString dm;
+    if (!DropOldHeaders(archivePath, dm)) {
+        m = dm;
+        return false;
+    }
+    m += "\n" + dm;
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- DropOldHeaders --------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Remove squirrel.json from every layer of a package except the newest one that has it
+ * @param archivePath Path to the package
+ * @param m Any messages generated during the operation
+ * @return true if successful, false otherwise
+ *
+ * A superseded header is no longer read, but its bytes are still in its layer.
+ * Neither 7z nor zip can delete an entry in place, so a layer is written again
+ * without its old squirrel.json. The layer's other items are copied as they
+ * are, without being decompressed or compressed again, so this costs the
+ * layer's I/O but not its compression. An older header segment, which holds
+ * nothing but the header, is replaced with a copy of the newest one, so the
+ * segments keep their numbering.
+ */
+bool squirrel::DropOldHeaders(QString archivePath, QString &m) {
+    phaseTimer t(CompressionPhase);
+    QStringList layers = ArchiveLayers(archivePath);
+    try {
+        int newest = static_cast<int>(layers.size()) - 1;
+        while ((newest >= 0) && !ArchiveItems(layers.at(newest)).contains("squirrel.json"))
+            newest--;
+        if (newest < 0) {
+            m = QString("Package [%1] has no squirrel.json").arg(archivePath);
+            return false;
+        }
+
+        int dropped(0);
+        for (int layer=0; layer<newest; layer++) {
+            const QString &layerPath = layers.at(layer);
+            const QHash<QString, archiveEntry> &items = ArchiveItems(layerPath);
+            auto json = items.constFind("squirrel.json");
+            if (json == items.constEnd())
+                continue;
+            quint32 index = json.value().index;
+            bool headerOnly = (layer > 0) && (items.size() == 1);
+
+            /* the layer is about to be replaced, so any open reader on it is stale */
+            CloseArchiveReader();
+            if (headerOnly) {
+                QString partialPath = ArchiveSegmentPath(archivePath, layer, true);
+                QFile::remove(partialPath);
+                std::error_code ec;
+                if (QFile::copy(layers.at(newest), partialPath))
+                    std::filesystem::rename(partialPath.toStdString(), layerPath.toStdString(), ec);
+                else
+                    ec = std::make_error_code(std::errc::io_error);
+                if (ec) {
+                    QFile::remove(partialPath);
+                    m = QString("Unable to replace header segment [%1]. Error [%2]").arg(layerPath).arg(QString::fromStdString(ec.message()));
+                    return false;
+                }
+            }
+            else {
+                archiveOpenCount++;
+                bit7z::BitArchiveEditor editor(ArchiveLibrary(), layerPath.toStdString(), ArchiveFormat(layerPath));
+                editor.setUpdateMode(bit7z::UpdateMode::Update);
+                editor.deleteItem(index);
+                editor.applyChanges();
+            }
+
+            QString im;
+            if (!WriteArchiveIndexFile(layerPath, im))
+                Log(im);
+            dropped++;
         }
+
+        m = QString("Removed [%1] superseded headers from package [%2]").arg(dropped).arg(archivePath);
         return true;
     }
-    else {
-        Debug("Unknown object type [" + ObjectTypeToString(object) + "]");
+    catch ( const bit7z::BitException& ex ) {
+        CloseArchiveReader();
+        m = "Unable to remove the superseded headers using bit7z library [" + QString(ex.what()) + "]";
         return false;
     }
 }
 
+
 /* ------------------------------------------------------------ */
-/* ----- ExtractArchiveFileToMemory --------------------------- */
+/* ----- DetachAliases ---------------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Extract a single file from an existing archive and return it as a string
+ * @brief Prepare an archive's aliases for files that are about to be replaced or removed
  * @param archivePath Path to the archive
- * @param filePath File path within the archive
- * @param fileContents File contents as a QByteArray
+ * @param dropped Returns true for an archive path that is about to be replaced or removed
+ * @param tmpDir Temporary directory for the files written by this function
+ * @param filePaths Files to add to the archive, along with the change. Appended to
+ * @param compressedFilePaths Paths of the files within the archive. Appended to
+ * @param m Any messages generated during the operation
  * @return true if successful, false otherwise
+ *
+ * A dropped alias is removed from aliases.json. An alias of a dropped file is
+ * given a copy of the file's current contents under its own path. If either
+ * happens, the new aliases.json is added to the files.
  */
-bool squirrel::ExtractArchiveFileToMemory(QString archivePath, QString filePath, QByteArray &fileContents) {
-    Debug(QString("Reading file [%1] from archive [%2]...").arg(filePath).arg(archivePath), __FUNCTION__);
+bool squirrel::DetachAliases(QString archivePath, std::function<bool(const QString&)> dropped, QString tmpDir, QStringList &filePaths, QStringList &compressedFilePaths, QString &m) {
+    QString dir = tmpDir + "/detached";
     try {
-        using namespace bit7z;
-        std::vector<unsigned char> buffer;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            BitFileExtractor extractor(lib, BitFormat::Zip);
-            extractor.setProgressCallback(progressCallback);
-            extractor.setTotalCallback(totalArchiveSizeCallback);
-            extractor.extractMatching(archivePath.toStdString(), filePath.toStdString(), buffer);
+        QHash<QString, QString> aliases = ArchiveIndex(archivePath).aliases;
+        if (aliases.isEmpty())
+            return true;
+
+        QJsonObject kept;
+        bool changed(false);
+        for (auto it = aliases.constBegin(); it != aliases.constEnd(); ++it) {
+            if (dropped(it.key())) {
+                changed = true;
+                continue;
+            }
+            if (!dropped(it.value())) {
+                kept.insert(it.key(), it.value());
+                continue;
+            }
+
+            /* the stored file is going away, so the alias gets its own copy of it */
+            changed = true;
+            quint32 index(0);
+            FindArchiveItem(archivePath, it.value(), index);
+            std::vector<unsigned char> buffer;
+            ArchiveReader(archivePath).extractTo(buffer, index);
+            bytesDecompressedCount += static_cast<qint64>(buffer.size());
+            QString path = dir + "/" + it.key();
+            QString dm;
+            utils::MakePath(QFileInfo(path).absolutePath(), dm);
+            QFile f(path);
+            if (!f.open(QIODevice::WriteOnly) || (f.write(reinterpret_cast<const char*>(buffer.data()), static_cast<qint64>(buffer.size())) != static_cast<qint64>(buffer.size()))) {
+                m = QString("Unable to write alias [%1] to [%2]. Error [%3]").arg(it.key()).arg(path).arg(f.errorString());
+                return false;
+            }
+            filePaths.append(path);
+            compressedFilePaths.append(it.key());
         }
-        else {
-            BitFileExtractor extractor(lib, BitFormat::SevenZip);
-            extractor.setProgressCallback(progressCallback);
-            extractor.setTotalCallback(totalArchiveSizeCallback);
-            Debug("Before calling extractMatching()", __FUNCTION__);
-            extractor.extractMatching(archivePath.toStdString(), filePath.toStdString(), buffer);
-            Debug(QString("After calling extractMatching() buffer size [%1] bytes").arg(buffer.size()), __FUNCTION__);
+        if (!changed)
+            return true;
+
+        QString dm;
+        utils::MakePath(dir, dm);
+        QFile f(dir + "/aliases.json");
+        QByteArray json = QJsonDocument(kept).toJson();
+        if (!f.open(QIODevice::WriteOnly) || (f.write(json) != json.size())) {
+            m = QString("Unable to write [%1]. Error [%2]").arg(f.fileName()).arg(f.errorString());
+            return false;
         }
-        Debug(QString("Copying buffer to QByteArray. Buffer size [%1] bytes").arg(buffer.size()), __FUNCTION__);
-        fileContents = QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<int>(buffer.size()));
-        Debug(QString("Extracted file [%1]. File is [%2] bytes in length").arg(filePath).arg(fileContents.size()), __FUNCTION__);
+        filePaths.append(f.fileName());
+        compressedFilePaths.append("aliases.json");
         return true;
     }
     catch ( const bit7z::BitException& ex ) {
-        /* Do something with ex.what()...*/
-        fileContents = QByteArray();
-        Debug("Unable to extract file from archive using bit7z library [" + QString(ex.what()) + "]", __FUNCTION__);
+        m = "Unable to read aliases using bit7z library [" + QString(ex.what()) + "]";
         return false;
     }
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- ExtractArchiveFileToMemory --------------------------- */
+/* ----- MaterializeAliases ----------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Extract a single file from an existing archive and return it as a string
- * @param archivePath Path to the archive
- * @param filePath File path within the archive
- * @param fileContents File contents as a QString
+ * @brief Copy each alias's stored file to the alias's path, in a directory extracted from an archive
+ * @param aliases alias path -> path of the stored file, both within the archive
+ * @param dir directory the archive was extracted to
+ * @param m Any messages generated during the operation
  * @return true if successful, false otherwise
  */
-bool squirrel::ExtractArchiveFileToMemory(QString archivePath, QString filePath, QString &fileContents) {
-    QByteArray bytes;
-    if (!ExtractArchiveFileToMemory(archivePath, filePath, bytes)) {
-        fileContents = "Unable to extract file from archive";
-        return false;
+bool squirrel::MaterializeAliases(const QHash<QString, QString> &aliases, QString dir, QString &m) {
+    for (auto it = aliases.constBegin(); it != aliases.constEnd(); ++it) {
+        QString source = dir + "/" + it.value();
+        QString dest = dir + "/" + it.key();
+        QString dm;
+        utils::MakePath(QFileInfo(dest).absolutePath(), dm);
+        QFile::remove(dest);
+        if (!QFile::copy(source, dest)) {
+            m = QString("Unable to copy [%1] to alias [%2]").arg(source).arg(dest);
+            return false;
+        }
     }
-
-    fileContents = QString::fromUtf8(bytes);
     return true;
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- CompressDirectoryToArchive --------------------------- */
+/* ----- ExtractArchiveToDirectory ---------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Compress an existing directory to a new archive
- * @param dir Directory containing the files to compress
+ * @brief Extract an entire archive to a specified directory
  * @param archivePath Path to the archive
- * @param m Any messages generated during the operation
  * @return true if successful, false otherwise
  */
-bool squirrel::CompressDirectoryToArchive(QString dir, QString archivePath, QString &m) {
-    Debug(QString("Compressing directory [%1] to archive [%2]...").arg(dir).arg(archivePath));
+bool squirrel::ExtractArchiveToDirectory(QString archivePath, QString destinationPath, QString &m) {
 
-    try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
+    phaseTimer t(ExtractionPhase);
 
-        if (overwritePackage) {
-            if (QFile::exists(archivePath) && (archivePath != "")) {
-                Debug("Overwrite option specified. Deleting existing package [" + archivePath + "]", __FUNCTION__);
-                QFile::remove(archivePath);
+    /* the package, then its appended segments, which overwrite the files they replace */
+    for (const QString &layer : ArchiveLayers(archivePath)) {
+        /* 7za reports no sizes, so the bytes extracted are the unpacked sizes of the stored files in the layer's index */
+        try {
+            const archiveIndex &index = ArchiveIndex(layer);
+            for (auto it = index.items.constBegin(); it != index.items.constEnd(); ++it) {
+                if (!it.value().isDir && !index.aliases.contains(it.key()))
+                    bytesDecompressedCount += it.value().size;
             }
         }
+        catch ( const bit7z::BitException& ex ) {
+            Debug(QString("Unable to index [%1]. Its extracted bytes are not counted [%2]").arg(layer).arg(ex.what()), __FUNCTION__);
+        }
 
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            BitArchiveWriter archive(lib, BitFormat::Zip);
-            archive.setUpdateMode(UpdateMode::Update);
-            archive.setCompressionLevel(BitCompressionLevel::Fastest);
-            archive.setRetainDirectories(true);
-            archive.setProgressCallback(progressCallback);
-            archive.setTotalCallback(totalArchiveSizeCallback);
-            archive.addFiles(dir.toStdString(), "*", true); // instead of addDirectory
-            archive.compressTo(archivePath.toStdString());
+        QString systemstring = QString("7za x -y %1 -o%2").arg(layer).arg(destinationPath);
+        archiveOpenCount++;
+        m += systemstring + "\n";
+        Log(QString("Extracting %1 to %2").arg(layer).arg(destinationPath));
+        Log(utils::SystemCommand(systemstring));
+
+        /* 7za extracts only the stored files, so each alias is copied from its stored file */
+        QString aliasPath = destinationPath + "/aliases.json";
+        if (QFile::exists(aliasPath)) {
+            QFile f(aliasPath);
+            QHash<QString, QString> aliases;
+            if (f.open(QIODevice::ReadOnly)) {
+                QJsonObject aliasObject = QJsonDocument::fromJson(f.readAll()).object();
+                for (auto it = aliasObject.constBegin(); it != aliasObject.constEnd(); ++it)
+                    aliases.insert(it.key(), it.value().toString());
+                f.close();
+            }
+            QString am;
+            if (!MaterializeAliases(aliases, destinationPath, am))
+                Log(am);
+            QFile::remove(aliasPath);
         }
-        else {
-            BitArchiveWriter archive(lib, BitFormat::SevenZip);
-            archive.setUpdateMode(UpdateMode::Update);
-            archive.setCompressionLevel(BitCompressionLevel::Fastest);
-            archive.setRetainDirectories(true);
-            archive.setSolidMode(false);
-            archive.setProgressCallback(progressCallback);
-            archive.setTotalCallback(totalArchiveSizeCallback);
-            archive.addFiles(dir.toStdString(), "*", true); // instead of addDirectory
-            archive.compressTo(archivePath.toStdString());
-        }
-        m = "Successfully compressed directory [" + dir + "] to archive [" + archivePath + "]";
+    }
+    if (utils::FileExists(destinationPath)) {
+        m += destinationPath + " exists\n";
         return true;
     }
-    catch ( const bit7z::BitException& ex ) {
-        /* Do something with ex.what()...*/
-        m = "Unable to compress directory into archive using bit7z library. Error [" + QString(ex.what()) + "]";
+    else {
+        m += destinationPath + " does not exist\n";
         return false;
     }
+
+    // try {
+    //     using namespace bit7z;
+    //     Bit7zLibrary lib(p7zipLibPath.toStdString());
+
+    //     if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
+    //         //bit7z::BitArchiveReader archive(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
+    //         //archive.setProgressCallback(progressCallback);
+    //         //archive.setTotalCallback(totalArchiveSizeCallback);
+    //         //archive.extractTo(destinationPath.toStdString());
+
+    //         bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::Zip);
+    //         extractor.setProgressCallback(progressCallback);
+    //         extractor.setTotalCallback(totalArchiveSizeCallback);
+    //         extractor.extract(archivePath.toStdString(), destinationPath.toStdString());
+    //     }
+    //     else {
+    //         //bit7z::BitArchiveReader archive(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
+    //         //archive.setProgressCallback(progressCallback);
+    //         //archive.setTotalCallback(totalArchiveSizeCallback);
+    //         //archive.extractTo(destinationPath.toStdString());
+
+    //         bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
+    //         extractor.setProgressCallback(progressCallback);
+    //         extractor.setTotalCallback(totalArchiveSizeCallback);
+    //         extractor.extract(archivePath.toStdString(), destinationPath.toStdString());
+    //    }
+    //    m = "Successfully extracted archive [" + archivePath + "] to directory [" + destinationPath + "]";
+    //    return true;
+    //}
+    //catch ( const bit7z::BitException& ex ) {
+    //    /* Do something with ex.what()...*/
+    //    m = "Unable to extract archive to directory using bit7z library [" + QString(ex.what()) + "]";
+    //    return false;
+    //}
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- AddFilesToArchive ------------------------------------ */
+/* ----- GetArchiveFileListing -------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Add/update files to an existing archive
- * @param filePaths File paths to add
- * @param compressedFilePaths Paths to the file paths within the archive
- * @param archivePath Path to the archive
- * @param m Any messages generated during the operation
- * @return true if successful, false otherwise
+ * @brief Get a list of files within an archive that are under a given sub-directory
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @param subDir path prefix to filter archive entries
+ * @param files output list of matching archive entry paths
+ * @param m output message on failure
+ * @return true if successful
  */
-bool squirrel::AddFilesToArchive(QStringList filePaths, QStringList compressedFilePaths, QString archivePath, QString &m) {
+bool squirrel::GetArchiveFileListing(QString archivePath, QString subDir, QStringList &files, QString &m) {
     try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-            editor.setUpdateMode(UpdateMode::Update);
-            editor.setProgressCallback(progressCallback);
-            editor.setTotalCallback(totalArchiveSizeCallback);
-            for (int i=0; i<filePaths.size(); i++) {
-                std::string filePath = filePaths.at(i).toStdString();
-                std::string compressedPath = compressedFilePaths.at(i).toStdString();
-                editor.addFile(filePath, compressedPath);
-            }
-            editor.applyChanges();
-        }
-        else {
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
-            editor.setUpdateMode(UpdateMode::Update);
-            editor.setSolidMode(false);
-            editor.setProgressCallback(progressCallback);
-            editor.setTotalCallback(totalArchiveSizeCallback);
-            for (int i=0; i<filePaths.size(); i++) {
-                std::string filePath = filePaths.at(i).toStdString();
-                std::string compressedPath = compressedFilePaths.at(i).toStdString();
-                editor.addFile(filePath, compressedPath);
+        /* from the index of each layer, so an archive with a current sidecar is not opened */
+        QSet<QString> listed(files.begin(), files.end());
+        for (const QString &layer : ArchiveLayers(archivePath)) {
+            const archiveIndex &index = ArchiveIndex(layer);
+            for (auto object = index.objects.constBegin(); object != index.objects.constEnd(); ++object) {
+                for (const QString &path : object.value()) {
+                    if (path.startsWith(subDir) && !listed.contains(path)) {
+                        listed.insert(path);
+                        files.append(path);
+                    }
+                }
             }
-            editor.applyChanges();
         }
-        m = "Successfully added/updated file(s) to archive [" + archivePath + "]";
         return true;
     }
     catch ( const bit7z::BitException& ex ) {
         /* Do something with ex.what()...*/
-        m = "Unable to add/update files into archive using bit7z library [" + QString(ex.what()) + "]";
+        m = "Unable to get subdirectory listing using bit7z library [" + QString(ex.what()) + "]";
         return false;
     }
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- RemoveDirectoryFromArchive --------------------------- */
+/* ----- BuildArchiveIndex ------------------------------------ */
 /* ------------------------------------------------------------ */
 /**
- * @brief Recursively remove a directory from an archive
- * @param compressedDirPath The path to delete
- * @param archivePath Path to the archive
- * @param m Any messages generated during he operation
- * @return true if successful, false otherwise
+ * @brief Index the series files and params.json files in an archive
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @param m output message
+ * @param dataPath if not empty, only index entries under this path (e.g. "data/S1234/")
+ * @return true if successful
+ *
+ * Fills archiveSeriesFiles with the files found under each data/subject/study/series
+ * path, and archiveParams with the contents of each series params.json. The
+ * series are the objects of ArchiveIndex(), which uses the package's .sqidx
+ * sidecar if it is present and current, otherwise one pass over the archive.
+ * The params.json files are extracted by item index from one open reader, so
+ * reading a package costs one archive open instead of two per series.
  */
-bool squirrel::RemoveDirectoryFromArchive(QString compressedDirPath, QString archivePath, QString &m) {
+bool squirrel::BuildArchiveIndex(QString archivePath, QString &m, QString dataPath) {
+    phaseTimer t(ExtractionPhase);
+    ClearArchiveIndex();
+
     try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
+        /* the package, then its appended segments. A params.json in a later segment replaces the earlier one.
+           The series are the objects of each layer's index, and a layer is opened only to extract params.json */
+        QSet<QString> indexed;
+        qint64 numParams(0);
+        for (const QString &layer : ArchiveLayers(archivePath)) {
+            const archiveIndex &index = ArchiveIndex(layer);
+            for (auto object = index.objects.constBegin(); object != index.objects.constEnd(); ++object) {
+                /* series files are stored as data/subject/study/series/... */
+                const QString &seriesPath = object.key();
+                if (!seriesPath.startsWith("data/") || (seriesPath.count('/') != 3))
+                    continue;
+                if (!dataPath.isEmpty() && !(seriesPath + "/").startsWith(dataPath))
+                    continue;
+
+                for (const QString &path : object.value()) {
+                    if (!index.items.value(path).isDir && !indexed.contains(path)) {
+                        indexed.insert(path);
+                        archiveSeriesFiles[seriesPath].append(QDir::toNativeSeparators(path));
+                    }
+                }
 
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            /* first, get the index of the directory to remove */
-            std::vector<uint32_t> indexes;
-            BitArchiveReader reader(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-            for (const auto& item : reader) {
-                QString archivedPath = QString::fromStdString(item.path());
-                if (archivedPath.startsWith(compressedDirPath)) {
-                    indexes.push_back(item.index());
+                auto params = index.items.constFind(seriesPath + "/params.json");
+                if ((params != index.items.constEnd()) && !params.value().isDir) {
+                    std::vector<unsigned char> buffer;
+                    ArchiveReader(layer).extractTo(buffer, params.value().index);
+                    bytesDecompressedCount += static_cast<qint64>(buffer.size());
+                    archiveParams.insert(seriesPath, QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<int>(buffer.size())));
+                    numParams++;
                 }
             }
+        }
 
-            /* next, remove the item from the archive and apply changes */
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-            editor.setUpdateMode(UpdateMode::Update);
-            for (uint32_t index : indexes) {
-                editor.deleteItem(index);
-            }
-            editor.applyChanges();
+        m = QString("Indexed [%1] archive entries, [%2] series, [%3] params files in archive [%4]%5").arg(indexed.size()).arg(archiveSeriesFiles.size()).arg(numParams).arg(archivePath).arg(dataPath.isEmpty() ? "" : " under [" + dataPath + "]");
+        return true;
+    }
+    catch ( const bit7z::BitException& ex ) {
+        ClearArchiveIndex();
+        m = "Unable to index archive using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ArchiveIndexFilePath --------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the path of the sidecar index for a package
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @return path of the sidecar index, which is the package path with .sqidx appended
+ */
+QString squirrel::ArchiveIndexFilePath(QString archivePath) {
+    return archivePath + ".sqidx";
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- WriteArchiveIndexFile -------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Write the binary sidecar index for a package
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @param m output message
+ * @return true if successful
+ *
+ * The sidecar records the size and modification time of the package, a SHA-1
+ * of squirrel.json, and every entry in the archive grouped by object (see
+ * archiveIndex::objects), with its item index, sizes, CRC, and the stored
+ * file of an alias. It must be written after the last change to the archive.
+ */
+bool squirrel::WriteArchiveIndexFile(QString archivePath, QString &m) {
+    QString indexPath = ArchiveIndexFilePath(archivePath);
+
+    /* the index comes from the archive itself, not from the sidecar being replaced */
+    bool ignore = ignoreArchiveIndexFile;
+    try {
+        ignoreArchiveIndexFile = true;
+        archiveIndexes.remove(archivePath);
+        const archiveIndex &index = ArchiveIndex(archivePath);
+        ignoreArchiveIndexFile = ignore;
+
+        QByteArray jsonHash;
+        auto json = index.items.constFind("squirrel.json");
+        if (json != index.items.constEnd()) {
+            std::vector<unsigned char> buffer;
+            ArchiveReader(archivePath).extractTo(buffer, json.value().index);
+            bytesDecompressedCount += static_cast<qint64>(buffer.size());
+            jsonHash = QCryptographicHash::hash(QByteArrayView(reinterpret_cast<const char*>(buffer.data()), static_cast<qsizetype>(buffer.size())), QCryptographicHash::Sha1);
         }
-        else {
-            /* first, get the index of the directory to remove */
-            std::vector<uint32_t> indexes;
-            BitArchiveReader reader(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
-            for (const auto& item : reader) {
-                QString archivedPath = QString::fromStdString(item.path());
-                if (archivedPath.startsWith(compressedDirPath)) {
-                    indexes.push_back(item.index());
-                }
-            }
 
-            /* next, remove the item from the archive and apply changes */
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
-            editor.setUpdateMode(UpdateMode::Update);
-            for (uint32_t index : indexes) {
-                editor.deleteItem(index);
+        QSaveFile f(indexPath);
+        if (!f.open(QIODevice::WriteOnly)) {
+            m = QString("Unable to open sidecar index [%1] for writing. Error [%2]").arg(indexPath).arg(f.errorString());
+            return false;
+        }
+        QDataStream out(&f);
+        out.setVersion(QDataStream::Qt_6_0);
+        out << quint32(0x53514958) << quint32(2); /* 'SQIX', format version 2 */
+        out << index.archiveSize << index.archiveModified << jsonHash;
+        out << quint32(index.objects.size());
+        for (auto object = index.objects.constBegin(); object != index.objects.constEnd(); ++object) {
+            out << object.key() << quint32(object.value().size());
+            for (const QString &path : object.value()) {
+                archiveEntry e = index.items.value(path);
+                out << path << e.index << e.size << e.packSize << e.crc << e.isDir << index.aliases.value(path);
             }
-            editor.applyChanges();
         }
-        m = "Successfully removed file(s) from archive [" + archivePath + "]";
+
+        if (!f.commit()) {
+            m = QString("Unable to write sidecar index [%1]. Error [%2]").arg(indexPath).arg(f.errorString());
+            return false;
+        }
+
+        m = QString("Wrote sidecar index [%1] with [%2] entries in [%3] objects").arg(indexPath).arg(index.items.size()).arg(index.objects.size());
         return true;
     }
     catch ( const bit7z::BitException& ex ) {
-        /* Do something with ex.what()...*/
-        m = "Unable to remove files from archive using bit7z library [" + QString(ex.what()) + "]";
+        ignoreArchiveIndexFile = ignore;
+        m = "Unable to index archive using bit7z library [" + QString(ex.what()) + "]";
+        return false;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadArchiveIndexFile --------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read the binary sidecar index for a package
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @param index the index of the archive, as recorded in the sidecar
+ * @param m output message
+ * @return true if the sidecar exists and matches the package, false otherwise
+ *
+ * The archive itself is not opened. Packages written by older versions of
+ * squirrel have no sidecar, or an older format, and a sidecar is ignored if
+ * the package was changed after it was written. In any of these cases the
+ * caller falls back to reading the archive directly.
+ */
+bool squirrel::ReadArchiveIndexFile(QString archivePath, archiveIndex &index, QString &m) {
+    QString indexPath = ArchiveIndexFilePath(archivePath);
+    index = archiveIndex();
+
+    if (ignoreArchiveIndexFile) {
+        m = QString("Ignoring sidecar index [%1]").arg(indexPath);
+        return false;
+    }
+
+    QFile f(indexPath);
+    if (!f.open(QIODevice::ReadOnly)) {
+        m = QString("No sidecar index found [%1]").arg(indexPath);
+        return false;
+    }
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_6_0);
+    quint32 magic, version;
+    in >> magic >> version;
+    if ((magic != 0x53514958) || (version != 2)) {
+        m = QString("Sidecar index [%1] is not a recognized format").arg(indexPath);
+        return false;
+    }
+
+    QFileInfo fi(archivePath);
+    in >> index.archiveSize >> index.archiveModified >> index.jsonHash;
+    if ((index.archiveSize != fi.size()) || (index.archiveModified != fi.lastModified().toMSecsSinceEpoch())) {
+        m = QString("Sidecar index [%1] is out of date with the package").arg(indexPath);
+        index = archiveIndex();
+        return false;
+    }
+
+    quint32 numObjects;
+    in >> numObjects;
+    for (quint32 i=0; (i<numObjects) && (in.status() == QDataStream::Ok); i++) {
+        QString objectPath;
+        quint32 numItems;
+        in >> objectPath >> numItems;
+        QStringList &paths = index.objects[objectPath];
+        for (quint32 j=0; (j<numItems) && (in.status() == QDataStream::Ok); j++) {
+            QString path, aliasOf;
+            archiveEntry entry;
+            in >> path >> entry.index >> entry.size >> entry.packSize >> entry.crc >> entry.isDir >> aliasOf;
+            index.items.insert(path, entry);
+            if (!aliasOf.isEmpty())
+                index.aliases.insert(path, aliasOf);
+            paths.append(path);
+        }
+    }
+
+    if (in.status() != QDataStream::Ok) {
+        m = QString("Sidecar index [%1] is truncated or corrupt").arg(indexPath);
+        index = archiveIndex();
         return false;
     }
+
+    m = QString("Read sidecar index [%1] with [%2] entries in [%3] objects").arg(indexPath).arg(index.items.size()).arg(index.objects.size());
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ClearArchiveIndex ------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Release the memory held by the archive index
+ */
+void squirrel::ClearArchiveIndex() {
+    archiveSeriesFiles.clear();
+    archiveParams.clear();
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- UpdateMemoryFileToArchive ---------------------------- */
+/* ----- ArchiveLibrary --------------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Update a single file, from memory, into an existing archive
- * @param file File contents as a QString
- * @param compressedFilePath File path within the archive
- * @param archivePath Path to the archive
- * @param m Any messages generated during the operation
- * @return true if successful, false otherwise
+ * @brief Get the 7-zip library, loading it on first use
+ * @return the library, which stays loaded for the lifetime of this object
  */
-bool squirrel::UpdateMemoryFileToArchive(QString file, QString compressedFilePath, QString archivePath, QString &m) {
-    try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
-        /* convert the QString to a istream */
-        std::istringstream i(file.toStdString());
-
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-            editor.setUpdateMode(UpdateMode::Update);
-            editor.setProgressCallback(progressCallback);
-            editor.setTotalCallback(totalArchiveSizeCallback);
-            editor.updateItem(compressedFilePath.toStdString(), i);
-            editor.applyChanges();
-        }
-        else {
-            bit7z::BitArchiveEditor editor(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
-            editor.setUpdateMode(UpdateMode::Update);
-            editor.setSolidMode(false);
-            editor.setProgressCallback(progressCallback);
-            editor.setTotalCallback(totalArchiveSizeCallback);
-            editor.updateItem(compressedFilePath.toStdString(), i);
-            editor.applyChanges();
-        }
-        m = "Successfully compressed memory file to archive [" + archivePath + "]";
-        return true;
-    }
-    catch ( const bit7z::BitException& ex ) {
-        /* Do something with ex.what()...*/
-        m = "Unable to compress directory into archive using bit7z library [" + QString(ex.what()) + "]";
-        return false;
+bit7z::Bit7zLibrary &squirrel::ArchiveLibrary() {
+    if (!archiveLib) {
+        archiveLib = std::make_unique<bit7z::Bit7zLibrary>(p7zipLibPath.toStdString());
+        Debug(QString("Loaded 7-zip library [%1]").arg(p7zipLibPath), __FUNCTION__);
     }
+
+    return *archiveLib;
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- ExtractArchiveToDirectory ---------------------------- */
+/* ----- ArchiveReader ---------------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Extract an entire archive to a specified directory
- * @param archivePath Path to the archive
- * @return true if successful, false otherwise
+ * @brief Get a reader for an archive, reusing the open reader when possible
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @return the open reader
+ *
+ * The reader is reopened if a different archive is requested, or if the
+ * archive's size or modification time changed since it was opened. Opening a
+ * reader parses the archive's whole item list, so lookups go through
+ * ArchiveIndex(), and the reader is only requested to extract. Any function
+ * that changes the archive calls CloseArchiveReader() first.
+ * Throws bit7z::BitException if the archive can't be opened.
  */
-bool squirrel::ExtractArchiveToDirectory(QString archivePath, QString destinationPath, QString &m) {
+bit7z::BitArchiveReader &squirrel::ArchiveReader(QString archivePath) {
+    QFileInfo fi(archivePath);
+    if (archiveReader && (archiveReaderPath == archivePath) && (archiveReaderSize == fi.size()) && (archiveReaderModified == fi.lastModified()))
+        return *archiveReader;
+
+    archiveReader.reset();
+    archiveReader = std::make_unique<bit7z::BitArchiveReader>(ArchiveLibrary(), archivePath.toStdString(), ArchiveFormat(archivePath));
+    archiveOpenCount++;
+    archiveReaderPath = archivePath;
+    archiveReaderSize = fi.size();
+    archiveReaderModified = fi.lastModified();
+    Debug(QString("Opened archive reader on [%1]. Archive contains [%2] items").arg(archivePath).arg(archiveReader->itemsCount()), __FUNCTION__);
+
+    return *archiveReader;
+}
 
-    QString systemstring = QString("7za x -y %1 -o%2").arg(archivePath).arg(destinationPath);
-    m += systemstring + "\n";
-    Log(QString("Extracting %1 to %2").arg(archivePath).arg(destinationPath));
-    Log(utils::SystemCommand(systemstring));
-    if (utils::FileExists(destinationPath)) {
-        m += destinationPath + " exists\n";
-        return true;
-    }
-    else {
-        m += destinationPath + " does not exist\n";
-        return false;
+
+/* ------------------------------------------------------------ */
+/* ----- ArchiveIndex ----------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the index of an archive: every entry by path and by object, and its aliases
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @return the index, which stays valid until CloseArchiveReader()
+ *
+ * Loaded on first use from the archive's .sqidx sidecar if it is current,
+ * without opening the archive. Otherwise built from one pass over the
+ * archive. The index is rebuilt if the archive's size or modification time
+ * changes. Throws bit7z::BitException if the archive must be opened and can't be.
+ */
+const archiveIndex &squirrel::ArchiveIndex(QString archivePath) {
+    QFileInfo fi(archivePath);
+    auto cached = archiveIndexes.find(archivePath);
+    if ((cached != archiveIndexes.end()) && (cached.value().archiveSize == fi.size()) && (cached.value().archiveModified == fi.lastModified().toMSecsSinceEpoch()))
+        return cached.value();
+
+    archiveIndex &index = archiveIndexes[archivePath];
+    QString m;
+    if (ReadArchiveIndexFile(archivePath, index, m)) {
+        Debug(m, __FUNCTION__);
+        return index;
+    }
+    Debug(m, __FUNCTION__);
+
+    /* the size stays -1 until the index is complete, so an exception leaves it to be rebuilt */
+    const bit7z::BitArchiveReader &reader = ArchiveReader(archivePath);
+    index.items.reserve(static_cast<int>(reader.itemsCount()));
+    for (const auto& item : reader) {
+        archiveEntry entry;
+        entry.index = item.index();
+        entry.size = static_cast<qint64>(item.size());
+        entry.packSize = static_cast<qint64>(item.packSize());
+        entry.crc = item.crc();
+        entry.isDir = item.isDir();
+        index.items.insert(QDir::fromNativeSeparators(QString::fromStdString(item.path())), entry);
+    }
+
+    /* each alias of a deduplicated file gets the entry of the stored file. A file stored under the
+       alias's own path, added by a later update, takes precedence */
+    auto aliasFile = index.items.constFind("aliases.json");
+    if ((aliasFile != index.items.constEnd()) && !aliasFile.value().isDir) {
+        std::vector<unsigned char> buffer;
+        reader.extractTo(buffer, aliasFile.value().index);
+        bytesDecompressedCount += static_cast<qint64>(buffer.size());
+        QJsonObject aliases = QJsonDocument::fromJson(QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<int>(buffer.size()))).object();
+        for (auto it = aliases.constBegin(); it != aliases.constEnd(); ++it) {
+            QString target = it.value().toString();
+            if (!index.items.contains(it.key()) && index.items.contains(target))
+                index.aliases.insert(it.key(), target);
+        }
+        for (auto it = index.aliases.constBegin(); it != index.aliases.constEnd(); ++it)
+            index.items.insert(it.key(), index.items.value(it.value()));
+        Debug(QString("Resolved [%1] aliases").arg(index.aliases.size()), __FUNCTION__);
     }
 
-    // try {
-    //     using namespace bit7z;
-    //     Bit7zLibrary lib(p7zipLibPath.toStdString());
+    IndexArchiveObjects(index);
+    index.archiveSize = fi.size();
+    index.archiveModified = fi.lastModified().toMSecsSinceEpoch();
+    Debug(QString("Indexed [%1] entries in [%2] objects in archive [%3]").arg(index.items.size()).arg(index.objects.size()).arg(archivePath), __FUNCTION__);
 
-    //     if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-    //         //bit7z::BitArchiveReader archive(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-    //         //archive.setProgressCallback(progressCallback);
-    //         //archive.setTotalCallback(totalArchiveSizeCallback);
-    //         //archive.extractTo(destinationPath.toStdString());
+    return index;
+}
 
-    //         bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::Zip);
-    //         extractor.setProgressCallback(progressCallback);
-    //         extractor.setTotalCallback(totalArchiveSizeCallback);
-    //         extractor.extract(archivePath.toStdString(), destinationPath.toStdString());
-    //     }
-    //     else {
-    //         //bit7z::BitArchiveReader archive(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-    //         //archive.setProgressCallback(progressCallback);
-    //         //archive.setTotalCallback(totalArchiveSizeCallback);
-    //         //archive.extractTo(destinationPath.toStdString());
 
-    //         bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
-    //         extractor.setProgressCallback(progressCallback);
-    //         extractor.setTotalCallback(totalArchiveSizeCallback);
-    //         extractor.extract(archivePath.toStdString(), destinationPath.toStdString());
-    //    }
-    //    m = "Successfully extracted archive [" + archivePath + "] to directory [" + destinationPath + "]";
-    //    return true;
-    //}
-    //catch ( const bit7z::BitException& ex ) {
-    //    /* Do something with ex.what()...*/
-    //    m = "Unable to extract archive to directory using bit7z library [" + QString(ex.what()) + "]";
-    //    return false;
-    //}
+/* ------------------------------------------------------------ */
+/* ----- ArchiveItems ----------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the item index, sizes, and CRC of every entry in an archive, keyed by path
+ * @param archivePath path to the archive file (.zip or .7z)
+ * @return archive path -> entry, from ArchiveIndex()
+ */
+const QHash<QString, archiveEntry> &squirrel::ArchiveItems(QString archivePath) {
+    return ArchiveIndex(archivePath).items;
 }
 
 
 /* ------------------------------------------------------------ */
-/* ----- GetArchiveFileListing -------------------------------- */
+/* ----- FindArchiveItem -------------------------------------- */
 /* ------------------------------------------------------------ */
 /**
- * @brief Get a list of files within an archive that are under a given sub-directory
+ * @brief Find the item index of a file within an archive
  * @param archivePath path to the archive file (.zip or .7z)
- * @param subDir path prefix to filter archive entries
- * @param files output list of matching archive entry paths
- * @param m output message on failure
- * @return true if successful
+ * @param filePath exact path of the file within the archive
+ * @param index the item index, if found
+ * @return true if the file was found, false otherwise
  */
-bool squirrel::GetArchiveFileListing(QString archivePath, QString subDir, QStringList &files, QString &m) {
-    try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
+bool squirrel::FindArchiveItem(QString archivePath, QString filePath, quint32 &index) {
+    const QHash<QString, archiveEntry> &items = ArchiveItems(archivePath);
 
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            BitArchiveReader reader(lib, archivePath.toStdString(), bit7z::BitFormat::Zip);
-            for (const auto& item : reader) {
-                QString archivedPath = QString::fromStdString(item.path());
-                if (archivedPath.startsWith(subDir)) {
-                    files.append(QString::fromStdString(item.path()));
-                }
-            }
-        }
-        else {
-            /* first, get the index of the directory to remove */
-            BitArchiveReader reader(lib, archivePath.toStdString(), bit7z::BitFormat::SevenZip);
-            for (const auto& item : reader) {
-                QString archivedPath = QString::fromStdString(item.path());
-                if (archivedPath.startsWith(subDir)) {
-                    files.append(QString::fromStdString(item.path()));
-                }
-            }
-        }
-        return true;
-    }
-    catch ( const bit7z::BitException& ex ) {
-        /* Do something with ex.what()...*/
-        m = "Unable to get subdirectory listing using bit7z library [" + QString(ex.what()) + "]";
+    auto it = items.constFind(QDir::fromNativeSeparators(filePath));
+    if (it == items.constEnd())
         return false;
-    }
+
+    index = it.value().index;
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- CloseArchiveReader ----------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Close the open archive reader, if any, and drop the archive indexes. The next read reopens the archive
+ */
+void squirrel::CloseArchiveReader() {
+    archiveReader.reset();
+    archiveReaderPath = "";
+    archiveReaderSize = -1;
+    archiveReaderModified = QDateTime();
+    archiveIndexes.clear();
 }
 
 
@@ -3669,6 +5962,7 @@ void squirrel::SetOverwritePackage(bool o) {
  */
 void squirrel::SetQuickRead(bool q) {
     quickRead = q;
+    readMode = q ? ReadMode::Quick : ReadMode::Full;
 
     if (quickRead)
         Log("QuickRead set to ON (params.json files will NOT be read)");
@@ -3677,6 +5971,69 @@ void squirrel::SetQuickRead(bool q) {
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- SetCacheDir ------------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set the directory of the on-disk metadata cache
+ * @param dir cache directory, or an empty string to turn caching off (the default)
+ *
+ * With a cache directory set, Read() saves the database it builds to the
+ * cache, and a later Read() of the same, unchanged, package loads that
+ * database instead of parsing the package again.
+ */
+void squirrel::SetCacheDir(QString dir) {
+    cacheDir = dir;
+
+    if (cacheDir.isEmpty())
+        Log("Metadata cache is OFF");
+    else
+        Log(QString("Metadata cache directory set to [%1]").arg(cacheDir));
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SetCompressionProfile -------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set the compression method, level, threads, and dictionary size used when writing the package,
+ * and whether files that are already compressed are stored instead of compressed again
+ * @param profile the compression profile
+ * @param m message describing the invalid value, if any
+ * @return true if the profile is valid and was set, false otherwise
+ */
+bool squirrel::SetCompressionProfile(compressionProfile profile, QString &m) {
+    if (!ValidateCompressionProfile(profile, m))
+        return false;
+
+    compression = profile;
+    Log(QString("Compression set to method [%1] level [%2] threads [%3] dictionary [%4 MB]. Already-compressed files are %5").arg(compression.method).arg(compression.level).arg(compression.threads).arg(compression.dictionarySize).arg(compression.storeCompressed ? "stored when they are most of a pass" : "recompressed"));
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SetReadMode ------------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set how much of the package Read() loads
+ * @param m `Full` to read every object and the params.json files, `Quick` to skip the params.json
+ * files, or `Lazy` to read only the package and subjects, and read each subject's child objects
+ * (including params.json and file listings) the first time they are requested
+ */
+void squirrel::SetReadMode(ReadMode m) {
+    readMode = m;
+    quickRead = (readMode == ReadMode::Quick);
+
+    if (readMode == ReadMode::Full)
+        Log("ReadMode set to Full (all objects and params.json files will be read)");
+    else if (readMode == ReadMode::Quick)
+        Log("ReadMode set to Quick (params.json files will NOT be read)");
+    else
+        Log("ReadMode set to Lazy (subjects' child objects will be read on first access)");
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- SetSystemTempDir ------------------------------------- */
 /* ------------------------------------------------------------ */
@@ -3722,6 +6079,22 @@ QString squirrel::GetSystemTempDir() {
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- GetWriteThreads -------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the number of series Write() stages concurrently
+ * @return the number set with SetWriteThreads(), or the number of cores if not set
+ */
+int squirrel::GetWriteThreads() {
+
+    if (writeThreads > 0)
+        return writeThreads;
+    else
+        return QThread::idealThreadCount();
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- GetJsonHeader ---------------------------------------- */
 /* ------------------------------------------------------------ */
@@ -3757,10 +6130,22 @@ bool squirrel::GetJsonHeader(QJsonDocument &jdoc) {
  */
 bool squirrel::UpdateJsonHeader(QString json) {
     QString m;
-    if (!UpdateMemoryFileToArchive(json, "squirrel.json", GetPackagePath(), m))
-        Log("Error [" + m + "] compressing memory file to archive");
 
-    return true;
+    QString td;
+    if (!MakeTempDir(td)) {
+        Log("Error creating temporary directory for the package header");
+        return false;
+    }
+    bool ok = utils::WriteTextFile(td + "/squirrel.json", json, false);
+    if (!ok)
+        Log("Error writing package header to [" + td + "]");
+    else if ((ok = UpdatePackageHeader(td + "/squirrel.json", m)))
+        Log(m);
+    else
+        Log("Error [" + m + "] updating the package header");
+    DeleteTempDir(td);
+
+    return ok;
 }
 
 
@@ -3777,23 +6162,57 @@ bool squirrel::UpdateJsonHeader(QString json) {
  */
 bool squirrel::ExtractArchiveFilesToDirectory(QString archivePath, QString filePattern, QString outDir, QString &m) {
     utils::Print(QString("Attempting to extract files [%1] from archive [%2] to path [%3]").arg(filePattern).arg(archivePath).arg(outDir));
+    phaseTimer t(ExtractionPhase);
     try {
-        using namespace bit7z;
-        Bit7zLibrary lib(p7zipLibPath.toStdString());
-        if (archivePath.endsWith(".zip", Qt::CaseInsensitive)) {
-            BitFileExtractor extractor(lib, BitFormat::Zip);
-            //extractor.setProgressCallback(progressCallback);
-            //extractor.setTotalCallback(totalArchiveSizeCallback);
-            Debug(QString("Attempting to extract files [%1] from archive [%2] to path [%3]").arg(filePattern).arg(archivePath).arg(outDir));
-            extractor.extractMatching(archivePath.toStdString(), filePattern.toStdString(), outDir.toStdString());
+        /* the package, then its appended segments, so a file in a later segment replaces the earlier version */
+        std::string pattern = QDir::fromNativeSeparators(filePattern).toStdString();
+        qint64 numFiles(0);
+        for (const QString &layer : ArchiveLayers(archivePath)) {
+            /* match against the archive's item list, using the same wildcard rules as BitFileExtractor::extractMatching() */
+            const archiveIndex &index = ArchiveIndex(layer);
+            std::vector<uint32_t> indexes;
+            QList<QPair<QString, quint32>> aliasFiles;
+            qint64 bytes(0);
+            for (auto it = index.items.constBegin(); it != index.items.constEnd(); ++it) {
+                if (bit7z::filesystem::fsutil::wildcard_match(pattern, it.key().toStdString())) {
+                    if (index.aliases.contains(it.key()))
+                        aliasFiles.append(qMakePair(it.key(), it.value().index));
+                    else
+                        indexes.push_back(it.value().index);
+                    bytes += it.value().size;
+                }
+            }
+            std::sort(indexes.begin(), indexes.end());
+            if (indexes.empty() && aliasFiles.isEmpty())
+                continue;
+            const bit7z::BitArchiveReader &reader = ArchiveReader(layer);
+
+            Debug(QString("Extracting [%1] files and [%2] aliases matching [%3] from archive [%4] to path [%5]").arg(indexes.size()).arg(aliasFiles.size()).arg(filePattern).arg(layer).arg(outDir), __FUNCTION__);
+            if (!indexes.empty())
+                reader.extractTo(outDir.toStdString(), indexes);
+
+            /* an alias is extracted from its stored file, to its own path */
+            for (const auto &alias : aliasFiles) {
+                std::vector<unsigned char> buffer;
+                reader.extractTo(buffer, alias.second);
+                QString path = outDir + "/" + alias.first;
+                QString dm;
+                utils::MakePath(QFileInfo(path).absolutePath(), dm);
+                QFile f(path);
+                if (!f.open(QIODevice::WriteOnly) || (f.write(reinterpret_cast<const char*>(buffer.data()), static_cast<qint64>(buffer.size())) != static_cast<qint64>(buffer.size()))) {
+                    m = QString("Unable to write [%1] to [%2]. Error [%3]").arg(alias.first).arg(path).arg(f.errorString());
+                    return false;
+                }
+            }
+            bytesDecompressedCount += bytes;
+            numFiles += static_cast<qint64>(indexes.size()) + aliasFiles.size();
         }
-        else {
-            BitFileExtractor extractor(lib, BitFormat::SevenZip);
-            //extractor.setProgressCallback(progressCallback);
-            //extractor.setTotalCallback(totalArchiveSizeCallback);
-            Debug(QString("Attempting to extract files [%1] from archive [%2] to path [%3]").arg(filePattern).arg(archivePath).arg(outDir));
-            extractor.extractMatching(archivePath.toStdString(), filePattern.toStdString(), outDir.toStdString());
+
+        if (numFiles == 0) {
+            m = QString("No files matching [%1] found in archive [%2]").arg(filePattern).arg(archivePath);
+            return false;
         }
+
         m = QString("Extracted files [%1] from archive [%2] to directory [%3]...").arg(filePattern).arg(archivePath).arg(outDir);
         return true;
     }
@@ -3823,6 +6242,183 @@ qint64 squirrel::GetFreeDiskSpace() {
 }
 
 
+/* ------------------------------------------------------------ */
+/* ----- GetArchiveOpenCount ---------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the number of times an archive has been opened for reading or writing
+ * @return number of archive opens by all squirrel objects in this process
+ *
+ * Each open means 7-zip reads the archive's headers again, so this is a
+ * measure of how well reads and writes are batched.
+ */
+qint64 squirrel::GetArchiveOpenCount() {
+    return archiveOpenCount;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- GetStats --------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the phase timers and I/O counters
+ * @return timers and counters for all squirrel objects in this process, since it started or since the last ResetStats()
+ *
+ * Phase times are summed over every call, including calls on worker threads, so
+ * a phase's wall time can exceed the elapsed time. Phases can nest: jsonParse
+ * includes sqlInsert, and extraction includes the extraction done by headerExtract.
+ */
+squirrelStats squirrel::GetStats() {
+    squirrelStats stats;
+    phaseStats *phases[NumStatsPhases] = { &stats.headerExtract, &stats.jsonParse, &stats.sqlInsert, &stats.staging, &stats.conversion, &stats.compression, &stats.extraction };
+    for (int i=0; i<NumStatsPhases; i++) {
+        phases[i]->wallSec = static_cast<double>(phaseCounters[i].wallNs)/1.0e9;
+        phases[i]->cpuSec = static_cast<double>(phaseCounters[i].cpuNs)/1.0e9;
+        phases[i]->calls = phaseCounters[i].calls;
+    }
+    stats.archiveOpens = archiveOpenCount;
+    stats.bytesCompressed = bytesCompressedCount;
+    stats.bytesDecompressed = bytesDecompressedCount;
+    stats.filesCopied = filesCopiedCount;
+    stats.sqlStatements = utils::GetSQLQueryCount() - sqlStatementBase;
+    stats.peakMemory = utils::GetPeakMemoryBytes();
+
+    return stats;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- GetStatsJSON ----------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Get the phase timers and I/O counters as JSON. See GetStats()
+ * @return JSON object, with one object per phase in "phases"
+ */
+QJsonObject squirrel::GetStatsJSON() {
+    squirrelStats stats = GetStats();
+
+    auto phaseJSON = [](const phaseStats &p) {
+        QJsonObject o;
+        o["wallSec"] = p.wallSec;
+        o["cpuSec"] = p.cpuSec;
+        o["calls"] = p.calls;
+        return o;
+    };
+
+    QJsonObject phases;
+    phases["headerExtract"] = phaseJSON(stats.headerExtract);
+    phases["jsonParse"] = phaseJSON(stats.jsonParse);
+    phases["sqlInsert"] = phaseJSON(stats.sqlInsert);
+    phases["staging"] = phaseJSON(stats.staging);
+    phases["conversion"] = phaseJSON(stats.conversion);
+    phases["compression"] = phaseJSON(stats.compression);
+    phases["extraction"] = phaseJSON(stats.extraction);
+
+    QJsonObject json;
+    json["phases"] = phases;
+    json["archiveOpens"] = stats.archiveOpens;
+    json["bytesCompressed"] = stats.bytesCompressed;
+    json["bytesDecompressed"] = stats.bytesDecompressed;
+    json["filesCopied"] = stats.filesCopied;
+    json["sqlStatements"] = stats.sqlStatements;
+    json["peakMemory"] = stats.peakMemory;
+
+    return json;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ResetStats ------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Reset the phase timers and I/O counters to zero. Peak memory is a process high-water mark, and is not reset
+ */
+void squirrel::ResetStats() {
+    for (int i=0; i<NumStatsPhases; i++) {
+        phaseCounters[i].wallNs = 0;
+        phaseCounters[i].cpuNs = 0;
+        phaseCounters[i].calls = 0;
+    }
+    archiveOpenCount = 0;
+    bytesCompressedCount = 0;
+    bytesDecompressedCount = 0;
+    filesCopiedCount = 0;
+    sqlStatementBase = utils::GetSQLQueryCount();
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ValidateCompressionProfile --------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Check the values of a compression profile
+ * @param profile the compression profile
+ * @param m message describing the invalid value
+ * @return true if valid, false otherwise
+ */
+bool squirrel::ValidateCompressionProfile(compressionProfile profile, QString &m) {
+    if ((profile.method != "lzma2") && (profile.method != "deflate") && (profile.method != "store")) {
+        m = QString("Invalid compression method [%1]. Valid methods: lzma2, deflate, store").arg(profile.method);
+        return false;
+    }
+    if ((profile.level < 0) || (profile.level > 9)) {
+        m = QString("Invalid compression level [%1]. Valid levels: 0 to 9").arg(profile.level);
+        return false;
+    }
+    if (profile.threads < 0) {
+        m = QString("Invalid number of compression threads [%1]").arg(profile.threads);
+        return false;
+    }
+    if ((profile.dictionarySize < 0) || (profile.dictionarySize > 1536)) {
+        m = QString("Invalid dictionary size [%1] MB. Valid sizes: 1 to 1536 MB, or 0 for the default").arg(profile.dictionarySize);
+        return false;
+    }
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SetDefaultCompressionProfile ------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set the compression profile given to squirrel objects created after this call
+ * @param profile the compression profile
+ * @param m message describing the invalid value, if any
+ * @return true if the profile is valid and was set, false otherwise
+ */
+bool squirrel::SetDefaultCompressionProfile(compressionProfile profile, QString &m) {
+    if (!ValidateCompressionProfile(profile, m))
+        return false;
+
+    defaultCompressionProfile = profile;
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SetDefaultAppendUpdates ------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set the append mode given to squirrel objects created after this call
+ * @param a true to append updates to existing packages as segments, instead of rewriting the archive
+ */
+void squirrel::SetDefaultAppendUpdates(bool a) {
+    defaultAppendUpdates = a;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SetDefaultDeduplicate -------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Set the deduplication given to squirrel objects created after this call
+ * @param d true to store files with identical contents once in new packages
+ */
+void squirrel::SetDefaultDeduplicate(bool d) {
+    defaultDeduplicate = d;
+}
+
+
 /* ------------------------------------------------------------ */
 /* ----- ObjectTypeToString ----------------------------------- */
 /* ------------------------------------------------------------ */
@@ -30,6 +30,9 @@
 #include <QDebug>
 #include <QtSql>
 #include <QUuid>
+#include <QMutex>
+#include <functional>
+#include <memory>
 #include <sstream>
 #include "squirrelSubject.h"
 #include "squirrelStudy.h"
@@ -42,6 +45,10 @@
 #include "squirrelDataDictionary.h"
 #include "squirrelTypes.h"
 
+namespace bit7z { class Bit7zLibrary; class BitArchiveReader; }
+struct subjectRecord;
+struct readQueries;
+struct seriesStagingRecord;
 
 /**
  * @brief The squirrel class
@@ -56,29 +63,42 @@ public:
     ~squirrel();
 
     /* user-facing package operations */
+    bool Compact(QString &m);
     QString Print(bool detail=false);
     bool Extract(QString destinationDir, QString &m);
     bool Read();
     bool Validate();
     bool Write();
-    bool WriteUpdate();
+    bool WriteUpdate(bool dropOldHeaders = false);
     bool ExtractArchiveFilesToDirectory(QString archivePath, QString filePattern, QString outDir, QString &m);
 
     /* get/set options */
+    bool GetAppendUpdates() { return appendUpdates; } /*!< true if file updates to an existing package are appended as a new segment. Header-only updates always are */
+    QString GetCacheDir() { return cacheDir; } /*!< get the metadata cache directory. Empty if caching is off */
     QString GetDatabaseUUID() { return databaseUUID; } /*!< get the database UUID */
+    bool GetDeduplicate() { return deduplicate; } /*!< true if files with identical contents are stored once in a new package */
     QString GetPackagePath();
     QString GetSystemTempDir();
+    int GetWriteThreads();
     bool GetDebug() { return debug; } /*!< true if debugging is enabled */
     bool GetDebugSQL() { return debugSQL; } /*!< true if SQL debugging is enabled */
+    ReadMode GetReadMode() { return readMode; } /*!< get the read mode */
+    compressionProfile GetCompressionProfile() { return compression; } /*!< get the compression profile used when writing */
+    void SetAppendUpdates(bool a) { appendUpdates = a; } /*!< Set true to append file updates to an existing package as a new segment, instead of rewriting the archive. Header-only updates always use a header segment */
+    void SetCacheDir(QString dir);
     void SetCommandLineExecution(bool c) { cmdLineExec = c; }
+    bool SetCompressionProfile(compressionProfile profile, QString &m);
     void SetDebug(bool d);
     void SetDebugSQL(bool d);
+    void SetDeduplicate(bool d) { deduplicate = d; } /*!< Set true to store files with identical contents once in a new package, and record the other paths as aliases */
     void SetFileMode(FileMode m) { fileMode = m; } /*!< Set the file mode to either NewPackage or ExistingPackage */
     void SetOverwritePackage(bool o);
     void SetPackagePath(QString p) { packagePath = p; } /*!< Set the package path */
     void SetQuickRead(bool q);
+    void SetReadMode(ReadMode m);
     void SetSystemTempDir(QString tmpdir);
     void SetWriteLog(bool w) { writeLog = w; }
+    void SetWriteThreads(int n) { writeThreads = n; } /*!< Set the number of series Write() stages concurrently. 0 uses one per core */
 
     /* package JSON elements */
     QDateTime Datetime;         /*!< datetime the package was created */
@@ -193,18 +213,31 @@ public:
     /* static functions */
     static QString ObjectTypeToString(ObjectType object);
     static ObjectType ObjectTypeToEnum(QString object);
+    static qint64 GetArchiveOpenCount();
+    static squirrelStats GetStats();
+    static QJsonObject GetStatsJSON();
+    static void ResetStats();
+    static void SetDefaultAppendUpdates(bool a);
+    static bool SetDefaultCompressionProfile(compressionProfile profile, QString &m);
+    static void SetDefaultDeduplicate(bool d);
+    static bool ValidateCompressionProfile(compressionProfile profile, QString &m);
 
 private:
     void ResequenceTable(QString table, QString pkCol, QString parentCol, qint64 parentRowID, QString orderBy);
 
     bool DatabaseConnect();
+    QString DatabaseCachePath();
+    bool ReadDatabaseCache(const QByteArray &jsonHash, QString &m);
+    bool WriteDatabaseCache(const QByteArray &jsonHash, QString &m);
     bool DeleteTempDir(QString dir);
     bool InitializeDatabase();
     bool MakeTempDir(QString &dir);
+    QString WriteWorkingDirPath();
 
     /* 7zip archive functions */
     bool AddFilesToArchive(QStringList filePaths, QStringList compressedFilePaths, QString archivePath, QString &m);
     bool CompressDirectoryToArchive(QString dir, QString archivePath, QString &m);
+    bool CompressFilesToArchive(QStringList filePaths, QStringList compressedFilePaths, const QMap<QString, QByteArray> &memoryFiles, QString archivePath, QString &m);
     bool ExtractArchiveToDirectory(QString archivePath, QString destinationPath, QString &m);
     bool ExtractArchiveFileToMemory(QString archivePath, QString filePath, QByteArray &fileContents);
     bool ExtractArchiveFileToMemory(QString archivePath, QString filePath, QString &fileContents);
@@ -213,8 +246,66 @@ private:
     bool RemoveDirectoryFromArchive(QString compressedDirPath, QString archivePath, QString &m);
     bool UpdateMemoryFileToArchive(QString file, QString compressedFilePath, QString archivePath, QString &m);
 
+    /* appended segments (<package>.seg1.7z, ...). A file in a segment replaces the same file in the package and in earlier segments */
+    bool AppendSegmentToArchive(QStringList filePaths, QStringList compressedFilePaths, QString archivePath, QString &m);
+    bool CompactArchive(QString archivePath, QString &m, QStringList filePaths = QStringList(), QStringList compressedFilePaths = QStringList());
+    bool UpdatePackageFiles(QStringList filePaths, QStringList compressedFilePaths, QString &m);
+    bool UpdatePackageHeader(QString jsonPath, QString &m, bool dropOldHeaders = false);
+    bool DropOldHeaders(QString archivePath, QString &m);
+
+    /* aliases (aliases.json). A deduplicated package stores identical files once, and records each other path as an alias of the stored file. Each layer of a package has its own aliases.json, and an alias only refers to a file in its own layer */
+    bool DetachAliases(QString archivePath, std::function<bool(const QString&)> dropped, QString tmpDir, QStringList &filePaths, QStringList &compressedFilePaths, QString &m);
+    bool MaterializeAliases(const QHash<QString, QString> &aliases, QString dir, QString &m);
+
+    /* archive session. The 7-zip library is loaded once, and a reader is kept open on the package
+       until the package is changed on disk */
+    bit7z::Bit7zLibrary &ArchiveLibrary();
+    bit7z::BitArchiveReader &ArchiveReader(QString archivePath);
+    const archiveIndex &ArchiveIndex(QString archivePath);
+    const QHash<QString, archiveEntry> &ArchiveItems(QString archivePath);
+    bool FindArchiveItem(QString archivePath, QString filePath, quint32 &index);
+    void CloseArchiveReader();
+    std::unique_ptr<bit7z::Bit7zLibrary> archiveLib;
+    std::unique_ptr<bit7z::BitArchiveReader> archiveReader; /* declared after archiveLib, so it is destroyed first */
+    QString archiveReaderPath;          /* path of the archive the reader has open */
+    QDateTime archiveReaderModified;    /* modification time of the archive when the reader was opened */
+    qint64 archiveReaderSize = -1;      /* size of the archive when the reader was opened */
+    QMap<QString, archiveIndex> archiveIndexes;     /* archive path -> index of the package and of each segment, built on first lookup. A QMap, so references stay valid as archives are added */
+
+    /* archive index, built in a single pass over the archive */
+    bool BuildArchiveIndex(QString archivePath, QString &m, QString dataPath = "");
+    void ClearArchiveIndex();
+    QHash<QString, QStringList> archiveSeriesFiles; /* series path (data/subject/study/series) -> files within that series */
+    QHash<QString, QByteArray> archiveParams;       /* series path -> contents of the series params.json */
+
+    /* binary sidecar index (<package>.sqidx), written with the package so it can be opened without walking the archive */
+    static QString ArchiveIndexFilePath(QString archivePath);
+    bool ReadArchiveIndexFile(QString archivePath, archiveIndex &index, QString &m);
+    bool WriteArchiveIndexFile(QString archivePath, QString &m);
+    bool ignoreArchiveIndexFile = false;            /* set if the sidecar index was found not to match the package */
+
+    /* subject decoding, shared by Read() and the lazy read mode */
+    subjectRecord DecodeSubject(const QByteArray &subjectJson, bool subjectOnly=false);
+    void StoreSubjectRecord(subjectRecord &rec, readQueries &queries, qint64 subjectRowID=-1);
+
+    /* series staging, run on the Write() staging workers */
+    seriesStagingRecord StageSeries(QString seriesArchivePath, QStringList stagedFiles, QString subjectID, int studyNumber, int seriesNumber, QString modality, QString bindir, QByteArray resumeChecksum);
+
+    /* package header, streamed from the database */
+    bool WriteJsonHeader(QString jsonPath, QString pipelinePath, QString &m);
+
+    /* lazy read mode. Read() stores only the package and subjects, and keeps each subject's JSON until
+       one of its child objects is requested */
+    bool MaterializeSubject(qint64 subjectRowID);
+    bool MaterializeSubject(QString subjectID);
+    bool MaterializeAllSubjects();
+    QHash<qint64, QByteArray> lazySubjects;         /* SubjectRowID -> unparsed subject JSON, for subjects whose children are not yet read */
+    qint64 headerTotalFileCount = 0;                /* TotalFileCount from the package header */
+    qint64 headerTotalSize = 0;                     /* TotalSize from the package header */
+
     QString log;
     QString logBuffer;
+    QMutex logMutex; /* Log() and Debug() are called from the Write() compression thread */
     QString logfile;
     QString p7zipLibPath;
     QString packagePath;
@@ -227,17 +318,23 @@ private:
     /* database */
     QSqlDatabase db;
     QString databaseUUID; /* necessary to create unique DB connections if more than one squirrel package is opened at a time */
+    QString cacheDir; /* directory of the on-disk metadata cache. Empty to disable caching */
+    compressionProfile compression; /* method, level, and threads used when writing the package */
 
     /* flags */
+    bool appendUpdates; /* true to append updates to an existing package as a new segment */
     bool cmdLineExec; /* true if running from command line, false if running from library */
     bool debug;
     bool debugSQL;
+    bool deduplicate; /* true to store files with identical contents once in a new package */
     bool isModified; /* true if any object in the package has been modified */
     bool isOkToDelete;
     bool isValid;
     bool overwritePackage;
     bool quickRead; /* set true to skip reading of the params.json files */
+    ReadMode readMode; /* Full, Quick, or Lazy. Quick is the same as quickRead */
     bool writeLog;
+    int writeThreads = 0; /* number of series staged concurrently by Write(). 0 uses one per core */
 };
 
 #endif // SQUIRREL_H
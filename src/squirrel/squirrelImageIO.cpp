@@ -61,6 +61,12 @@ squirrelImageIO::squirrelImageIO()
 */
 squirrelImageIO::~squirrelImageIO()
 {
+    /* ask the exiftool worker to exit */
+    if (exiftool && (exiftool->state() == QProcess::Running)) {
+        exiftool->write("-stay_open\nFalse\n");
+        if (!exiftool->waitForFinished(5000))
+            exiftool->kill();
+    }
 }
 
 
@@ -71,6 +77,10 @@ squirrelImageIO::~squirrelImageIO()
  * @brief Run exiftool to get DICOM tags. Output should be terminated with {ready}, otherwise it is incomplete
  * @param arg The DICOM (or other type) file
  * @return The full output from exiftool
+ *
+ * The files are passed to one exiftool process per squirrelImageIO, started
+ * with -stay_open, instead of starting a new process for every file. If the
+ * worker doesn't answer, it is killed, and a new one is started for the next file.
  */
 QString squirrelImageIO::Exiftool(QString arg) {
     QString str;
@@ -78,8 +88,29 @@ QString squirrelImageIO::Exiftool(QString arg) {
     QFileInfo fileInfo(arg);
     QString filename = fileInfo.fileName();
 
-    QString systemstring = "exiftool " + arg;
-    str = utils::SystemCommand(systemstring, false);
+    if (!exiftool || (exiftool->state() != QProcess::Running)) {
+        exiftool = std::make_unique<QProcess>();
+        exiftool->setStandardErrorFile(QProcess::nullDevice());
+        exiftool->start("exiftool", QStringList() << "-stay_open" << "True" << "-@" << "-");
+        if (!exiftool->waitForStarted()) {
+            exiftool.reset();
+            return "";
+        }
+    }
+
+    /* one argument per line, then -execute. The output of each file ends with {ready} */
+    exiftool->write(QFile::encodeName(arg) + "\n-execute\n");
+    QByteArray output;
+    while (!output.contains("{ready}")) {
+        if (!exiftool->waitForReadyRead(60000)) {
+            exiftool->kill();
+            exiftool->waitForFinished();
+            exiftool.reset();
+            return "";
+        }
+        output += exiftool->readAllStandardOutput();
+    }
+    str = QString::fromUtf8(output.left(output.indexOf("{ready}")));
 
     /* check if the output is not truncated or cut off */
     if (str.size() < 50) {
@@ -100,6 +131,159 @@ QString squirrelImageIO::Exiftool(QString arg) {
     return str;
 }
 
+
+/* ---------------------------------------------------------- */
+/* --------- SniffFileType ---------------------------------- */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Classify a file by its extension and its first bytes, before any reader parses it
+ * @param f path to the file
+ * @return DICOM if the file has the DICM prefix after the 128 byte preamble.
+ *         EEG, ET, NIFTI, or PARREC if the extension (or the NIfTI or PAR header)
+ *         is one GetImageFileTags() reads without DCMTK. Other if the file is
+ *         recognizably not DICOM (empty, text, or a common image, document,
+ *         or archive format). Empty if the type is unknown, so it can only be
+ *         found by the readers
+ *
+ * The content is checked before the extension. A DICOM file without a preamble
+ * starts with its first element, a little-endian group 0002 (file meta) or
+ * 0008 tag. Such a file is left unclassified, whatever its extension, so
+ * DCMTK gets to read it first and the extension only decides if DCMTK can't.
+ */
+QString squirrelImageIO::SniffFileType(QString f) {
+    if (f == sniffedPath)
+        return sniffedType;
+
+    QByteArray head;
+    QFile file(f);
+    if (file.open(QIODevice::ReadOnly))
+        head = file.read(352);
+    file.close();
+
+    QString type;
+    if ((head.size() >= 132) && (head.mid(128, 4) == "DICM"))
+        type = "DICOM";
+    else if ((head.size() >= 8) && (head.at(1) == 0) && ((head.at(0) == 0x02) || (head.at(0) == 0x08)))
+        type = "";
+    else if ((f.endsWith(".cnt", Qt::CaseInsensitive)) || (f.endsWith(".dat", Qt::CaseInsensitive)) || (f.endsWith(".3dd", Qt::CaseInsensitive)) || (f.endsWith(".eeg", Qt::CaseInsensitive)))
+        type = "EEG";
+    else if (f.endsWith(".edf", Qt::CaseInsensitive))
+        type = "ET";
+    else if ((f.endsWith(".nii", Qt::CaseInsensitive)) || (f.endsWith(".nii.gz", Qt::CaseInsensitive)) || (f.endsWith(".hdr", Qt::CaseInsensitive)) || (f.endsWith(".img", Qt::CaseInsensitive)) || ((head.size() >= 348) && ((head.mid(344, 4) == QByteArray("n+1\0", 4)) || (head.mid(344, 4) == QByteArray("ni1\0", 4)))) || (head.mid(4, 4) == QByteArray("n+2\0", 4)))
+        type = "NIFTI";
+    else if (f.endsWith(".par", Qt::CaseInsensitive) || f.endsWith(".rec", Qt::CaseInsensitive) || head.startsWith("# === DATA DESCRIPTION FILE"))
+        type = "PARREC";
+    else if (head.isEmpty() || head.startsWith("\x89PNG\r\n\x1a\n") || head.startsWith("\xFF\xD8\xFF") || head.startsWith("GIF87a") || head.startsWith("GIF89a") || head.startsWith("%PDF-") || head.startsWith(QByteArray("PK\x03\x04", 4)) || head.startsWith("\x1F\x8B") || head.startsWith("7z\xBC\xAF\x27\x1C") || head.startsWith(QByteArray("II*\0", 4)) || head.startsWith(QByteArray("MM\0*", 4)))
+        type = "Other";
+    else {
+        /* plain text, such as logs, notes, and CSV files */
+        bool text = true;
+        for (char c : head.left(132)) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if ((u < 0x20) && (u != '\t') && (u != '\n') && (u != '\r') && (u != '\f')) {
+                text = false;
+                break;
+            }
+        }
+        if (text)
+            type = "Other";
+    }
+
+    sniffedPath = f;
+    sniffedType = type;
+    return type;
+}
+
+
+/* ---------------------------------------------------------- */
+/* --------- GetDicomGroupingTags --------------------------- */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Read only the tags needed to group a DICOM file into subject, study, and series
+ * @param f path to the file
+ * @param tags FileType, and the PatientID, StudyInstanceUID, and SeriesInstanceUID as GetImageFileTags() returns them
+ * @param wantAllTags optional. Called with the grouping tags. If it returns true, the file's header is loaded
+ *        in full, and tags is replaced by every tag, as GetImageFileTags() returns them
+ * @return true if DCMTK read the file, false otherwise
+ *
+ * The file is only parsed up to the SeriesInstanceUID (0020,000E), the last of
+ * the grouping tags, and the dataset is walked the same way as
+ * GetImageTagsDCMTK(), so the values are the same. The rest of the header,
+ * including the Siemens CSA headers, is only read if all tags are wanted.
+ */
+bool squirrelImageIO::GetDicomGroupingTags(QString f, QHash<QString, QString> &tags, std::function<bool(const QHash<QString, QString> &)> wantAllTags) {
+
+    tags.clear();
+
+    /* files that are recognizably something else are not given to DCMTK */
+    QString sniffed = SniffFileType(f);
+    if ((sniffed != "") && (sniffed != "DICOM"))
+        return false;
+
+    /* parsing stops at the first element past the SeriesInstanceUID */
+    QByteArray filenameBA = f.toLatin1();
+    DcmFileFormat fileformat;
+    OFCondition status = fileformat.loadFileUntilTag(filenameBA.constData(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength, ERM_autoDetect, DcmTagKey(0x0020, 0x000F));
+    if (!status.good())
+        return false;
+
+    tags["FileType"] = "DICOM";
+    tags["PatientID"] = "";
+    tags["StudyInstanceUID"] = "";
+    tags["SeriesInstanceUID"] = "";
+    DcmStack stack;
+    DcmDataset *dataset = fileformat.getDataset();
+    while (dataset->nextObject(stack, OFTrue /*intoSub*/).good()) {
+        DcmObject *object = stack.top();
+        if (!object->isElement())
+            continue;
+
+        const DcmTagKey key = object->getTag();
+        QString name;
+        if (key == DCM_PatientID)
+            name = "PatientID";
+        else if (key == DCM_StudyInstanceUID)
+            name = "StudyInstanceUID";
+        else if (key == DCM_SeriesInstanceUID)
+            name = "SeriesInstanceUID";
+        else
+            continue;
+
+        OFString strValue;
+        DcmElement *element = OFstatic_cast(DcmElement *, object);
+        if (element->getOFStringArray(strValue).good())
+            tags[name] = strValue.c_str();
+        else if (element->isLeaf())
+            tags[name] = "";
+    }
+
+    /* the same default as GetImageFileTags() */
+    if (tags["PatientID"] == "")
+        tags["PatientID"] = "(empty)";
+
+    /* the same tags GetImageFileTags() returns for a DICOM file, from the whole header */
+    if (wantAllTags && wantAllTags(tags)) {
+        DcmFileFormat fullformat;
+        if (!fullformat.loadFileUntilTag(filenameBA.constData(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength, ERM_autoDetect, DcmTagKey(0x7FE0, 0x0010)).good())
+            return false;
+        dataset = fullformat.getDataset();
+
+        QString msg;
+        tags.clear();
+        tags["FileExists"] = "true";
+        tags["Filename"] = f;
+        tags["Modality"] = "Unknown";
+        tags["FilePath"] = f;
+        tags["FileType"] = "DICOM";
+        ReadDatasetTags(dataset, tags);
+        tags["ParseMessages"] = "";
+        FixImageFileTags(f, tags, msg);
+    }
+
+    return true;
+}
+
+
 /* ---------------------------------------------------------- */
 /* --------- GetImageTagsDCMTK ------------------------------ */
 /* ---------------------------------------------------------- */
@@ -123,93 +307,106 @@ bool squirrelImageIO::GetImageTagsDCMTK(QString f, QHash<QString, QString> &tags
     OFCondition status = fileformat.loadFileUntilTag(filename, EXS_Unknown, EGL_noChange, DCM_MaxReadLength, ERM_autoDetect, DcmTagKey(0x7FE0, 0x0010));
     if (status.good()) {
         tags["FileType"] = "DICOM";
-        DcmStack stack;
-        DcmDataset *dataset = fileformat.getDataset();
-        while (dataset->nextObject(stack, OFTrue /*intoSub*/).good())
-        {
-            DcmObject *object = stack.top();
-            QString tagName = DcmTag(object->getTag()).getTagName();
-            if (tagName.startsWith("Unknown")) {
-                int group = DcmTag(object->getTag()).getGroup();
-                int element = DcmTag(object->getTag()).getElement();
-                tagName = QString("Unknown_%1x%2").arg(group, 4, 10, QChar('0')).arg(element, 4, 10, QChar('0'));
-            }
+        ReadDatasetTags(fileformat.getDataset(), tags);
+    }
+    else {
+        tags["Valid"] = "0";
+        tags["ParseMessages"] = msgs.join("\n");
+        return false;
+    }
 
-            if (object->isElement()) {
-                OFString strValue;
-                DcmElement *element = OFstatic_cast(DcmElement *, object);
-                if (element->getOFStringArray(strValue).good()) {
-                    /* read the Siemens binary encoded CSA header */
-                    if ((object->getGTag() == 0x0029) && (object->getETag() == 0x1010)) {
-                        QString hexstr = strValue.c_str();
-                        hexstr.remove('\\');
-                        QByteArray bytes = QByteArray::fromHex(hexstr.toLatin1());
-
-                        QMap<QString, CsaElement> csaTags = ParseSiemensCSA(bytes);
-                        for (auto i = csaTags.cbegin(), end = csaTags.cend(); i != end; ++i) {
-                            CsaElement elem = i.value();
-                            QString name = i.key();
-                            QString vr = i.value().vr;
-                            QString val;
-                            if (elem.values.size() > 0) {
-                                if (vr == "LO" || vr == "SH" || vr == "ST" || vr == "LT" || vr == "AE" || vr == "CS" || vr == "UT" || vr == "DS" || vr == "IS") {
-                                    val = csaToString(elem.values.first());
-                                }
-                                else if (vr == "FD" || vr == "FL") {
-                                    val = QString("%1").arg(csaToDouble(elem.values.first()));
-                                }
-                                else if (vr == "SL" || vr == "UL" || vr == "SS" || vr == "US") {
-                                    val = QString("%1").arg(csaToInteger(elem.values.first()));
-                                }
+    tags["ParseMessages"] = msgs.join("\n");
+
+    return true;
+}
+
+
+/* ---------------------------------------------------------- */
+/* --------- ReadDatasetTags -------------------------------- */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Convert every element of a loaded DICOM dataset, including the Siemens CSA headers, into tags
+ * @param dataset the dataset, loaded by DCMTK
+ * @param tags the tags are added to this list
+ */
+void squirrelImageIO::ReadDatasetTags(DcmDataset *dataset, QHash<QString, QString> &tags) {
+
+    DcmStack stack;
+    while (dataset->nextObject(stack, OFTrue /*intoSub*/).good())
+    {
+        DcmObject *object = stack.top();
+        QString tagName = DcmTag(object->getTag()).getTagName();
+        if (tagName.startsWith("Unknown")) {
+            int group = DcmTag(object->getTag()).getGroup();
+            int element = DcmTag(object->getTag()).getElement();
+            tagName = QString("Unknown_%1x%2").arg(group, 4, 10, QChar('0')).arg(element, 4, 10, QChar('0'));
+        }
+
+        if (object->isElement()) {
+            OFString strValue;
+            DcmElement *element = OFstatic_cast(DcmElement *, object);
+            if (element->getOFStringArray(strValue).good()) {
+                /* read the Siemens binary encoded CSA header */
+                if ((object->getGTag() == 0x0029) && (object->getETag() == 0x1010)) {
+                    QString hexstr = strValue.c_str();
+                    hexstr.remove('\\');
+                    QByteArray bytes = QByteArray::fromHex(hexstr.toLatin1());
+
+                    QMap<QString, CsaElement> csaTags = ParseSiemensCSA(bytes);
+                    for (auto i = csaTags.cbegin(), end = csaTags.cend(); i != end; ++i) {
+                        CsaElement elem = i.value();
+                        QString name = i.key();
+                        QString vr = i.value().vr;
+                        QString val;
+                        if (elem.values.size() > 0) {
+                            if (vr == "LO" || vr == "SH" || vr == "ST" || vr == "LT" || vr == "AE" || vr == "CS" || vr == "UT" || vr == "DS" || vr == "IS") {
+                                val = csaToString(elem.values.first());
+                            }
+                            else if (vr == "FD" || vr == "FL") {
+                                val = QString("%1").arg(csaToDouble(elem.values.first()));
                             }
-                            else {
-                                //printf("Value appears to be empty\n");
+                            else if (vr == "SL" || vr == "UL" || vr == "SS" || vr == "US") {
+                                val = QString("%1").arg(csaToInteger(elem.values.first()));
                             }
-                            val.remove(QChar('\0'));
-                            tags[name] = val.trimmed();
                         }
+                        else {
+                            //printf("Value appears to be empty\n");
+                        }
+                        val.remove(QChar('\0'));
+                        tags[name] = val.trimmed();
                     }
-                    /* read the Siemens MrPhoenixProtocol header */
-                    else if ((object->getGTag() == 0x0029) && (object->getETag() == 0x1020)) {
-                        QString hexstr = strValue.c_str();
-                        hexstr.remove('\\');
-                        QByteArray bytes = QByteArray::fromHex(hexstr.toLatin1());
-                        QString text = QString::fromLatin1(bytes);
-                        QStringList lines = text.split("\n");
-                        foreach (QString line, lines) {
-                            if (line.startsWith("sSliceArray.asSlice[0].dInPlaneRot") && (line.size() < 70)) {
-                                /* make sure the line does not contain any non-printable ASCII control characters */
-                                if (!line.contains(QRegularExpression(QStringLiteral("[\\x00-\\x1F]")))) {
-                                    qint64 idx = line.indexOf(".dInPlaneRot");
-                                    line = line.mid(idx,23);
-                                    QStringList vals = line.split(QRegularExpression("\\s+"));
-                                    if (vals.size() > 0)
-                                        tags["PhaseEncodeAngle"] = vals.last().trimmed();
-                                    break;
-                                }
+                }
+                /* read the Siemens MrPhoenixProtocol header */
+                else if ((object->getGTag() == 0x0029) && (object->getETag() == 0x1020)) {
+                    QString hexstr = strValue.c_str();
+                    hexstr.remove('\\');
+                    QByteArray bytes = QByteArray::fromHex(hexstr.toLatin1());
+                    QString text = QString::fromLatin1(bytes);
+                    QStringList lines = text.split("\n");
+                    foreach (QString line, lines) {
+                        if (line.startsWith("sSliceArray.asSlice[0].dInPlaneRot") && (line.size() < 70)) {
+                            /* make sure the line does not contain any non-printable ASCII control characters */
+                            if (!line.contains(QRegularExpression(QStringLiteral("[\\x00-\\x1F]")))) {
+                                qint64 idx = line.indexOf(".dInPlaneRot");
+                                line = line.mid(idx,23);
+                                QStringList vals = line.split(QRegularExpression("\\s+"));
+                                if (vals.size() > 0)
+                                    tags["PhaseEncodeAngle"] = vals.last().trimmed();
+                                break;
                             }
                         }
                     }
-                    /* read all other tags */
-                    else {
-                        tags[tagName] = strValue.c_str();
-                    }
                 }
-                else if (element->isLeaf()) {
-                    tags[tagName] = "";
+                /* read all other tags */
+                else {
+                    tags[tagName] = strValue.c_str();
                 }
             }
+            else if (element->isLeaf()) {
+                tags[tagName] = "";
+            }
         }
     }
-    else {
-        tags["Valid"] = "0";
-        tags["ParseMessages"] = msgs.join("\n");
-        return false;
-    }
-
-    tags["ParseMessages"] = msgs.join("\n");
-
-    return true;
 }
 
 
@@ -349,8 +546,6 @@ bool squirrelImageIO::ConvertDicom(QString filetype, QString indir, QString outd
 
     QStringList msgs;
 
-    QString pwd = QDir::currentPath();
-
     numfilesconv = 0; /* need to fix this to be correct at some point */
 
     msgs << QString("Converting DICOM to Nifti.  indir [" + indir + "]  outdir [" + outdir + "]  outfiletype [" + filetype + "]");
@@ -382,7 +577,6 @@ bool squirrelImageIO::ConvertDicom(QString filetype, QString indir, QString outd
 #ifdef USE_DCM2NIIX_LIB
     /* ----- in-process conversion using the embedded dcm2niix library ----- */
     Q_UNUSED(bindir);
-    Q_UNUSED(pwd);
     Q_UNUSED(gzip);
 
     /* in case of par/rec, the input to dcm2niix is a file instead of a directory */
@@ -415,8 +609,11 @@ bool squirrelImageIO::ConvertDicom(QString filetype, QString indir, QString outd
     if (datatype == "parrec")
         fileext = "/*.par";
 
+    /* dcm2niix gets absolute paths, so the process-wide working directory is left alone and conversions on other threads run side by side */
+    indir = QDir(indir).absolutePath();
+    outdir = QDir(outdir).absolutePath();
+
     QString systemstring;
-    QDir::setCurrent(indir);
     if (filetype == "nifti4d")
         systemstring = QString("%1/./dcm2niix -1 -b n -o '%2' %3%4").arg(bindir).arg(outdir).arg(indir).arg(fileext);
     else if (filetype == "nifti4dgz")
@@ -433,9 +630,6 @@ bool squirrelImageIO::ConvertDicom(QString filetype, QString indir, QString outd
         systemstring = "cd " + outdir + "; gzip *";
         msgs << utils::SystemCommand(systemstring, true);
     }
-
-    /* change back to original directory before leaving */
-    QDir::setCurrent(pwd);
 #endif
 
     /* rename the files into something meaningful */
@@ -677,7 +871,10 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
     tags["Modality"] = "Unknown";
     tags["FileType"] = "Unknown";
 
-    GetImageTagsDCMTK(f, tags);
+    /* only files that may be DICOM are given to DCMTK */
+    QString sniffed = SniffFileType(f);
+    if ((sniffed == "") || (sniffed == "DICOM"))
+        GetImageTagsDCMTK(f, tags);
 
     if (tags["FileType"] == "DICOM") {
         /* ---------- it's a readable DICOM file ---------- */
@@ -710,7 +907,7 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
                 tags["PatientID"] = "Empty";
         }
         /* check if MR (Non-DICOM) analyze or nifti */
-        else if ((f.endsWith(".nii", Qt::CaseInsensitive)) || (f.endsWith(".nii.gz", Qt::CaseInsensitive)) || (f.endsWith(".hdr", Qt::CaseInsensitive)) || (f.endsWith(".img", Qt::CaseInsensitive))) {
+        else if ((f.endsWith(".nii", Qt::CaseInsensitive)) || (f.endsWith(".nii.gz", Qt::CaseInsensitive)) || (f.endsWith(".hdr", Qt::CaseInsensitive)) || (f.endsWith(".img", Qt::CaseInsensitive)) || (sniffed == "NIFTI")) {
             tags["FileType"] = "NIFTI";
             tags["Modality"] = "NIFTI";
             QFileInfo fn = QFileInfo(f);
@@ -721,7 +918,7 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
                 tags["PatientID"] = "Empty";
         }
         /* check if par/rec */
-        else if (f.endsWith(".par", Qt::CaseInsensitive) || f.endsWith(".rec", Qt::CaseInsensitive)) {
+        else if (f.endsWith(".par", Qt::CaseInsensitive) || f.endsWith(".rec", Qt::CaseInsensitive) || (sniffed == "PARREC")) {
             tags["FileType"] = "PARREC";
             tags["Modality"] = "PARREC";
 
@@ -791,6 +988,10 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
                 inputFile.close();
             }
         }
+        /* text, and common image, document, and archive formats, where exiftool can't find DICOM tags */
+        else if (sniffed == "Other") {
+            return false;
+        }
         else {
             /* unknown modality/filetype... so we'll try one last time to read with EXIF tool */
             QString exifoutput = Exiftool(f);
@@ -812,6 +1013,23 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
         }
     }
 
+    FixImageFileTags(f, tags, msg);
+
+    return true;
+}
+
+
+/* ---------------------------------------------------------- */
+/* --------- FixImageFileTags ------------------------------- */
+/* ---------------------------------------------------------- */
+/**
+ * @brief Fill in the derived tags and fix the formats of the dates, times, and blank fields, so the tags are amenable to the DB
+ * @param f path to the file the tags were read from
+ * @param tags the tags
+ * @param msg messages are appended to this string
+ */
+void squirrelImageIO::FixImageFileTags(QString f, QHash<QString, QString> &tags, QString &msg) {
+
     /* fix some of the fields to be amenable to the DB */
     if (tags["Modality"] == "")
         tags["Modality"] = "OT";
@@ -944,8 +1162,6 @@ bool squirrelImageIO::GetImageFileTags(QString f, QHash<QString, QString> &tags,
     tags["UniqueSeriesString"] = uniqueseries;
 
     msg += uniqueseries + "\n";
-
-    return true;
 }
 
 
@@ -26,6 +26,9 @@
 #include <QFile>
 #include <QString>
 #include <QDir>
+#include <functional>
+#include <memory>
+#include <QProcess>
 #include "dcmtk/config/osconfig.h"
 #include "dcmtk/dcmdata/dcfilefo.h"
 #include "dcmtk/dcmdata/dcdatset.h"
@@ -63,12 +66,23 @@ public:
 
     QString GetDicomModality(QString f);
     void GetFileType(QString f, QString &fileType, QString &fileModality, QString &filePatientID, QString &fileProtocol);
+    QString SniffFileType(QString f);
+    bool GetDicomGroupingTags(QString f, QHash<QString, QString> &tags, std::function<bool(const QHash<QString, QString> &)> wantAllTags = nullptr);
     bool GetImageFileTags(QString f, QHash<QString, QString> &tags, QString &msg);
     bool GetImageTagsDCMTK(QString f, QHash<QString, QString> &tags);
 
 private:
     /* exiftool helper */
     QString Exiftool(QString arg);
+    std::unique_ptr<QProcess> exiftool; /* the exiftool -stay_open worker, started on first use */
+
+    /* result of the last SniffFileType(), which GetDicomGroupingTags() and GetImageFileTags() both ask for */
+    QString sniffedPath;
+    QString sniffedType;
+
+    /* tag helpers shared by GetImageFileTags() and GetDicomGroupingTags() */
+    void ReadDatasetTags(DcmDataset *dataset, QHash<QString, QString> &tags);
+    void FixImageFileTags(QString f, QHash<QString, QString> &tags, QString &msg);
 
     /* Siemens CSA header parser functions */
     QMap<QString, CsaElement> ParseSiemensCSA(const QByteArray& csa);
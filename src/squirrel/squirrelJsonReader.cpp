@@ -0,0 +1,454 @@
+/* ------------------------------------------------------------------------------
+  Squirrel squirrelJsonReader.cpp
+  Copyright (C) 2004 - 2025
+  Gregory A Book <gregory.book@hhchealth.org> <gregory.a.book@gmail.com>
+  Olin Neuropsychiatry Research Center, Hartford Hospital
+  ------------------------------------------------------------------------------
+  GPLv3 License:
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  ------------------------------------------------------------------------------ */
+
+#include "squirrelJsonReader.h"
+#include <QJsonDocument>
+#include <QJsonParseError>
+
+
+/* ------------------------------------------------------------ */
+/* ----- squirrelJsonReader ----------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Constructor
+ * @param json contents of squirrel.json. Must stay valid until Read() returns
+ */
+squirrelJsonReader::squirrelJsonReader(const QByteArray &json) : json(json) {
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- Read ------------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Walk the document and emit an event for every object
+ * @return true if the whole document was read, false on a parse error or if a handler returned false
+ *
+ * Events are emitted in this order: root, package, data, then each subject
+ * (followed by its studies, each with their series and analyses, then its
+ * observations and interventions), then experiments, then pipelines.
+ */
+bool squirrelJsonReader::Read() {
+    err = "";
+
+    qsizetype pos(0);
+    SkipWhitespace(pos);
+    QJsonObject root;
+    QHash<QString, jsonRange> deferred;
+    if (!ReadObject(pos, root, {"package", "data", "subjects", "experiments", "pipelines"}, deferred))
+        return false;
+
+    if (onRoot && !onRoot(root))
+        return false;
+
+    /* package */
+    if (deferred.contains("package")) {
+        qsizetype p = deferred["package"].start;
+        QJsonObject package;
+        QHash<QString, jsonRange> none;
+        if (!ReadObject(p, package, {}, none))
+            return false;
+        if (onPackage && !onPackage(package))
+            return false;
+    }
+
+    /* subjects are normally in data.subjects, but older packages may have them in the root */
+    jsonRange subjects;
+    if (deferred.contains("data")) {
+        qsizetype p = deferred["data"].start;
+        QJsonObject data;
+        QHash<QString, jsonRange> dataDeferred;
+        if (!ReadObject(p, data, {"subjects"}, dataDeferred))
+            return false;
+        if (onData && !onData(data))
+            return false;
+        subjects = dataDeferred.value("subjects");
+    }
+    else if (deferred.contains("subjects")) {
+        subjects = deferred["subjects"];
+    }
+
+    if (subjects.start >= 0) {
+        if (!ReadArray(subjects, [this](qsizetype &p) { return ReadSubject(p); }))
+            return false;
+    }
+
+    /* experiments */
+    if (deferred.contains("experiments")) {
+        if (!ReadObjectArray(deferred["experiments"], onExperiment))
+            return false;
+    }
+
+    /* pipelines are small, and are read whole, including their dataSteps */
+    if (deferred.contains("pipelines")) {
+        if (!ReadObjectArray(deferred["pipelines"], onPipeline))
+            return false;
+    }
+
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadSubjectDocument ---------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read a document containing a single subject object, such as one passed to onSubjectJson
+ * @return true if the subject was read, false on a parse error or if a handler returned false
+ */
+bool squirrelJsonReader::ReadSubjectDocument() {
+    err = "";
+
+    qsizetype pos(0);
+    SkipWhitespace(pos);
+    return ReadSubject(pos);
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadSubject ------------------------------------------ */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read one subject, then its studies, observations, and interventions
+ * @param pos position of the subject object. Set to the position after the object
+ * @return true if successful
+ */
+bool squirrelJsonReader::ReadSubject(qsizetype &pos) {
+    if (onSubjectJson) {
+        qsizetype start = pos;
+        if (!SkipValue(pos))
+            return false;
+        return onSubjectJson(QByteArray::fromRawData(json.constData() + start, pos - start));
+    }
+
+    QJsonObject subject;
+    QHash<QString, jsonRange> deferred;
+    if (!ReadObject(pos, subject, {"studies", "observations", "interventions", "Interventions"}, deferred))
+        return false;
+
+    if (onSubject && !onSubject(subject))
+        return false;
+
+    /* a reader with no study, series, or analysis handlers doesn't need to walk the studies */
+    if (deferred.contains("studies") && (onStudy || onSeries || onAnalysis)) {
+        bool ok = ReadArray(deferred["studies"], [this](qsizetype &p) {
+            QJsonObject study;
+            QHash<QString, jsonRange> studyDeferred;
+            if (!ReadObject(p, study, {"series", "analyses"}, studyDeferred))
+                return false;
+            if (onStudy && !onStudy(study))
+                return false;
+            if (studyDeferred.contains("series") && !ReadObjectArray(studyDeferred["series"], onSeries))
+                return false;
+            if (studyDeferred.contains("analyses") && !ReadObjectArray(studyDeferred["analyses"], onAnalysis))
+                return false;
+            return true;
+        });
+        if (!ok)
+            return false;
+    }
+
+    if (deferred.contains("observations") && !ReadObjectArray(deferred["observations"], onObservation))
+        return false;
+
+    /* packages have been written with both spellings */
+    if (deferred.contains("interventions") && !ReadObjectArray(deferred["interventions"], onIntervention))
+        return false;
+    if (deferred.contains("Interventions") && !ReadObjectArray(deferred["Interventions"], onIntervention))
+        return false;
+
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadObject ------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Read an object, skipping over the values of some keys
+ * @param pos position of the opening brace. Set to the position after the closing brace
+ * @param obj the object's fields, excluding the deferred keys
+ * @param deferKeys keys whose values are not parsed
+ * @param deferred the byte range of the value of each deferred key found in the object
+ * @return true if successful
+ *
+ * The fields that are kept are copied into one small buffer and parsed with
+ * QJsonDocument, so string escapes and numbers are handled exactly as before.
+ */
+bool squirrelJsonReader::ReadObject(qsizetype &pos, QJsonObject &obj, const QStringList &deferKeys, QHash<QString, jsonRange> &deferred) {
+    SkipWhitespace(pos);
+    if ((pos >= json.size()) || (json.at(pos) != '{'))
+        return Fail(pos, "expected '{'");
+
+    qsizetype objStart = pos;
+    pos++;
+
+    /* no deferred keys, so parse the object in one go */
+    if (deferKeys.isEmpty()) {
+        pos = objStart;
+        if (!SkipValue(pos))
+            return false;
+        QJsonParseError parseError;
+        QJsonDocument d = QJsonDocument::fromJson(json.mid(objStart, pos - objStart), &parseError);
+        if (parseError.error != QJsonParseError::NoError)
+            return Fail(objStart + parseError.offset, parseError.errorString());
+        obj = d.object();
+        return true;
+    }
+
+    QByteArray kept("{");
+    bool first(true);
+    SkipWhitespace(pos);
+    if ((pos < json.size()) && (json.at(pos) == '}')) {
+        pos++;
+        obj = QJsonObject();
+        return true;
+    }
+
+    while (pos < json.size()) {
+        /* key */
+        SkipWhitespace(pos);
+        qsizetype keyStart = pos;
+        if (!SkipString(pos))
+            return false;
+        QString key = QString::fromUtf8(json.mid(keyStart + 1, pos - keyStart - 2));
+
+        SkipWhitespace(pos);
+        if ((pos >= json.size()) || (json.at(pos) != ':'))
+            return Fail(pos, "expected ':'");
+        pos++;
+        SkipWhitespace(pos);
+
+        /* value */
+        qsizetype valueStart = pos;
+        if (!SkipValue(pos))
+            return false;
+
+        if (deferKeys.contains(key)) {
+            jsonRange r;
+            r.start = valueStart;
+            r.end = pos;
+            deferred.insert(key, r);
+        }
+        else {
+            if (!first)
+                kept.append(',');
+            kept.append(json.constData() + keyStart, pos - keyStart);
+            first = false;
+        }
+
+        SkipWhitespace(pos);
+        if (pos >= json.size())
+            break;
+        if (json.at(pos) == ',') {
+            pos++;
+            continue;
+        }
+        if (json.at(pos) == '}') {
+            pos++;
+            kept.append('}');
+            QJsonParseError parseError;
+            QJsonDocument d = QJsonDocument::fromJson(kept, &parseError);
+            if (parseError.error != QJsonParseError::NoError)
+                return Fail(objStart, parseError.errorString());
+            obj = d.object();
+            return true;
+        }
+        return Fail(pos, "expected ',' or '}'");
+    }
+
+    return Fail(pos, "unexpected end of document");
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadArray -------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Call a function for each element of an array
+ * @param r byte range of the array
+ * @param element called with the position of each element. Must move the position past the element
+ * @return true if successful
+ */
+bool squirrelJsonReader::ReadArray(jsonRange r, const std::function<bool(qsizetype &)> &element) {
+    qsizetype pos = r.start;
+    SkipWhitespace(pos);
+    if ((pos >= r.end) || (json.at(pos) != '['))
+        return Fail(pos, "expected '['");
+    pos++;
+
+    SkipWhitespace(pos);
+    if ((pos < r.end) && (json.at(pos) == ']'))
+        return true;
+
+    while (pos < r.end) {
+        SkipWhitespace(pos);
+        if (!element(pos))
+            return false;
+
+        SkipWhitespace(pos);
+        if (pos >= r.end)
+            break;
+        if (json.at(pos) == ',') {
+            pos++;
+            continue;
+        }
+        if (json.at(pos) == ']')
+            return true;
+        return Fail(pos, "expected ',' or ']'");
+    }
+
+    return Fail(pos, "unexpected end of array");
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- ReadObjectArray -------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Call a handler with each object in an array
+ * @param r byte range of the array
+ * @param handler called with each object. May be empty, in which case the array is not walked again
+ * @return true if successful
+ */
+bool squirrelJsonReader::ReadObjectArray(jsonRange r, const std::function<bool(const QJsonObject &)> &handler) {
+    /* the range was already skipped over, and checked, when the parent object was read */
+    if (!handler)
+        return true;
+
+    return ReadArray(r, [this, &handler](qsizetype &p) {
+        QJsonObject obj;
+        QHash<QString, jsonRange> none;
+        if (!ReadObject(p, obj, {}, none))
+            return false;
+        return handler(obj);
+    });
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SkipValue -------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Move past one JSON value, without parsing it
+ * @param pos position of the value. Set to the position after the value
+ * @return true if successful
+ */
+bool squirrelJsonReader::SkipValue(qsizetype &pos) {
+    SkipWhitespace(pos);
+    if (pos >= json.size())
+        return Fail(pos, "expected a value");
+
+    char c = json.at(pos);
+    if (c == '"')
+        return SkipString(pos);
+
+    if ((c == '{') || (c == '[')) {
+        int depth(0);
+        while (pos < json.size()) {
+            c = json.at(pos);
+            if (c == '"') {
+                if (!SkipString(pos))
+                    return false;
+                continue;
+            }
+            if ((c == '{') || (c == '['))
+                depth++;
+            else if ((c == '}') || (c == ']')) {
+                depth--;
+                if (depth == 0) {
+                    pos++;
+                    return true;
+                }
+            }
+            pos++;
+        }
+        return Fail(pos, "unterminated object or array");
+    }
+
+    /* number, true, false, null */
+    qsizetype start = pos;
+    while ((pos < json.size()) && !QByteArrayView(",}] \t\r\n").contains(json.at(pos)))
+        pos++;
+    if (pos == start)
+        return Fail(pos, "expected a value");
+
+    return true;
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SkipString ------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Move past a quoted string, including any escaped characters
+ * @param pos position of the opening quote. Set to the position after the closing quote
+ * @return true if successful
+ */
+bool squirrelJsonReader::SkipString(qsizetype &pos) {
+    if ((pos >= json.size()) || (json.at(pos) != '"'))
+        return Fail(pos, "expected '\"'");
+
+    pos++;
+    while (pos < json.size()) {
+        char c = json.at(pos);
+        if (c == '\\')
+            pos += 2;
+        else if (c == '"') {
+            pos++;
+            return true;
+        }
+        else
+            pos++;
+    }
+
+    return Fail(pos, "unterminated string");
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- SkipWhitespace --------------------------------------- */
+/* ------------------------------------------------------------ */
+void squirrelJsonReader::SkipWhitespace(qsizetype &pos) {
+    while (pos < json.size()) {
+        char c = json.at(pos);
+        if ((c != ' ') && (c != '\t') && (c != '\r') && (c != '\n'))
+            break;
+        pos++;
+    }
+}
+
+
+/* ------------------------------------------------------------ */
+/* ----- Fail ------------------------------------------------- */
+/* ------------------------------------------------------------ */
+/**
+ * @brief Record a parse error
+ * @param pos byte offset of the error
+ * @param s description of the error
+ * @return false, always
+ */
+bool squirrelJsonReader::Fail(qsizetype pos, QString s) {
+    if (err.isEmpty())
+        err = QString("Error parsing squirrel.json at byte [%1]: %2").arg(pos).arg(s);
+    return false;
+}
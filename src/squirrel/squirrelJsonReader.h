@@ -0,0 +1,97 @@
+/* ------------------------------------------------------------------------------
+  Squirrel squirrelJsonReader.h
+  Copyright (C) 2004 - 2025
+  Gregory A Book <gregory.book@hhchealth.org> <gregory.a.book@gmail.com>
+  Olin Neuropsychiatry Research Center, Hartford Hospital
+  ------------------------------------------------------------------------------
+  GPLv3 License:
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  ------------------------------------------------------------------------------ */
+
+#ifndef SQUIRRELJSONREADER_H
+#define SQUIRRELJSONREADER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+#include <functional>
+
+/**
+ * @brief The squirrelJsonReader class
+ *
+ * Streaming reader for squirrel.json. Instead of building a QJsonDocument of the
+ * entire header, the reader walks the document and emits one event per package,
+ * subject, study, series, analysis, observation, intervention, experiment, and
+ * pipeline. Each event receives a QJsonObject of that object's own fields only;
+ * child arrays (studies, series, observations, etc) are not included, and are
+ * emitted as their own events after the parent. Only one object is ever held as
+ * a QJsonObject, so memory use does not grow with the size of the header.
+ *
+ * Child arrays can appear before their parent's fields (QJsonObject writes keys
+ * in sorted order, so "Interventions" comes before "SubjectID"). The reader
+ * records the byte range of each child array while scanning the parent, and
+ * walks it after the parent event is emitted.
+ *
+ * If onSubjectJson is set, each subject is passed on as its unparsed JSON, so
+ * it can be parsed elsewhere (for example on a worker thread) by a second
+ * reader calling ReadSubjectDocument().
+ *
+ * A handler returns false to stop the read.
+ */
+class squirrelJsonReader
+{
+public:
+    squirrelJsonReader(const QByteArray &json);
+
+    bool Read();
+    bool ReadSubjectDocument();
+    QString Error() { return err; } /*!< description of the parse error, if Read() returned false */
+
+    /* event handlers */
+    std::function<bool(const QJsonObject &)> onRoot;         /*!< root fields, excluding package, data, subjects, experiments, pipelines */
+    std::function<bool(const QJsonObject &)> onPackage;      /*!< the package object */
+    std::function<bool(const QJsonObject &)> onData;         /*!< the data object, excluding subjects */
+    std::function<bool(const QByteArray &)> onSubjectJson;   /*!< if set, each subject is passed as unparsed JSON instead of as events */
+    std::function<bool(const QJsonObject &)> onSubject;
+    std::function<bool(const QJsonObject &)> onStudy;        /*!< study of the most recent subject */
+    std::function<bool(const QJsonObject &)> onSeries;       /*!< series of the most recent study */
+    std::function<bool(const QJsonObject &)> onAnalysis;     /*!< analysis of the most recent study */
+    std::function<bool(const QJsonObject &)> onObservation;  /*!< observation of the most recent subject */
+    std::function<bool(const QJsonObject &)> onIntervention; /*!< intervention of the most recent subject */
+    std::function<bool(const QJsonObject &)> onExperiment;
+    std::function<bool(const QJsonObject &)> onPipeline;     /*!< a complete pipeline, including its dataSteps */
+
+private:
+    struct jsonRange {
+        qsizetype start = -1;
+        qsizetype end = -1;
+    };
+
+    bool ReadSubject(qsizetype &pos);
+    bool ReadObject(qsizetype &pos, QJsonObject &obj, const QStringList &deferKeys, QHash<QString, jsonRange> &deferred);
+    bool ReadArray(jsonRange r, const std::function<bool(qsizetype &)> &element);
+    bool ReadObjectArray(jsonRange r, const std::function<bool(const QJsonObject &)> &handler);
+    bool SkipValue(qsizetype &pos);
+    bool SkipString(qsizetype &pos);
+    void SkipWhitespace(qsizetype &pos);
+    bool Fail(qsizetype pos, QString s);
+
+    const QByteArray &json;
+    QString err;
+};
+
+#endif // SQUIRRELJSONREADER_H
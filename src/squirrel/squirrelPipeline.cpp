@@ -318,8 +318,8 @@ bool squirrelPipeline::Store() {
 
 /**
  * @brief Get JSON object describing the pipeline
- * @param path if a path is specified, the full JSON object is written
- * to that path and a smaller JSON object is returned
+ * @param path if a path is specified, the pipeline scripts are written
+ * to that path. If empty, nothing is written to disk
  * @return JSON object
  */
 
@@ -388,19 +388,21 @@ QJsonObject squirrelPipeline::ToJSON(QString path) {
     json["data-steps"] = JSONdataSteps;
 
     /* write all pipeline info to path */
-    QString m;
-    QString pipelinepath = QString("%1/pipelines/%2").arg(path).arg(PipelineName);
-    if (utils::MakePath(pipelinepath, m)) {
-        /* write the scripts */
-        if (!utils::WriteTextFile(QString(pipelinepath + "/primaryScript.sh"), PipelinePrimaryScript))
-            utils::Print("Error writing primary script [" + pipelinepath + "/primaryScript.sh]");
-
-        if (!utils::WriteTextFile(QString(pipelinepath + "/secondaryScript.sh"), PipelineSecondaryScript))
-            utils::Print("Error writing secondary script [" + pipelinepath + "/secondaryScript.sh]");
-
-    }
-    else {
-        utils::Print("Error creating path [" + pipelinepath + "] because of [" + m + "]");
+    if (!path.isEmpty()) {
+        QString m;
+        QString pipelinepath = QString("%1/pipelines/%2").arg(path).arg(PipelineName);
+        if (utils::MakePath(pipelinepath, m)) {
+            /* write the scripts */
+            if (!utils::WriteTextFile(QString(pipelinepath + "/primaryScript.sh"), PipelinePrimaryScript))
+                utils::Print("Error writing primary script [" + pipelinepath + "/primaryScript.sh]");
+
+            if (!utils::WriteTextFile(QString(pipelinepath + "/secondaryScript.sh"), PipelineSecondaryScript))
+                utils::Print("Error writing secondary script [" + pipelinepath + "/secondaryScript.sh]");
+
+        }
+        else {
+            utils::Print("Error creating path [" + pipelinepath + "] because of [" + m + "]");
+        }
     }
 
     /* return JSON object */
@@ -490,9 +490,10 @@ QString squirrelStudy::PrintTree(bool isLast) {
 /* ------------------------------------------------------------ */
 /**
  * @brief Get a JSON object for this study
+ * @param includeChildren `true` to add the series and analyses. `false` for only the study's own fields
  * @return JSON object
  */
-QJsonObject squirrelStudy::ToJSON() {
+QJsonObject squirrelStudy::ToJSON(bool includeChildren) {
 	QJsonObject json;
 
     json["AgeAtStudy"] = AgeAtStudy;
@@ -510,6 +511,9 @@ QJsonObject squirrelStudy::ToJSON() {
     json["VisitType"] = VisitType;
     json["Weight"] = Weight;
 
+    if (!includeChildren)
+        return json;
+
     /* add all the series */
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select * from Series where StudyRowID = :id");
@@ -42,7 +42,7 @@ public:
     squirrelStudy(QString dbID);
 
     QHash<QString, QString> GetData(DatasetType d);
-    QJsonObject ToJSON();
+    QJsonObject ToJSON(bool includeChildren = true);
     QList<QPair<QString,QString>> GetStagedFileList();
     QString Error() { return err; }
     QString GetDatabaseUUID() { return databaseUUID; }
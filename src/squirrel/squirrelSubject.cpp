@@ -520,9 +520,10 @@ bool squirrelSubject::Remove() {
 /* ------------------------------------------------------------ */
 /**
  * @brief Get JSON object for this subject
+ * @param includeChildren `true` to add the studies, observations, and interventions. `false` for only the subject's own fields
  * @return a JSON object containing the entire subject
  */
-QJsonObject squirrelSubject::ToJSON() {
+QJsonObject squirrelSubject::ToJSON(bool includeChildren) {
     QJsonObject json;
 
     json["AlternateIDs"] = QJsonArray::fromStringList(AlternateIDs);
@@ -538,6 +539,9 @@ QJsonObject squirrelSubject::ToJSON() {
     json["SubjectID"] = ID;
     json["VirtualPath"] = VirtualPath();
 
+    if (!includeChildren)
+        return json;
+
     /* add studies */
     QSqlQuery q(QSqlDatabase::database(databaseUUID));
     q.prepare("select * from Study where SubjectRowID = :id");
@@ -43,7 +43,7 @@ public:
 
     /* functions */
     QHash<QString, QString> GetData(DatasetType d);
-    QJsonObject ToJSON();
+    QJsonObject ToJSON(bool includeChildren = true);
     QList<QPair<QString,QString>> GetStagedFileList();
     QString CSVLine();
     QString Error() { return err; }
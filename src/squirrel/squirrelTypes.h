@@ -3,8 +3,17 @@
 
 #include <QString>
 #include <QList>
+#include <QHash>
+#include <QMap>
+#include <QByteArray>
+#include <QStringList>
 
 enum FileMode { NewPackage, ExistingPackage };
+enum class ReadMode {
+    Full,                     /* read every object, and each series' params.json and file listing */
+    Quick,                    /* read every object, but skip the params.json files and file listings */
+    Lazy                      /* read the package and subjects. Each subject's child objects are read on first access */
+};
 enum PrintFormat { BasicList, FullList, List, Details, CSV, Tree };
 enum DatasetType { DatasetID, DatasetBasic, DatasetFull };
 enum ObjectType {
@@ -35,6 +44,7 @@ struct infoQuery {
     int studyNum;
     DatasetType dataset;
     PrintFormat printFormat;
+    QString cacheDir;         /* metadata cache directory. Empty to read the package without the cache */
 };
 
 struct modification {
@@ -53,4 +63,51 @@ struct modification {
     bool recursive;           /* search dataPath recursively when it is a directory */
 };
 
+struct archiveEntry {
+    quint32 index;            /* item index within the archive */
+    qint64 size;              /* unpacked size in bytes */
+    qint64 packSize;          /* packed (compressed) size in bytes */
+    quint32 crc;              /* CRC32 of the unpacked contents */
+    bool isDir;               /* true if the item is a directory entry */
+};
+
+struct archiveIndex {
+    qint64 archiveSize = -1;              /* size of the archive when it was indexed */
+    qint64 archiveModified = 0;           /* modification time of the archive (ms since epoch) when it was indexed */
+    QByteArray jsonHash;                  /* SHA-1 of squirrel.json, if known */
+    QHash<QString, archiveEntry> items;   /* item path -> entry. An alias has the entry of its stored file */
+    QHash<QString, QString> aliases;      /* alias path -> path of the stored file */
+    QMap<QString, QStringList> objects;   /* object path (data/subject/study/series, or the first two levels of other paths, such as pipelines/name) -> paths of its items, in archive order */
+};
+
+struct compressionProfile {
+    QString method = "lzma2";     /* lzma2, deflate, or store. Zip packages use deflate in place of lzma2 */
+    int level = 1;                /* 0 (store) to 9 (ultra) */
+    int threads = 0;              /* compressor threads. 0 lets 7-zip choose */
+    int dictionarySize = 0;       /* LZMA2 dictionary size in MB. 0 uses the default for the level */
+    bool storeCompressed = false; /* store, instead of compress, an archive pass that is at least 90% already-compressed files (.gz, .zip, JPEG DICOM, ...) by size */
+};
+
+struct phaseStats {
+    double wallSec = 0.0;     /* wall time in seconds, summed over every call of the phase */
+    double cpuSec = 0.0;      /* process CPU time (all threads) in seconds while the phase ran */
+    qint64 calls = 0;         /* number of times the phase ran */
+};
+
+struct squirrelStats {
+    phaseStats headerExtract;     /* extracting squirrel.json from the package */
+    phaseStats jsonParse;         /* reading squirrel.json into the database. Includes sqlInsert */
+    phaseStats sqlInsert;         /* storing decoded subjects, and their child objects, in the database */
+    phaseStats staging;           /* copying series and other staged files into the working directory */
+    phaseStats conversion;        /* DICOM anonymization and Nifti conversion while staging */
+    phaseStats compression;       /* creating, updating, or removing items from an archive */
+    phaseStats extraction;        /* extracting items from an archive, to memory or to disk */
+    qint64 archiveOpens = 0;      /* number of times an archive was opened */
+    qint64 bytesCompressed = 0;   /* uncompressed bytes passed to the compressor */
+    qint64 bytesDecompressed = 0; /* uncompressed bytes extracted from archives */
+    qint64 filesCopied = 0;       /* files copied into the working directory */
+    qint64 sqlStatements = 0;     /* SQL statements executed */
+    qint64 peakMemory = -1;       /* peak resident memory of the process in bytes, -1 if not available */
+};
+
 #endif // SQUIRRELTYPES_H
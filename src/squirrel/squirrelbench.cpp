@@ -0,0 +1,379 @@
+/* ------------------------------------------------------------------------------
+  Squirrel squirrelbench.cpp
+  Copyright (C) 2004 - 2025
+  Gregory A Book <gregory.book@hhchealth.org> <gregory.a.book@gmail.com>
+  Olin Neuropsychiatry Research Center, Hartford Hospital
+  ------------------------------------------------------------------------------
+  GPLv3 License:
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  ------------------------------------------------------------------------------ */
+
+/* squirrelbench - generates deterministic synthetic squirrel packages and times
+   the main library operations on them. Every run with the same options produces
+   byte-identical input files, so timings can be compared between builds. */
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QRandomGenerator>
+#include <functional>
+#include "squirrelVersion.h"
+#include "squirrel.h"
+#include "dicom.h"
+#include "modify.h"
+#include "utils.h"
+
+struct benchOptions {
+    int subjects;
+    int studies;              /* studies per subject */
+    int series;               /* series per study */
+    int files;                /* files per series */
+    qint64 fileSize;          /* size in bytes of each file */
+    int observations;         /* observations per subject */
+    QString format;           /* zip or 7z */
+    quint32 seed;
+    QString workDir;
+};
+
+struct benchResult {
+    QString phase;
+    bool ok;
+    qint64 wallMs;
+    qint64 peakRSS;
+    qint64 archiveOpens;
+};
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- GenerateStagingFiles ------------------------------------------------- */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Write the raw files for one series to disk
+ * @param dir directory to write the files to
+ * @param opt benchmark options
+ * @param rng random generator, seeded once per package so the contents are deterministic
+ * @return list of the files written
+ */
+QStringList GenerateStagingFiles(QString dir, const benchOptions &opt, QRandomGenerator &rng) {
+    QStringList files;
+    QDir().mkpath(dir);
+
+    QByteArray buf(opt.fileSize, Qt::Uninitialized);
+    for (int i=0; i<opt.files; i++) {
+        /* fill with random 32-bit words, so the data is not trivially compressible */
+        qint64 words = opt.fileSize / 4;
+        rng.fillRange(reinterpret_cast<quint32*>(buf.data()), words);
+        for (qint64 j=words*4; j<opt.fileSize; j++)
+            buf[j] = char(rng.bounded(256));
+
+        QString path = QString("%1/file%2.dat").arg(dir).arg(i, 5, 10, QChar('0'));
+        QFile f(path);
+        if (f.open(QIODevice::WriteOnly)) {
+            f.write(buf);
+            f.close();
+            files.append(path);
+        }
+    }
+    return files;
+}
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- GeneratePackage ------------------------------------------------------ */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Build and write a synthetic squirrel package
+ * @param packagePath path of the package to write
+ * @param idPrefix prefix for the subject IDs, so two packages can be merged without collisions
+ * @param opt benchmark options
+ * @param m output message if the write failed
+ * @return true if successful
+ */
+bool GeneratePackage(QString packagePath, QString idPrefix, const benchOptions &opt, QString &m) {
+    QRandomGenerator rng(opt.seed);
+    QString stagingDir = QString("%1/staging-%2").arg(opt.workDir).arg(idPrefix);
+    QDir(stagingDir).removeRecursively();
+
+    squirrel *sqrl = new squirrel(false, true);
+    sqrl->SetOverwritePackage(true);
+    sqrl->DataFormat = "orig";
+    sqrl->SetPackagePath(packagePath);
+    QDateTime baseDate(QDate(2020, 1, 1), QTime(8, 0, 0));
+
+    for (int subj=0; subj<opt.subjects; subj++) {
+        squirrelSubject subject(sqrl->GetDatabaseUUID());
+        subject.ID = QString("%1%2").arg(idPrefix).arg(subj + 1, 5, 10, QChar('0'));
+        subject.Sex = (subj % 2) ? "F" : "M";
+        subject.Gender = subject.Sex;
+        subject.DateOfBirth = QDate(1980, 1, 1).addDays(subj);
+        subject.Store();
+        qint64 subjectRowID = subject.GetObjectID();
+
+        for (int obs=0; obs<opt.observations; obs++) {
+            squirrelObservation observation(sqrl->GetDatabaseUUID());
+            observation.subjectRowID = subjectRowID;
+            observation.ObservationName = QString("measure%1").arg(obs + 1);
+            observation.Value = QString::number(rng.bounded(1000));
+            observation.DateStart = baseDate.addDays(obs);
+            observation.Store();
+        }
+
+        for (int stdy=0; stdy<opt.studies; stdy++) {
+            squirrelStudy study(sqrl->GetDatabaseUUID());
+            study.subjectRowID = subjectRowID;
+            study.StudyNumber = stdy + 1;
+            /* alternate modalities, so SplitByModality has something to split */
+            study.Modality = (stdy % 2) ? "CT" : "MR";
+            study.DateTime = baseDate.addDays(subj*opt.studies + stdy);
+            study.Description = "Synthetic study";
+            study.Store();
+            qint64 studyRowID = study.GetObjectID();
+
+            for (int ser=0; ser<opt.series; ser++) {
+                squirrelSeries series(sqrl->GetDatabaseUUID());
+                series.studyRowID = studyRowID;
+                series.SeriesNumber = ser + 1;
+                series.DateTime = study.DateTime.addSecs(ser*60);
+                series.Description = QString("series%1").arg(ser + 1);
+                series.Protocol = series.Description;
+                series.Store();
+
+                QString seriesDir = QString("%1/%2/%3/%4").arg(stagingDir).arg(subject.ID).arg(stdy + 1).arg(ser + 1);
+                QStringList files = GenerateStagingFiles(seriesDir, opt, rng);
+                sqrl->AddStagedFiles(Series, series.GetObjectID(), files);
+            }
+        }
+    }
+
+    bool ok = sqrl->Write();
+    if (!ok)
+        m = sqrl->GetLog();
+    delete sqrl;
+    QDir(stagingDir).removeRecursively();
+
+    return ok;
+}
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- LoadDicom ------------------------------------------------------------ */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Load a DICOM directory into a new squirrel object, through the ingest cache
+ * @param dir the DICOM directory
+ * @param cacheDir the ingest cache directory
+ * @param objects output: one line per series with its subject ID, StudyUID, SeriesUID, and file count
+ * @return true if successful
+ */
+bool LoadDicom(QString dir, QString cacheDir, QStringList &objects) {
+    objects.clear();
+    squirrel sqrl(false, true);
+    dicom dcm;
+    dcm.SetCacheDir(cacheDir);
+    if (!dcm.LoadToSquirrel(dir, &sqrl))
+        return false;
+
+    foreach (squirrelSubject subject, sqrl.GetSubjectList())
+        foreach (squirrelStudy study, sqrl.GetStudyList(subject.GetObjectID()))
+            foreach (squirrelSeries series, sqrl.GetSeriesList(study.GetObjectID()))
+                objects.append(QString("%1 %2 %3 %4").arg(subject.ID).arg(study.StudyUID).arg(series.SeriesUID).arg(series.FileCount));
+    return true;
+}
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- RunPhase ------------------------------------------------------------- */
+/* ---------------------------------------------------------------------------- */
+/**
+ * @brief Time one benchmark phase
+ * @param phase name of the phase
+ * @param f the operation to run. Returns true if successful
+ * @return the result of the phase
+ */
+benchResult RunPhase(QString phase, std::function<bool()> f) {
+    benchResult r;
+    r.phase = phase;
+
+    qint64 opensBefore = squirrel::GetArchiveOpenCount();
+    QElapsedTimer timer;
+    timer.start();
+    r.ok = f();
+    r.wallMs = timer.elapsed();
+    r.archiveOpens = squirrel::GetArchiveOpenCount() - opensBefore;
+    r.peakRSS = utils::GetPeakMemoryBytes();
+
+    utils::Print(QString("%1 %2 ms").arg(phase, -20).arg(r.wallMs));
+    return r;
+}
+
+
+/* ---------------------------------------------------------------------------- */
+/* ----- main ----------------------------------------------------------------- */
+/* ---------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationVersion(QString("squirrellib %1.%2  Build date %3 %4").arg(SQUIRREL_VERSION_MAJ).arg(SQUIRREL_VERSION_MIN).arg(__DATE__).arg(__TIME__));
+    a.setApplicationName("squirrelbench");
+
+    QCommandLineParser p;
+    p.setApplicationDescription("Generate synthetic squirrel packages and time Read, Write, ExtractObject, MergePackages, and SplitByModality. With --dicomdir, also time a cold and a warm DICOM load through the ingest cache");
+    p.addHelpOption();
+    p.addVersionOption();
+    p.addOption(QCommandLineOption(QStringList() << "subjects", "Number of subjects (default: 10)", "count", "10"));
+    p.addOption(QCommandLineOption(QStringList() << "studies", "Studies per subject (default: 2)", "count", "2"));
+    p.addOption(QCommandLineOption(QStringList() << "series", "Series per study (default: 5)", "count", "5"));
+    p.addOption(QCommandLineOption(QStringList() << "files", "Files per series (default: 20)", "count", "20"));
+    p.addOption(QCommandLineOption(QStringList() << "filesize", "Size of each file in bytes (default: 65536)", "bytes", "65536"));
+    p.addOption(QCommandLineOption(QStringList() << "observations", "Observations per subject (default: 10)", "count", "10"));
+    p.addOption(QCommandLineOption(QStringList() << "format", "Package format [zip  7z] (default: zip)", "format", "zip"));
+    p.addOption(QCommandLineOption(QStringList() << "seed", "Random seed for the file contents (default: 1)", "seed", "1"));
+    p.addOption(QCommandLineOption(QStringList() << "workdir", "Directory for the generated packages (default: a temp directory)", "dir"));
+    p.addOption(QCommandLineOption(QStringList() << "keep", "Keep the generated packages after the benchmark"));
+    p.addOption(QCommandLineOption(QStringList() << "dicomdir", "DICOM directory to load with a cold and then a warm ingest cache. The warm load fails if it finds different subjects, studies, or series", "dir"));
+    p.process(a);
+
+    benchOptions opt;
+    opt.subjects = p.value("subjects").toInt();
+    opt.studies = p.value("studies").toInt();
+    opt.series = p.value("series").toInt();
+    opt.files = p.value("files").toInt();
+    opt.fileSize = p.value("filesize").toLongLong();
+    opt.observations = p.value("observations").toInt();
+    opt.format = p.value("format").trimmed().toLower();
+    opt.seed = p.value("seed").toUInt();
+    opt.workDir = p.value("workdir").trimmed();
+    bool keep = p.isSet("keep");
+    QString dicomDir = p.value("dicomdir").trimmed();
+
+    if ((opt.format != "zip") && (opt.format != "7z")) {
+        utils::Print("Invalid format [" + opt.format + "]. Must be zip or 7z");
+        return 1;
+    }
+    if ((opt.subjects < 1) || (opt.studies < 1) || (opt.series < 1) || (opt.files < 0) || (opt.fileSize < 0) || (opt.observations < 0)) {
+        utils::Print("Invalid package dimensions");
+        return 1;
+    }
+    if (opt.workDir == "")
+        opt.workDir = QString("%1/squirrelbench-%2").arg(QDir::tempPath()).arg(QCoreApplication::applicationPid());
+    QDir().mkpath(opt.workDir);
+
+    QString packageA = QString("%1/benchA.%2").arg(opt.workDir).arg(opt.format);
+    QString packageB = QString("%1/benchB.%2").arg(opt.workDir).arg(opt.format);
+    QString packageSplit = QString("%1/split/bench.%2").arg(opt.workDir).arg(opt.format);
+    QString packageMerged = QString("%1/merged.%2").arg(opt.workDir).arg(opt.format);
+    QString extractDir = QString("%1/extract").arg(opt.workDir);
+
+    utils::Print(QString("Package: %1 subjects x %2 studies x %3 series x %4 files x %5 bytes, %6 observations per subject, format [%7], seed [%8]").arg(opt.subjects).arg(opt.studies).arg(opt.series).arg(opt.files).arg(opt.fileSize).arg(opt.observations).arg(opt.format).arg(opt.seed));
+    utils::Print("Working directory [" + opt.workDir + "]");
+
+    QList<benchResult> results;
+    QString m;
+
+    /* Write - the generation of the second package (for merging) is not timed */
+    results.append(RunPhase("Write", [&]() { return GeneratePackage(packageA, "A", opt, m); }));
+    if (!results.last().ok) {
+        utils::Print("Unable to write package [" + packageA + "]: " + m);
+        return 1;
+    }
+    if (!GeneratePackage(packageB, "B", opt, m)) {
+        utils::Print("Unable to write package [" + packageB + "]: " + m);
+        return 1;
+    }
+
+    /* Read, quick and full */
+    results.append(RunPhase("Read (quick)", [&]() {
+        squirrel sqrl(false, true);
+        sqrl.SetFileMode(FileMode::ExistingPackage);
+        sqrl.SetPackagePath(packageA);
+        sqrl.SetReadMode(ReadMode::Quick);
+        return sqrl.Read();
+    }));
+    results.append(RunPhase("Read (full)", [&]() {
+        squirrel sqrl(false, true);
+        sqrl.SetFileMode(FileMode::ExistingPackage);
+        sqrl.SetPackagePath(packageA);
+        sqrl.SetReadMode(ReadMode::Full);
+        return sqrl.Read();
+    }));
+
+    /* ExtractObject, the first subject. Includes the read */
+    results.append(RunPhase("ExtractObject", [&]() {
+        QDir(extractDir).removeRecursively();
+        QDir().mkpath(extractDir);
+        squirrel sqrl(false, true);
+        sqrl.SetFileMode(FileMode::ExistingPackage);
+        sqrl.SetPackagePath(packageA);
+        if (!sqrl.Read())
+            return false;
+        return sqrl.ExtractObject(Subject, sqrl.FindSubject("A00001"), extractDir);
+    }));
+
+    /* MergePackages */
+    results.append(RunPhase("MergePackages", [&]() {
+        QFile::remove(packageMerged);
+        modify mod;
+        return mod.MergePackages(QStringList() << packageA << packageB, packageMerged, false, false, 0, m);
+    }));
+
+    /* SplitByModality, on a copy so the split packages land in their own directory */
+    QDir().mkpath(QFileInfo(packageSplit).absolutePath());
+    QFile::remove(packageSplit);
+    QFile::copy(packageA, packageSplit);
+    results.append(RunPhase("SplitByModality", [&]() {
+        modify mod;
+        modification split;
+        split.operation = "splitbymodality";
+        return mod.SplitByModality(packageSplit, split, m);
+    }));
+
+    /* DICOM load, first with an empty ingest cache and then with the cache it filled */
+    if (dicomDir != "") {
+        QString cacheDir = QString("%1/ingestcache").arg(opt.workDir);
+        QDir(cacheDir).removeRecursively();
+        QStringList coldObjects;
+        QStringList warmObjects;
+        results.append(RunPhase("DICOM (cold cache)", [&]() { return LoadDicom(dicomDir, cacheDir, coldObjects); }));
+        results.append(RunPhase("DICOM (warm cache)", [&]() { return LoadDicom(dicomDir, cacheDir, warmObjects); }));
+        if (warmObjects != coldObjects) {
+            results.last().ok = false;
+            utils::Print(QString("The warm load found %1 series, the cold load found %2. Series that differ:").arg(warmObjects.size()).arg(coldObjects.size()));
+            foreach (QString o, coldObjects)
+                if (!warmObjects.contains(o))
+                    utils::Print("  cold only: " + o);
+            foreach (QString o, warmObjects)
+                if (!coldObjects.contains(o))
+                    utils::Print("  warm only: " + o);
+        }
+    }
+
+    /* report. Peak RSS is the process high-water mark, so it only increases from one phase to the next */
+    utils::Print("");
+    utils::Print(QString("%1 %2 %3 %4 %5").arg("Phase", -20).arg("Result", -8).arg("Wall (ms)", 12).arg("Peak RSS", 12).arg("Archive opens", 14));
+    foreach (benchResult r, results) {
+        utils::Print(QString("%1 %2 %3 %4 %5").arg(r.phase, -20).arg(r.ok ? "ok" : "FAILED", -8).arg(r.wallMs, 12).arg(utils::HumanReadableSize(r.peakRSS), 12).arg(r.archiveOpens, 14));
+    }
+
+    if (!keep)
+        QDir(opt.workDir).removeRecursively();
+
+    foreach (benchResult r, results)
+        if (!r.ok)
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+# Use this file to build squirrelbench, the synthetic package benchmark
+
+QT -= gui
+
+CONFIG += c++17
+CONFIG += cmdline
+CONFIG -= app_bundle
+CONFIG += silent
+
+TARGET = squirrelbench
+
+# squirrel core sources (everything except main.cpp), compiled directly as in squirrel.pro
+include($$PWD/squirrel-sources.pri)
+
+SOURCES += $$PWD/squirrelbench.cpp
+
+# bit7z (LZMA) + DCMTK, shared with squirrel.pro and squirrellib.pro
+include($$PWD/squirrel-deps.pri)
+
+# dcm2niix in-process DICOM->Nifti conversion (Linux only; see dcm2niix.pri)
+include($$PWD/dcm2niix.pri)
@@ -25,10 +25,22 @@
 #include "squirrel.h"
 #ifdef Q_OS_LINUX
 #include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <time.h>
 #endif
+#include <atomic>
 
 namespace utils {
 
+    /* number of statements run through SQLQuery(), by all threads. See GetSQLQueryCount() */
+    static std::atomic<qint64> sqlQueryCount(0);
+
     /* ---------------------------------------------------------- */
     /* --------- Print ------------------------------------------ */
     /* ---------------------------------------------------------- */
@@ -719,6 +731,98 @@ namespace utils {
     }
 
 
+    /* ---------------------------------------------------------- */
+    /* --------- StageFile -------------------------------------- */
+    /* ---------------------------------------------------------- */
+    /* Put a copy of a file at dest, as cheaply as the filesystem */
+    /* allows: a reflink (copy-on-write clone), then              */
+    /* copy_file_range() in the kernel, then a buffered copy.     */
+    /* dest can be modified without changing the original. bytes  */
+    /* is the size of the file                                    */
+    bool StageFile(QString source, QString dest, qint64 &bytes, QString &m) {
+        bytes = 0;
+#ifdef Q_OS_LINUX
+        QByteArray src = QFile::encodeName(source);
+        QByteArray dst = QFile::encodeName(dest);
+
+        int in = ::open(src.constData(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            m = QString("Unable to open [%1]. Error [%2]").arg(source).arg(strerror(errno));
+            return false;
+        }
+        struct stat st;
+        if (fstat(in, &st) != 0) {
+            m = QString("Unable to stat [%1]. Error [%2]").arg(source).arg(strerror(errno));
+            ::close(in);
+            return false;
+        }
+
+        int out = ::open(dst.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+        if (out < 0) {
+            m = QString("Unable to create [%1]. Error [%2]").arg(dest).arg(strerror(errno));
+            ::close(in);
+            return false;
+        }
+
+        /* reflink. Supported by btrfs, XFS, and others, if both files are on the same filesystem */
+        if (ioctl(out, FICLONE, in) == 0) {
+            ::close(out);
+            ::close(in);
+            bytes = st.st_size;
+            return true;
+        }
+
+        /* in-kernel copy. Falls back to a buffered copy if the kernel or filesystem can't do it */
+        qint64 copied(0);
+        bool ok(true);
+        while (copied < st.st_size) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(st.st_size - copied), 0);
+            if (n <= 0) {
+                if ((n < 0) && (copied == 0) && ((errno == EXDEV) || (errno == ENOSYS) || (errno == EINVAL) || (errno == EOPNOTSUPP)))
+                    break;
+                ok = (n == 0);
+                if (!ok)
+                    m = QString("Unable to copy [%1] to [%2]. Error [%3]").arg(source).arg(dest).arg(strerror(errno));
+                break;
+            }
+            copied += n;
+        }
+        if (ok && (copied == 0) && (st.st_size > 0)) {
+            QByteArray buffer(1024*1024, Qt::Uninitialized);
+            ssize_t n;
+            while ((n = ::read(in, buffer.data(), static_cast<size_t>(buffer.size()))) > 0) {
+                if (::write(out, buffer.constData(), static_cast<size_t>(n)) != n) {
+                    n = -1;
+                    break;
+                }
+                copied += n;
+            }
+            if (n < 0) {
+                ok = false;
+                m = QString("Unable to copy [%1] to [%2]. Error [%3]").arg(source).arg(dest).arg(strerror(errno));
+            }
+        }
+        ::close(in);
+        if (::close(out) != 0)
+            ok = false;
+        if (!ok) {
+            ::unlink(dst.constData());
+            return false;
+        }
+        bytes = copied;
+        return true;
+#else
+        QFile::remove(dest);
+        if (!QFile::copy(source, dest)) {
+            m = QString("Unable to copy [%1] to [%2]").arg(source).arg(dest);
+            return false;
+        }
+        bytes = QFileInfo(dest).size();
+        return true;
+#endif
+    }
+
+
 
 
     /* ---------------------------------------------------------- */
@@ -750,6 +854,7 @@ namespace utils {
             Print(sql);
 
         /* run the query */
+        sqlQueryCount++;
         if (q.exec())
             return true;
         else {
@@ -840,6 +945,35 @@ namespace utils {
     }
 
 
+    /* ---------------------------------------------------------- */
+    /* --------- GetProcessCPUTime ------------------------------ */
+    /* ---------------------------------------------------------- */
+    /* CPU time used by all threads of this process, in           */
+    /* nanoseconds. Returns -1 if not available on this platform  */
+    qint64 GetProcessCPUTime()
+    {
+#ifdef Q_OS_LINUX
+        struct timespec ts;
+        if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+            return (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        return -1;
+#else
+        return -1;
+#endif
+    }
+
+
+    /* ---------------------------------------------------------- */
+    /* --------- GetSQLQueryCount ------------------------------- */
+    /* ---------------------------------------------------------- */
+    /* number of SQL statements run through SQLQuery() since the  */
+    /* process started                                            */
+    qint64 GetSQLQueryCount()
+    {
+        return sqlQueryCount;
+    }
+
+
     /* --------- HumanReadableSize ------------------------------ */
     /* ---------------------------------------------------------- */
     QString HumanReadableSize(qint64 bytes)
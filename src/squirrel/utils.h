@@ -53,6 +53,8 @@ namespace utils {
     QString CreateLogDate();
     QString GenerateRandomString(int n);
     qint64 GetPeakMemoryBytes();
+    qint64 GetProcessCPUTime();
+    qint64 GetSQLQueryCount();
     QString HumanReadableSize(qint64 bytes);
     QString ParseDate(QString s);
     QString ParseTime(QString s);
@@ -69,6 +71,7 @@ namespace utils {
 
     /* file and directory operations */
     bool CopyFileToDir(QString f, QString dir);
+    bool StageFile(QString source, QString dest, qint64 &bytes, QString &m);
     bool MakePath(QString p, QString &msg, bool perm777=true);
     bool RemoveDir(QString p, QString &msg);
     QStringList FindAllFiles(QString dir, QString pattern, bool recursive=false);